@@ -122,9 +122,16 @@ struct AbismalAlign {
   uint16_t q_sz_max;
   uint16_t q_sz;
 
-  static const size_t max_off_diag = 30;
+  // how far the band extends on each side of the diagonal, which can
+  // be set before any aligner is made
+  static size_t max_off_diag;
+  static const size_t default_max_off_diag = 30;
 };
 
+template<score_t (*scr_fun)(const uint8_t, const uint8_t), score_t indel_pen>
+size_t AbismalAlign<scr_fun, indel_pen>::max_off_diag =
+  AbismalAlign<scr_fun, indel_pen>::default_max_off_diag;
+
 template<score_t (*scr_fun)(const uint8_t, const uint8_t), score_t indel_pen>
 void
 AbismalAlign<scr_fun, indel_pen>::reset(
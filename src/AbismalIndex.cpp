@@ -30,6 +30,17 @@
 #include <fstream>
 #include <utility>
 
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <omp.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <zlib.h>
+
 using std::pair;
 using std::make_pair;
 using std::ofstream;
@@ -47,28 +58,72 @@ using std::fill;
 using std::to_string;
 using std::max;
 
+uint32_t seed::window_size = seed::default_window_size;
+
+uint32_t seed::span_two = seed::key_weight;
+uint32_t seed::span_three = seed::key_weight_three;
+uint64_t seed::mask_two = (1ull << seed::key_weight) - 1;
+uint64_t seed::mask_three = (1ull << seed::key_weight_three) - 1;
+uint64_t seed::lanes_three = (1ull << (2*seed::key_weight_three)) - 1;
+
+const char *seed::default_pattern_two = "11101101111011011110111011101111";
+const char *seed::default_pattern_three = "11101101111011101111";
+
+// set in the key weight field of the index if the seeds are spaced,
+// so indexes with contiguous seeds are unchanged
+static const uint32_t spaced_seed_flag = 1u << 31;
+
 bool AbismalIndex::VERBOSE = false;
 string AbismalIndex::internal_identifier = "AbismalIndex";
+// same length as internal_identifier, so either can be recognized
+string AbismalIndex::compressed_identifier = "AbismalIndxZ";
 
 using genome_iterator = genome_four_bit_itr;
 
 void
-AbismalIndex::create_index(const string &genome_file) {
+AbismalIndex::create_index(const string &genome_file,
+                           const size_t first_chrom, const size_t last_chrom) {
+  build_phases.clear();
+  double phase_start = omp_get_wtime();
+
   vector<uint8_t> inflated_genome;
   if (VERBOSE)
     cerr << "[loading genome]" << endl;
-  load_genome(genome_file, inflated_genome, cl);
+  load_genome(genome_file, inflated_genome, cl, first_chrom, last_chrom);
+  phase_start = end_build_phase("load_genome", phase_start);
   encode_genome(inflated_genome);
   vector<uint8_t>().swap(inflated_genome);
+  phase_start = end_build_phase("encode_genome", phase_start);
 
   // creat genome-wide mask of positions to keep
   keep.resize(cl.get_genome_size());
   fill(begin(keep), end(keep), true);
 
-  select_two_letter_positions();
-  compress_dp();
-  hash_genome();
+  const bool spaced = seed::is_spaced();
+  if (spaced) select_two_letter_positions<true>();
+  else select_two_letter_positions<false>();
+  phase_start = end_build_phase("select_two_letter_positions", phase_start);
+
+  if (spaced) compress_dp<true>();
+  else compress_dp<false>();
+  phase_start = end_build_phase("compress_dp", phase_start);
+
+  if (spaced) hash_genome<true>();
+  else hash_genome<false>();
+  phase_start = end_build_phase("hash_genome", phase_start);
+
   sort_buckets();
+  end_build_phase("sort_buckets", phase_start);
+}
+
+double
+AbismalIndex::end_build_phase(const string &name, const double start_time) {
+  const double end_time = omp_get_wtime();
+  build_phases.push_back({name, end_time - start_time, get_peak_rss()});
+  if (VERBOSE)
+    cerr << "[" << name << ": " << end_time - start_time << "s, peak RSS: "
+         << get_peak_rss() << " bytes]" << endl;
+  return end_time;
 }
 
 
@@ -81,7 +136,7 @@ AbismalIndex::encode_genome(const vector<uint8_t> &input_genome) {
   encode_dna_four_bit(begin(input_genome), end(input_genome), begin(genome));
 }
 
-template<const bool use_mask>
+template<const bool use_mask, const bool spaced>
 void
 AbismalIndex::get_bucket_sizes() {
   counter.clear();
@@ -92,7 +147,7 @@ AbismalIndex::get_bucket_sizes() {
   counter.resize(counter_size + 1, 0);
 
   const size_t genome_st = seed::padding_size;
-  const size_t lim = cl.get_genome_size() - seed::key_weight - seed::padding_size;
+  const size_t lim = cl.get_genome_size() - seed::span_two - seed::padding_size;
   ProgressBar progress(lim, "counting " + to_string(seed::key_weight) +
                             "-bit words");
 
@@ -103,27 +158,28 @@ AbismalIndex::get_bucket_sizes() {
   genome_iterator gi(begin(genome));
   gi = gi + genome_st;
 
-  const auto gi_lim(gi + (seed::key_weight - 1));
-  uint32_t hash_key = 0;
+  const auto gi_lim(gi + (seed::span_two - 1));
+  two_letter_key<spaced> hash_key;
   while (gi != gi_lim)
-    shift_hash_key(*gi++, hash_key);
+    hash_key.shift(*gi++);
 
   for (size_t i = genome_st; i < lim; ++i) {
-    shift_hash_key(*gi++, hash_key);
+    hash_key.shift(*gi++);
 
     if (keep[i]) {
       if (VERBOSE && progress.time_to_report(i))
         progress.report(cerr, i);
 
       const bool count_base =  (!use_mask || is_two_letter[i]);
-      counter[hash_key] += count_base;
+      counter[hash_key.hash] += count_base;
     }
   }
   if (VERBOSE)
     progress.report(cerr, lim);
 }
 
-template<const three_conv_type the_conv, const bool use_mask> void
+template<const three_conv_type the_conv, const bool use_mask,
+         const bool spaced> void
 AbismalIndex::get_bucket_sizes_three() {
   counter_size_three = seed::hash_mask_three;
 
@@ -138,7 +194,7 @@ AbismalIndex::get_bucket_sizes_three() {
     counter_a.resize(counter_size_three + 1, 0);
 
   const size_t genome_st = seed::padding_size;
-  const size_t lim = cl.get_genome_size() - seed::key_weight_three - seed::padding_size;
+  const size_t lim = cl.get_genome_size() - seed::span_three - seed::padding_size;
   ProgressBar progress(lim, "counting " + to_string(seed::key_weight_three) +
                             "-3 letters");
 
@@ -149,13 +205,13 @@ AbismalIndex::get_bucket_sizes_three() {
   genome_iterator gi(begin(genome));
   gi = gi + genome_st;
 
-  const auto gi_lim(gi + (seed::key_weight_three - 1));
-  uint32_t hash_key = 0;
+  const auto gi_lim(gi + (seed::span_three - 1));
+  three_letter_key<the_conv, spaced> hash_key;
   while (gi != gi_lim)
-    shift_three_key<the_conv>(*gi++, hash_key);
+    hash_key.shift(*gi++);
 
   for (size_t i = genome_st; i < lim; ++i) {
-    shift_three_key<the_conv>(*gi++, hash_key);
+    hash_key.shift(*gi++);
     if (keep[i]) {
       if (VERBOSE && progress.time_to_report(i))
         progress.report(cerr, i);
@@ -163,44 +219,90 @@ AbismalIndex::get_bucket_sizes_three() {
       const bool count_base = (!use_mask || !is_two_letter[i]);
 
       if (the_conv == c_to_t)
-        counter_t[hash_key] += count_base;
+        counter_t[hash_key.hash] += count_base;
       else
-        counter_a[hash_key] += count_base;
+        counter_a[hash_key.hash] += count_base;
     }
   }
   if (VERBOSE)
     progress.report(cerr, lim);
 }
 
-inline uint32_t
-two_letter_cost(const uint32_t count) {
-  return (count);
+// a xorshift generator, so the benchmark does not depend on the
+// speed of the standard library generators
+static inline uint64_t
+next_random(uint64_t &x) {
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
 }
 
-inline uint32_t
-three_letter_cost(const uint32_t count_t, const uint32_t count_a) {
-  return ((count_t + count_a) >> 1);
+void
+AbismalIndex::calibrate_cost_model() {
+  // ADS: large enough that the times are not dominated by the timer,
+  // small enough to take a fraction of a second
+  static const size_t n_trials = 1000000;
+  // a typical read length in 4-bit words of 16 bases
+  static const size_t words_per_candidate = 150/16 + 1;
+
+  const size_t n_words = genome.size() - words_per_candidate;
+  uint64_t x = 88172645463325252ull;
+  size_t checksum = 0;
+
+  // verifying a candidate compares a read against the genome at a
+  // random position, usually stopping early, so only a few words
+  double start = omp_get_wtime();
+  for (size_t i = 0; i < n_trials; ++i) {
+    const size_t pos = next_random(x) % n_words;
+    const element_t read_word = next_random(x);
+    for (size_t j = 0; j < words_per_candidate; ++j)
+      checksum += __builtin_popcountll(genome[pos + j] & read_word);
+  }
+  const double candidate_time = omp_get_wtime() - start;
+
+  // a step of the binary search that narrows a large bucket reads one
+  // genome word at a random position of the bucket
+  start = omp_get_wtime();
+  for (size_t i = 0; i < n_trials; ++i)
+    checksum += genome[next_random(x) % n_words] & 5;
+  const double compare_time = omp_get_wtime() - start;
+
+  // keeps the loops from being removed by the compiler
+  if (checksum == 0)
+    cerr << "[cost model benchmark checksum: 0]" << endl;
+
+  const double denom = max(candidate_time, 1e-9);
+  cost_model.compare = min(1.0, compare_time/denom);
+  cost_model.max_candidates = default_max_candidates;
+
+  if (VERBOSE)
+    cerr << "[calibrated cost model: search step = "
+         << cost_model.compare << " candidates]" << endl;
 }
 
-void
+template<const bool spaced> void
 AbismalIndex::select_two_letter_positions() {
   // first get statistics on the full genome
 #pragma omp parallel for
   for (size_t i = 0; i < 3; ++i) {
     if (i == 0)
-      get_bucket_sizes<false>();
+      get_bucket_sizes<false, spaced>();
     if (i == 1)
-      get_bucket_sizes_three<c_to_t, false>();
+      get_bucket_sizes_three<c_to_t, false, spaced>();
     if (i == 2)
-      get_bucket_sizes_three<g_to_a, false >();
+      get_bucket_sizes_three<g_to_a, false, spaced>();
   }
 
+  if (calibrate_costs)
+    calibrate_cost_model();
+
   // now choose which have lower count under two-letters
   is_two_letter.resize(cl.get_genome_size());
   fill(begin(is_two_letter), end(is_two_letter), false);
 
   const size_t genome_st = seed::padding_size;
-  const size_t lim = cl.get_genome_size() - seed::key_weight - seed::padding_size;
+  const size_t lim = cl.get_genome_size() - seed::span_two - seed::padding_size;
   ProgressBar progress(lim, "building hybrid index");
 
   if (VERBOSE)
@@ -212,33 +314,33 @@ AbismalIndex::select_two_letter_positions() {
   gi_two = gi_two + genome_st;
   gi_three = gi_three + genome_st;
 
-  uint32_t hash_two = 0;
-  uint32_t hash_t = 0;
-  uint32_t hash_a = 0;
+  two_letter_key<spaced> hash_two;
+  three_letter_key<c_to_t, spaced> hash_t;
+  three_letter_key<g_to_a, spaced> hash_a;
 
-  const auto gi_lim_two(gi_two + (seed::key_weight - 1));
-  const auto gi_lim_three(gi_three + (seed::key_weight_three - 1));
+  const auto gi_lim_two(gi_two + (seed::span_two - 1));
+  const auto gi_lim_three(gi_three + (seed::span_three - 1));
   while (gi_two != gi_lim_two) {
-    shift_hash_key(*gi_two++, hash_two);
+    hash_two.shift(*gi_two++);
   }
 
   while (gi_three != gi_lim_three) {
-    shift_three_key<c_to_t>(*gi_three, hash_t);
-    shift_three_key<g_to_a>(*gi_three, hash_a);
+    hash_t.shift(*gi_three);
+    hash_a.shift(*gi_three);
     ++gi_three;
   }
 
   for (size_t i = genome_st; i < lim; ++i, ++gi_two, ++gi_three) {
-    shift_hash_key(*gi_two, hash_two);
-    shift_three_key<c_to_t>(*gi_three, hash_t);
-    shift_three_key<g_to_a>(*gi_three, hash_a);
+    hash_two.shift(*gi_two);
+    hash_t.shift(*gi_three);
+    hash_a.shift(*gi_three);
 
     if (VERBOSE && progress.time_to_report(i))
       progress.report(cerr, i);
 
     is_two_letter[i] = (
-      two_letter_cost(counter[hash_two]) <=
-      three_letter_cost(counter_t[hash_t], counter_a[hash_a])
+      cost_model.two_letter_cost(counter[hash_two.hash]) <=
+      cost_model.three_letter_cost(counter_t[hash_t.hash], counter_a[hash_a.hash])
     );
   }
   if (VERBOSE)
@@ -246,18 +348,18 @@ AbismalIndex::select_two_letter_positions() {
 
 }
 
-void
+template<const bool spaced> void
 AbismalIndex::hash_genome() {
 
   // count k-mers under each encoding with masking
 #pragma omp parallel for
   for (size_t i = 0; i < 3; ++i) {
     if (i == 0)
-    get_bucket_sizes<true>();
+    get_bucket_sizes<true, spaced>();
     else if (i == 1)
-      get_bucket_sizes_three<c_to_t, true>();
+      get_bucket_sizes_three<c_to_t, true, spaced>();
     else if (i == 2)
-      get_bucket_sizes_three<g_to_a,  true>();
+      get_bucket_sizes_three<g_to_a, true, spaced>();
   }
 
   if (VERBOSE)
@@ -277,7 +379,7 @@ AbismalIndex::hash_genome() {
     cerr << "[index sizes: " << index_size << " " << index_size_three << "]\n";
 
   const size_t genome_st = seed::padding_size;
-  const size_t lim = cl.get_genome_size() - seed::key_weight - seed::padding_size;
+  const size_t lim = cl.get_genome_size() - seed::span_two - seed::padding_size;
   ProgressBar progress(lim, "hashing genome");
 
   // start building up the hash key
@@ -286,37 +388,37 @@ AbismalIndex::hash_genome() {
   gi_two = gi_two + genome_st;
   gi_three = gi_three + genome_st;
 
-  const auto gi_lim_two(gi_two + (seed::key_weight - 1));
-  const auto gi_lim_three(gi_three + (seed::key_weight_three - 1));
+  const auto gi_lim_two(gi_two + (seed::span_two - 1));
+  const auto gi_lim_three(gi_three + (seed::span_three - 1));
 
-  uint32_t hash_two = 0;
-  uint32_t hash_t = 0;
-  uint32_t hash_a = 0;
+  two_letter_key<spaced> hash_two;
+  three_letter_key<c_to_t, spaced> hash_t;
+  three_letter_key<g_to_a, spaced> hash_a;
 
   while (gi_two != gi_lim_two) {
-    shift_hash_key(*gi_two++, hash_two);
+    hash_two.shift(*gi_two++);
   }
 
   while (gi_three != gi_lim_three) {
-    shift_three_key<c_to_t>(*gi_three, hash_t);
-    shift_three_key<g_to_a>(*gi_three, hash_a);
+    hash_t.shift(*gi_three);
+    hash_a.shift(*gi_three);
     ++gi_three;
   }
 
   for (size_t i = genome_st; i < lim; ++i, ++gi_two, ++gi_three) {
-    shift_hash_key(*gi_two, hash_two);
-    shift_three_key<c_to_t>(*gi_three, hash_t);
-    shift_three_key<g_to_a>(*gi_three, hash_a);
+    hash_two.shift(*gi_two);
+    hash_t.shift(*gi_three);
+    hash_a.shift(*gi_three);
 
     if (keep[i]) {
       if (VERBOSE && progress.time_to_report(i))
         progress.report(cerr, i);
 
       if (is_two_letter[i])
-        index[--counter[hash_two]] = i;
+        index[--counter[hash_two.hash]] = i;
       else {
-        index_t[--counter_t[hash_t]] = i;
-        index_a[--counter_a[hash_a]] = i;
+        index_t[--counter_t[hash_t.hash]] = i;
+        index_a[--counter_a[hash_a.hash]] = i;
       }
     }
   }
@@ -353,20 +455,20 @@ add_sol(deque<helper_sol> &helper, const uint32_t pos, const dp_sol &cand) {
 }
 
 inline uint32_t
-get_hybrid_cost(const bool is_two_letter,
+get_hybrid_cost(const index_cost_model &cost_model, const bool is_two_letter,
                 const uint32_t count_two,
                 const uint32_t count_t, const uint32_t count_a) {
-  return (is_two_letter ? two_letter_cost(count_two) :
-                          three_letter_cost(count_t, count_a));
+  return (is_two_letter ? cost_model.two_letter_cost(count_two) :
+                          cost_model.three_letter_cost(count_t, count_a));
 }
 
-void
+template<const bool spaced> void
 AbismalIndex::compress_dp() {
   // no position is indexed
   fill(begin(keep), end(keep), false);
 
   const size_t lim =
-    cl.get_genome_size() - seed::padding_size - seed::key_weight;
+    cl.get_genome_size() - seed::padding_size - seed::span_two;
 
   // the dp memory allocation
   static const size_t BLOCK_SIZE = 1000000;
@@ -377,9 +479,9 @@ AbismalIndex::compress_dp() {
 
   genome_iterator gi_two(begin(genome));
   genome_iterator gi_three(begin(genome));
-  uint32_t hash_two = 0;
-  uint32_t hash_t = 0;
-  uint32_t hash_a = 0;
+  two_letter_key<spaced> hash_two;
+  three_letter_key<c_to_t, spaced> hash_t;
+  three_letter_key<g_to_a, spaced> hash_a;
   size_t num_bases = 0;
 
   // fast forward padding positions
@@ -387,14 +489,14 @@ AbismalIndex::compress_dp() {
   gi_three = gi_three + seed::padding_size;
 
   // build the first hash key minus last base
-  const auto gi_lim_two(gi_three + (seed::key_weight - 1));
+  const auto gi_lim_two(gi_three + (seed::span_two - 1));
   while (gi_two != gi_lim_two)
-    shift_hash_key(*gi_two++, hash_two);
+    hash_two.shift(*gi_two++);
 
-  const auto gi_lim_three(gi_three + (seed::key_weight_three - 1));
+  const auto gi_lim_three(gi_three + (seed::span_three - 1));
   while (gi_three != gi_lim_three) {
-    shift_three_key<c_to_t>(*gi_three, hash_t);
-    shift_three_key<g_to_a>(*gi_three++, hash_a);
+    hash_t.shift(*gi_three);
+    hash_a.shift(*gi_three++);
   }
 
   size_t beg = seed::padding_size;
@@ -411,13 +513,13 @@ AbismalIndex::compress_dp() {
 
     // get the first w solutions
     for (size_t i = 0; i < seed::window_size; ++i) {
-      shift_hash_key(*gi_two++, hash_two);
-      shift_three_key<c_to_t>(*gi_three, hash_t);
-      shift_three_key<g_to_a>(*gi_three++, hash_a);
+      hash_two.shift(*gi_two++);
+      hash_t.shift(*gi_three);
+      hash_a.shift(*gi_three++);
 
       opt[i].cost =
-        get_hybrid_cost(is_two_letter[beg + i],
-            counter[hash_two], counter_t[hash_t], counter_a[hash_a]);
+        get_hybrid_cost(cost_model, is_two_letter[beg + i],
+            counter[hash_two.hash], counter_t[hash_t.hash], counter_a[hash_a.hash]);
       opt[i].prev = dp_sol::NIL;
       add_sol(helper, i, opt[i]);
     }
@@ -427,13 +529,13 @@ AbismalIndex::compress_dp() {
       if (VERBOSE && progress.time_to_report(beg + i))
         progress.report(cerr, beg + i);
 
-      shift_hash_key(*gi_two++, hash_two);
-      shift_three_key<c_to_t>(*gi_three, hash_t);
-      shift_three_key<g_to_a>(*gi_three++, hash_a);
+      hash_two.shift(*gi_two++);
+      hash_t.shift(*gi_three);
+      hash_a.shift(*gi_three++);
 
       opt[i].cost = helper.front().first.cost +
-        get_hybrid_cost(is_two_letter[beg + i],
-                         counter[hash_two], counter_t[hash_t], counter_a[hash_a]);
+        get_hybrid_cost(cost_model, is_two_letter[beg + i],
+                         counter[hash_two.hash], counter_t[hash_t.hash], counter_a[hash_a.hash]);
 
       opt[i].prev = helper.front().second;
       add_sol(helper, i, opt[i]);
@@ -463,10 +565,15 @@ AbismalIndex::compress_dp() {
   }
 
   // GS: this is a heuristic
-  max_candidates = 100u;
+  max_candidates = default_max_candidates;
   if (VERBOSE)
     progress.report(cerr, lim);
 
+  if (VERBOSE)
+    cerr << "[positions kept with window " << seed::window_size << ": "
+         << num_bases << " (" << (100.0*num_bases)/max(lim, 1ul)
+         << "% of genome)]" << endl;
+
 }
 
 struct BucketLess {
@@ -535,14 +642,117 @@ AbismalIndex::sort_buckets() {
       sort(b_a + counter_a[i], b_a + counter_a[i + 1], bucket_less_a);
     }
 }
+
+// merge the sorted buckets of two indexes over the same hash values,
+// where positions in other_index are already in the merged genome
+template<class bucket_less_type> static void
+merge_buckets(const size_t n_buckets, const bucket_less_type &bucket_less,
+              vector<uint32_t> &counter, vector<uint32_t> &index,
+              const vector<uint32_t> &other_counter,
+              const vector<uint32_t> &other_index) {
+  vector<uint32_t> merged_counter(n_buckets + 1);
+  for (size_t i = 0; i <= n_buckets; ++i)
+    merged_counter[i] = counter[i] + other_counter[i];
+
+  vector<uint32_t> merged_index(index.size() + other_index.size());
+#pragma omp parallel for
+  for (size_t i = 0; i < n_buckets; ++i)
+    merge(begin(index) + counter[i], begin(index) + counter[i + 1],
+          begin(other_index) + other_counter[i],
+          begin(other_index) + other_counter[i + 1],
+          begin(merged_index) + merged_counter[i], bucket_less);
+
+  counter.swap(merged_counter);
+  index.swap(merged_index);
+}
+
+void
+AbismalIndex::append(AbismalIndex &other) {
+  // other starts at a whole word, so its 4-bit encoding is unchanged
+  const size_t offset = genome.size()*16;
+  if (offset + other.cl.get_genome_size() >
+      std::numeric_limits<uint32_t>::max())
+    throw runtime_error("combined genomes too large for one index");
+
+  cl.append(other.cl, offset);
+
+  genome.insert(end(genome), begin(other.genome), end(other.genome));
+  Genome().swap(other.genome);
+
+#pragma omp parallel for
+  for (size_t i = 0; i < other.index.size(); ++i)
+    other.index[i] += offset;
+#pragma omp parallel for
+  for (size_t i = 0; i < other.index_t.size(); ++i)
+    other.index_t[i] += offset;
+#pragma omp parallel for
+  for (size_t i = 0; i < other.index_a.size(); ++i)
+    other.index_a[i] += offset;
+
+  merge_buckets(counter_size, BucketLess(genome), counter, index,
+                other.counter, other.index);
+  merge_buckets(counter_size_three, BucketLessThree<c_to_t>(genome),
+                counter_t, index_t, other.counter_t, other.index_t);
+  merge_buckets(counter_size_three, BucketLessThree<g_to_a>(genome),
+                counter_a, index_a, other.counter_a, other.index_a);
+  index_size = index.size();
+  index_size_three = index_t.size();
+
+  max_candidates = max(max_candidates, other.max_candidates);
+  other = AbismalIndex();
+}
+
 static void
-write_internal_identifier(FILE *out) {
-  if (fwrite((char*)&AbismalIndex::internal_identifier[0], 1,
-             AbismalIndex::internal_identifier.size(), out) !=
-      AbismalIndex::internal_identifier.size())
+write_internal_identifier(FILE *out,
+                          const string &id =
+                          AbismalIndex::internal_identifier) {
+  if (fwrite((char*)&id[0], 1, id.size(), out) != id.size())
     throw runtime_error("failed writing index identifier");
 }
 
+static uint64_t
+pattern_to_mask(const string &pattern, const uint32_t weight,
+                const uint32_t max_span) {
+  if (pattern.size() > max_span)
+    throw runtime_error("seed pattern longer than " + to_string(max_span) +
+                        ": " + pattern);
+  if (pattern.find_first_not_of("01") != string::npos ||
+      pattern.front() != '1' || pattern.back() != '1')
+    throw runtime_error("seed pattern must have only 0 and 1, beginning "
+                        "and ending with 1: " + pattern);
+  if (static_cast<uint32_t>(count(begin(pattern), end(pattern), '1')) !=
+      weight)
+    throw runtime_error("seed pattern must have " + to_string(weight) +
+                        " positions set: " + pattern);
+  uint64_t mask = 0;
+  for (size_t j = 0; j < pattern.size(); ++j)
+    mask = (mask << 1) | (pattern[j] == '1');
+  return mask;
+}
+
+// two bits for each bit of a three-letter mask
+static uint64_t
+mask_to_lanes(const uint64_t mask) {
+  uint64_t lanes = 0;
+  for (uint32_t j = 0; j < 32; ++j)
+    if ((mask >> j) & 1ull)
+      lanes |= 3ull << (2*j);
+  return lanes;
+}
+
+void
+seed::set_patterns(const string &pattern_two, const string &pattern_three) {
+  // ADS: three-letter spans are at most 32 bases, with 2 bits per base
+  mask_two = pattern_to_mask(pattern_two, key_weight, 64);
+  mask_three = pattern_to_mask(pattern_three, key_weight_three, 32);
+  lanes_three = mask_to_lanes(mask_three);
+  span_two = pattern_two.size();
+  span_three = pattern_three.size();
+  // both seeds are taken at the same positions of the read
+  if (span_three > span_two)
+    throw runtime_error("three-letter seed pattern longer than two-letter");
+}
+
 void seed::read(FILE* in) {
   static const std::string error_msg("failed to read seed data");
   uint32_t _key_weight;
@@ -553,6 +763,9 @@ void seed::read(FILE* in) {
   if (fread((char*)&_key_weight, sizeof(uint32_t), 1, in) != 1)
     throw runtime_error(error_msg);
 
+  const bool spaced = (_key_weight & spaced_seed_flag) != 0;
+  _key_weight &= ~spaced_seed_flag;
+
   if(_key_weight != key_weight) {
     throw runtime_error("inconsistent k-mer size. Expected: " +
         to_string(key_weight) + ", got: " + to_string(_key_weight));
@@ -562,10 +775,13 @@ void seed::read(FILE* in) {
   if (fread((char*)&_window_size, sizeof(uint32_t), 1, in) != 1)
     throw runtime_error(error_msg);
 
-  if (_window_size != window_size) {
-    throw runtime_error("inconsistent window size size. Expected: " +
-        to_string(window_size) + ", got: " + to_string(_window_size));
+  // the index determines the window used for mapping
+  if (_window_size == 0 || _window_size > default_window_size) {
+    throw runtime_error("inconsistent window size. Expected at most: " +
+        to_string(default_window_size) + ", got: " +
+        to_string(_window_size));
   }
+  window_size = _window_size;
 
   // n_sorting_positions
   if (fread((char*)&_n_sorting_positions, sizeof(uint32_t), 1, in) != 1)
@@ -576,59 +792,229 @@ void seed::read(FILE* in) {
         to_string(n_sorting_positions) + ", got: " +
         to_string(_n_sorting_positions));
   }
+
+  // spaced seed patterns
+  span_two = key_weight;
+  span_three = key_weight_three;
+  mask_two = (1ull << key_weight) - 1;
+  mask_three = (1ull << key_weight_three) - 1;
+  if (spaced) {
+    if (fread((char*)&span_two, sizeof(uint32_t), 1, in) != 1 ||
+        fread((char*)&span_three, sizeof(uint32_t), 1, in) != 1 ||
+        fread((char*)&mask_two, sizeof(uint64_t), 1, in) != 1 ||
+        fread((char*)&mask_three, sizeof(uint64_t), 1, in) != 1)
+      throw runtime_error(error_msg);
+    if (static_cast<uint32_t>(__builtin_popcountll(mask_two)) != key_weight ||
+        static_cast<uint32_t>(__builtin_popcountll(mask_three)) !=
+        key_weight_three ||
+        span_three > span_two || span_two > 64 || span_three > 32)
+      throw runtime_error("inconsistent spaced seed patterns");
+  }
+  lanes_three = mask_to_lanes(mask_three);
 }
 
 void seed::write(FILE*out) {
   static const std::string error_msg("failed to write seed data");
-  if (fwrite((char*)&seed::key_weight, sizeof(uint32_t), 1, out) != 1 ||
+  const uint32_t key_weight_field =
+    seed::key_weight | (is_spaced() ? spaced_seed_flag : 0u);
+  if (fwrite((char*)&key_weight_field, sizeof(uint32_t), 1, out) != 1 ||
       fwrite((char*)&seed::window_size, sizeof(uint32_t), 1, out) != 1 ||
       fwrite((char*)&seed::n_sorting_positions, sizeof(uint32_t), 1, out) != 1)
     throw runtime_error(error_msg);
+
+  if (is_spaced() &&
+      (fwrite((char*)&seed::span_two, sizeof(uint32_t), 1, out) != 1 ||
+       fwrite((char*)&seed::span_three, sizeof(uint32_t), 1, out) != 1 ||
+       fwrite((char*)&seed::mask_two, sizeof(uint64_t), 1, out) != 1 ||
+       fwrite((char*)&seed::mask_three, sizeof(uint64_t), 1, out) != 1))
+    throw runtime_error(error_msg);
+}
+
+// a range of the index file and where it is in memory
+struct file_range {
+  file_range(char *d, const size_t o, const size_t n) :
+    dest(d), offset(o), n_bytes(n) {}
+  char *dest;
+  size_t offset;
+  size_t n_bytes;
+};
+
+// sections are split so threads share the load of the large ones, both
+// when reading and writing
+static const size_t load_chunk_size = 64ul << 20;
+static const size_t direct_io_alignment = 4096;
+
+static void
+add_file_ranges(char *dest, const size_t offset, const size_t n_bytes,
+                vector<file_range> &ranges) {
+  for (size_t i = 0; i < n_bytes; i += load_chunk_size)
+    ranges.push_back(file_range(dest + i, offset + i,
+                                min(load_chunk_size, n_bytes - i)));
+}
+
+// writes a range of the file from memory, as read_file_range reads it
+static void
+write_file_range(const int fd, const file_range &r) {
+  size_t n_done = 0;
+  while (n_done < r.n_bytes) {
+    const ssize_t ret =
+      pwrite(fd, r.dest + n_done, r.n_bytes - n_done, r.offset + n_done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      throw runtime_error("failed writing index");
+    n_done += ret;
+  }
+}
+
+// an index is written to this name until it is complete; the process
+// id keeps apart two programs writing the same index
+static string
+temporary_index_name(const string &index_file) {
+  return index_file + ".tmp." + to_string(getpid());
+}
+
+// gives a complete file, already synced, its final name. Readers see
+// either the previous file or the new one, never a partial file
+static void
+publish_index(const string &tmp_file, const string &index_file) {
+  if (rename(tmp_file.c_str(), index_file.c_str()) != 0)
+    throw runtime_error("cannot rename " + tmp_file + " to " + index_file);
+  // ADS: the rename is only durable once the directory is synced, but
+  // not all systems allow it, so failing here is not an error
+  const size_t slash = index_file.find_last_of('/');
+  const string dir = (slash == string::npos) ? "." :
+    index_file.substr(0, max(slash, static_cast<size_t>(1)));
+  const int dir_fd = open(dir.c_str(), O_RDONLY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
 }
 
 void
-AbismalIndex::write(const string &index_file) const {
+AbismalIndex::write(const string &index_file, const int n_threads) const {
 
-  FILE *out = fopen(index_file.c_str(), "wb");
+  static const string error_msg("failed writing index");
+
+  const string tmp_file = temporary_index_name(index_file);
+  FILE *out = fopen(tmp_file.c_str(), "wb");
   if (!out)
     throw runtime_error("cannot open output file " + index_file);
 
-  write_internal_identifier(out);
-  seed::write(out);
-  cl.write(out);
+  int fd = -1;
+  try {
+    // the header is small, and the sections after it are written by
+    // all threads at their offsets, in the order read_parallel expects
+    write_internal_identifier(out);
+    seed::write(out);
+    cl.write(out);
+    const long genome_offset = ftell(out);
+    const int status = fclose(out);
+    out = nullptr;
+    if (genome_offset < 0 || status != 0)
+      throw runtime_error(error_msg);
 
-  if (fwrite((char*)&genome[0], sizeof(element_t), genome.size(), out) != genome.size() ||
-      fwrite((char*)&max_candidates, sizeof(uint32_t), 1, out) != 1 ||
-      fwrite((char*)&counter_size, sizeof(size_t), 1, out) != 1 ||
-      fwrite((char*)&counter_size_three, sizeof(size_t), 1, out) != 1 ||
-      fwrite((char*)&index_size, sizeof(size_t), 1, out) != 1 ||
-      fwrite((char*)&index_size_three, sizeof(size_t), 1, out) != 1 ||
-      fwrite((char*)(&counter[0]), sizeof(uint32_t),
-             counter_size + 1, out) != (counter_size + 1) ||
-      fwrite((char*)(&counter_t[0]), sizeof(uint32_t),
-             counter_size_three + 1, out) != (counter_size_three + 1) ||
-      fwrite((char*)(&counter_a[0]), sizeof(uint32_t),
-             counter_size_three + 1, out) != (counter_size_three + 1) ||
-
-      fwrite((char*)(&index[0]), sizeof(uint32_t),
-             index_size, out) != (index_size) ||
-      fwrite((char*)(&index_t[0]), sizeof(uint32_t),
-             index_size_three, out) != (index_size_three) ||
-      fwrite((char*)(&index_a[0]), sizeof(uint32_t),
-             index_size_three, out) != (index_size_three))
-    throw runtime_error("failed writing index");
+    const size_t sizes_bytes = sizeof(uint32_t) + 4*sizeof(size_t);
+    char sizes[sizes_bytes];
+    char *sizes_itr = sizes;
+    memcpy(sizes_itr, &max_candidates, sizeof(uint32_t));
+    sizes_itr += sizeof(uint32_t);
+    memcpy(sizes_itr, &counter_size, sizeof(size_t));
+    sizes_itr += sizeof(size_t);
+    memcpy(sizes_itr, &counter_size_three, sizeof(size_t));
+    sizes_itr += sizeof(size_t);
+    memcpy(sizes_itr, &index_size, sizeof(size_t));
+    sizes_itr += sizeof(size_t);
+    memcpy(sizes_itr, &index_size_three, sizeof(size_t));
+
+    // ADS: file_range is shared with reading, so its pointers are
+    // non-const, but nothing is written to memory here
+    vector<pair<char*, size_t> > sections;
+    sections.push_back(make_pair((char*)genome.data(),
+                                 genome.size()*sizeof(element_t)));
+    sections.push_back(make_pair(sizes, sizes_bytes));
+    sections.push_back(make_pair((char*)counter.data(),
+                                 (counter_size + 1)*sizeof(uint32_t)));
+    sections.push_back(make_pair((char*)counter_t.data(),
+                                 (counter_size_three + 1)*sizeof(uint32_t)));
+    sections.push_back(make_pair((char*)counter_a.data(),
+                                 (counter_size_three + 1)*sizeof(uint32_t)));
+    sections.push_back(make_pair((char*)index.data(),
+                                 index_size*sizeof(uint32_t)));
+    sections.push_back(make_pair((char*)index_t.data(),
+                                 index_size_three*sizeof(uint32_t)));
+    sections.push_back(make_pair((char*)index_a.data(),
+                                 index_size_three*sizeof(uint32_t)));
+
+    vector<file_range> ranges;
+    size_t offset = genome_offset;
+    for (size_t i = 0; i < sections.size(); ++i) {
+      add_file_ranges(sections[i].first, offset, sections[i].second, ranges);
+      offset += sections[i].second;
+    }
+    const size_t file_size = offset;
+
+    fd = open(tmp_file.c_str(), O_WRONLY);
+    if (fd < 0)
+      throw runtime_error("cannot open output file " + index_file);
+
+    // all blocks are allocated before threads write at their offsets,
+    // which would otherwise fragment the file on some file systems
+#if defined(__linux__)
+    const bool allocated = (posix_fallocate(fd, 0, file_size) == 0);
+#else
+    const bool allocated = false;
+#endif
+    if (!allocated && ftruncate(fd, file_size) != 0)
+      throw runtime_error(error_msg);
 
-  if (fclose(out) != 0)
-    throw runtime_error("problem closing file: " + index_file);
+    bool failed = false;
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic)
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      // exceptions cannot leave the parallel region
+      try {
+        write_file_range(fd, ranges[i]);
+      }
+      catch (const runtime_error &) {
+#pragma omp atomic write
+        failed = true;
+      }
+    }
+    if (failed)
+      throw runtime_error(error_msg);
+
+    if (fsync(fd) != 0)
+      throw runtime_error(error_msg);
+    const int fd_status = close(fd);
+    fd = -1;
+    if (fd_status != 0)
+      throw runtime_error("problem closing file: " + index_file);
+
+    publish_index(tmp_file, index_file);
+  }
+  catch (const runtime_error &) {
+    if (out)
+      fclose(out);
+    if (fd >= 0)
+      close(fd);
+    remove(tmp_file.c_str());
+    throw;
+  }
 }
 
-static bool
-check_internal_identifier(FILE *in) {
+static string
+read_internal_identifier(FILE *in) {
   string id_found;
   while (id_found.size() < AbismalIndex::internal_identifier.size())
     id_found.push_back(getc(in));
+  return id_found;
+}
 
-  return (id_found == AbismalIndex::internal_identifier);
+static bool
+check_internal_identifier(const string &id_found) {
+  return (id_found == AbismalIndex::internal_identifier ||
+          id_found == AbismalIndex::compressed_identifier);
 }
 
 
@@ -641,12 +1027,20 @@ AbismalIndex::read(const string &index_file) {
   if (!in)
     throw runtime_error("cannot open input file " + index_file);
 
-  if (!check_internal_identifier(in))
+  const string id_found = read_internal_identifier(in);
+  if (!check_internal_identifier(id_found))
     throw runtime_error("index file format problem: " + index_file);
 
   seed::read(in);
   cl.read(in);
 
+  if (id_found == compressed_identifier) {
+    read_compressed(in);
+    if (fclose(in) != 0)
+      throw runtime_error("problem closing file: " + index_file);
+    return;
+  }
+
   const size_t genome_to_read = (cl.get_genome_size() + 15)/16;
   // read the 4-bit encoded genome
   genome.resize(genome_to_read);
@@ -698,6 +1092,57 @@ AbismalIndex::read(const string &index_file) {
     throw runtime_error("problem closing file: " + index_file);
 }
 
+void
+ChromLookup::append(const ChromLookup &other, const size_t offset) {
+  // ADS: the pad_end entry of this genome becomes the padding between
+  // the two genomes, which maps to no target in the output
+  ChromLookup merged;
+  if (tids.empty()) {
+    tids.push_back(-1);
+    for (size_t i = 1; i + 1 < names.size(); ++i)
+      tids.push_back(i - 1);
+    tids.push_back(-1);
+  }
+  const int32_t n_tids =
+    count_if(begin(tids), end(tids), [](const int32_t t) {
+      return t >= 0;
+    });
+  merged.names.assign(begin(names), end(names) - 1);
+  merged.starts.assign(begin(starts), end(starts) - 2);
+  merged.tids.assign(begin(tids), end(tids) - 1);
+
+  merged.names.push_back("pad_between");
+  merged.starts.push_back(starts[starts.size() - 2]);
+  merged.tids.push_back(-1);
+
+  for (size_t i = 1; i + 1 < other.names.size(); ++i) {
+    merged.names.push_back(other.names[i]);
+    merged.starts.push_back(offset + other.starts[i]);
+    merged.tids.push_back(n_tids + i - 1);
+  }
+  merged.names.push_back(other.names.back());
+  merged.starts.push_back(offset + other.starts[other.starts.size() - 2]);
+  merged.starts.push_back(offset + other.starts.back());
+  merged.tids.push_back(-1);
+  *this = merged;
+}
+
+void
+AbismalIndex::read_chrom_lookup(const string &index_file, ChromLookup &cl) {
+  FILE *in = fopen(index_file.c_str(), "rb");
+  if (!in)
+    throw runtime_error("cannot open input file " + index_file);
+
+  const string id_found = read_internal_identifier(in);
+  if (!check_internal_identifier(id_found))
+    throw runtime_error("index file format problem: " + index_file);
+
+  seed::read(in);
+  cl.read(in);
+  if (fclose(in) != 0)
+    throw runtime_error("problem closing file: " + index_file);
+}
+
 std::ostream &
 ChromLookup::write(std::ostream &out) const {
   const uint32_t n_chroms = names.size();
@@ -838,6 +1283,480 @@ ChromLookup::get_pos(const string &chrom, const uint32_t offset) const {
     std::numeric_limits<uint32_t>::max() : starts[itr - begin(names)] + offset;
 }
 
+// uncompressed size of each block in a compressed index
+static const size_t compressed_block_size = 4ul << 20;
+
+// one section of the index as stored on disk
+struct index_section {
+  index_section(char *d, const size_t n, const bool dt) :
+    data(d), n_bytes(n), delta(dt) {}
+  char *data;
+  size_t n_bytes;
+  // the counters are monotone, and compress much better as the
+  // differences between consecutive values
+  bool delta;
+};
+
+static void
+delta_encode(uint32_t *v, const size_t n) {
+  for (size_t i = n; i > 1; --i)
+    v[i - 1] -= v[i - 2];
+}
+
+static void
+delta_decode(uint32_t *v, const size_t n) {
+  for (size_t i = 1; i < n; ++i)
+    v[i] += v[i - 1];
+}
+
+// blocks are compressed in parallel, and each block is delta encoded
+// on its own so it can also be decompressed independently
+static void
+write_compressed_section(const index_section &sec, FILE *out) {
+  const size_t n_blocks =
+    (sec.n_bytes + compressed_block_size - 1)/compressed_block_size;
+  vector<vector<Bytef> > blocks(n_blocks);
+  bool failed = false;
+
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < n_blocks; ++i) {
+    const size_t offset = i*compressed_block_size;
+    const size_t n_bytes = min(compressed_block_size, sec.n_bytes - offset);
+    vector<uint32_t> delta_buf;
+    const Bytef *src = reinterpret_cast<const Bytef*>(sec.data + offset);
+    if (sec.delta) {
+      delta_buf.resize(n_bytes/sizeof(uint32_t));
+      memcpy(&delta_buf[0], src, n_bytes);
+      delta_encode(&delta_buf[0], delta_buf.size());
+      src = reinterpret_cast<const Bytef*>(&delta_buf[0]);
+    }
+    uLongf n_compressed = compressBound(n_bytes);
+    blocks[i].resize(n_compressed);
+    if (compress2(&blocks[i][0], &n_compressed, src, n_bytes,
+                  Z_DEFAULT_COMPRESSION) != Z_OK) {
+#pragma omp atomic write
+      failed = true;
+    }
+    blocks[i].resize(n_compressed);
+  }
+  if (failed)
+    throw runtime_error("failed compressing index");
+
+  const uint64_t n_blocks_out = n_blocks;
+  if (fwrite((char*)&n_blocks_out, sizeof(uint64_t), 1, out) != 1)
+    throw runtime_error("failed writing index");
+  for (size_t i = 0; i < n_blocks; ++i) {
+    const uint64_t n_compressed = blocks[i].size();
+    if (fwrite((char*)&n_compressed, sizeof(uint64_t), 1, out) != 1)
+      throw runtime_error("failed writing index");
+  }
+  for (size_t i = 0; i < n_blocks; ++i)
+    if (fwrite((char*)&blocks[i][0], 1, blocks[i].size(), out) !=
+        blocks[i].size())
+      throw runtime_error("failed writing index");
+}
+
+// the compressed section is read at once, then its blocks are
+// decompressed by all threads directly into the section
+static void
+read_compressed_section(const index_section &sec, FILE *in) {
+  static const string error_msg("failed loading index file");
+
+  uint64_t n_blocks = 0;
+  if (fread((char*)&n_blocks, sizeof(uint64_t), 1, in) != 1 ||
+      n_blocks != (sec.n_bytes + compressed_block_size - 1)/
+      compressed_block_size)
+    throw runtime_error(error_msg);
+
+  vector<uint64_t> block_start(n_blocks + 1, 0);
+  for (size_t i = 0; i < n_blocks; ++i) {
+    uint64_t n_compressed = 0;
+    if (fread((char*)&n_compressed, sizeof(uint64_t), 1, in) != 1)
+      throw runtime_error(error_msg);
+    block_start[i + 1] = block_start[i] + n_compressed;
+  }
+
+  vector<Bytef> compressed(block_start.back());
+  if (!compressed.empty() &&
+      fread((char*)&compressed[0], 1, compressed.size(), in) !=
+      compressed.size())
+    throw runtime_error(error_msg);
+
+  bool failed = false;
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < n_blocks; ++i) {
+    const size_t offset = i*compressed_block_size;
+    const size_t n_bytes = min(compressed_block_size, sec.n_bytes - offset);
+    uLongf n_uncompressed = n_bytes;
+    Bytef *dest = reinterpret_cast<Bytef*>(sec.data + offset);
+    if (uncompress(dest, &n_uncompressed, &compressed[block_start[i]],
+                   block_start[i + 1] - block_start[i]) != Z_OK ||
+        n_uncompressed != n_bytes) {
+#pragma omp atomic write
+      failed = true;
+    }
+    else if (sec.delta)
+      delta_decode(reinterpret_cast<uint32_t*>(dest),
+                   n_bytes/sizeof(uint32_t));
+  }
+  if (failed)
+    throw runtime_error(error_msg);
+}
+
+static vector<index_section>
+get_index_sections(Genome &genome,
+                   vector<uint32_t> &counter, vector<uint32_t> &counter_t,
+                   vector<uint32_t> &counter_a, vector<uint32_t> &index,
+                   vector<uint32_t> &index_t, vector<uint32_t> &index_a) {
+  vector<index_section> sections;
+  sections.push_back(index_section((char*)genome.data(),
+                                   genome.size()*sizeof(element_t), false));
+  sections.push_back(index_section((char*)counter.data(),
+                                   counter.size()*sizeof(uint32_t), true));
+  sections.push_back(index_section((char*)counter_t.data(),
+                                   counter_t.size()*sizeof(uint32_t), true));
+  sections.push_back(index_section((char*)counter_a.data(),
+                                   counter_a.size()*sizeof(uint32_t), true));
+  sections.push_back(index_section((char*)index.data(),
+                                   index.size()*sizeof(uint32_t), false));
+  sections.push_back(index_section((char*)index_t.data(),
+                                   index_t.size()*sizeof(uint32_t), false));
+  sections.push_back(index_section((char*)index_a.data(),
+                                   index_a.size()*sizeof(uint32_t), false));
+  return sections;
+}
+
+void
+AbismalIndex::write_compressed(const string &index_file) const {
+  const string tmp_file = temporary_index_name(index_file);
+  FILE *out = fopen(tmp_file.c_str(), "wb");
+  if (!out)
+    throw runtime_error("cannot open output file " + index_file);
+
+  try {
+    write_compressed(out);
+    const bool synced = (fflush(out) == 0 && fsync(fileno(out)) == 0);
+    const int status = fclose(out);
+    out = nullptr;
+    if (!synced || status != 0)
+      throw runtime_error("problem closing file: " + index_file);
+    publish_index(tmp_file, index_file);
+  }
+  catch (const runtime_error &) {
+    if (out)
+      fclose(out);
+    remove(tmp_file.c_str());
+    throw;
+  }
+}
+
+void
+AbismalIndex::write_compressed(FILE *out) const {
+
+  write_internal_identifier(out, compressed_identifier);
+  seed::write(out);
+  cl.write(out);
+
+  const uint64_t block_size = compressed_block_size;
+  if (fwrite((char*)&max_candidates, sizeof(uint32_t), 1, out) != 1 ||
+      fwrite((char*)&counter_size, sizeof(size_t), 1, out) != 1 ||
+      fwrite((char*)&counter_size_three, sizeof(size_t), 1, out) != 1 ||
+      fwrite((char*)&index_size, sizeof(size_t), 1, out) != 1 ||
+      fwrite((char*)&index_size_three, sizeof(size_t), 1, out) != 1 ||
+      fwrite((char*)&block_size, sizeof(uint64_t), 1, out) != 1)
+    throw runtime_error("failed writing index");
+
+  // ADS: sections are not modified, the pointers are only non-const
+  // because the same list is used when reading
+  AbismalIndex &self = const_cast<AbismalIndex&>(*this);
+  const vector<index_section> sections =
+    get_index_sections(self.genome, self.counter, self.counter_t,
+                       self.counter_a, self.index, self.index_t,
+                       self.index_a);
+  for (size_t i = 0; i < sections.size(); ++i)
+    write_compressed_section(sections[i], out);
+}
+
+void
+AbismalIndex::read_compressed(FILE *in) {
+  static const string error_msg("failed loading index file");
+
+  uint64_t block_size = 0;
+  if (fread((char*)&max_candidates, sizeof(uint32_t), 1, in) != 1 ||
+      fread((char*)&counter_size, sizeof(size_t), 1, in) != 1 ||
+      fread((char*)&counter_size_three, sizeof(size_t), 1, in) != 1 ||
+      fread((char*)&index_size, sizeof(size_t), 1, in) != 1 ||
+      fread((char*)&index_size_three, sizeof(size_t), 1, in) != 1 ||
+      fread((char*)&block_size, sizeof(uint64_t), 1, in) != 1)
+    throw runtime_error(error_msg);
+
+  if (block_size != compressed_block_size)
+    throw runtime_error("unexpected block size in compressed index: " +
+                        to_string(block_size));
+
+  genome.resize((cl.get_genome_size() + 15)/16);
+  counter = vector<uint32_t>(counter_size + 1);
+  counter_t = vector<uint32_t>(counter_size_three + 1);
+  counter_a = vector<uint32_t>(counter_size_three + 1);
+  index = vector<uint32_t>(index_size);
+  index_t = vector<uint32_t>(index_size_three);
+  index_a = vector<uint32_t>(index_size_three);
+
+  const vector<index_section> sections =
+    get_index_sections(genome, counter, counter_t, counter_a,
+                       index, index_t, index_a);
+  for (size_t i = 0; i < sections.size(); ++i)
+    read_compressed_section(sections[i], in);
+}
+
+// reads a range of the file in place; buffer is null unless O_DIRECT
+// is used, in which case offsets, sizes and memory must be aligned, so
+// the aligned blocks covering the range are read into buffer first
+static void
+read_file_range(const int fd, const file_range &r, char *buffer) {
+  const size_t start = buffer ?
+    r.offset/direct_io_alignment*direct_io_alignment : r.offset;
+  const size_t n_needed = r.offset + r.n_bytes - start;
+  const size_t n_request = buffer ?
+    (n_needed + direct_io_alignment - 1)/direct_io_alignment*
+    direct_io_alignment : n_needed;
+  char *target = buffer ? buffer : r.dest;
+
+  size_t n_done = 0;
+  while (n_done < n_needed) {
+    const ssize_t ret =
+      pread(fd, target + n_done, n_request - n_done, start + n_done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      throw runtime_error("failed loading index file");
+    n_done += ret;
+  }
+  if (buffer)
+    memcpy(r.dest, buffer + (r.offset - start), r.n_bytes);
+}
+
+void
+AbismalIndex::read_parallel(const string &index_file, const int n_threads,
+                            const bool direct_io) {
+
+  static const string error_msg("failed loading index file");
+
+  // the header is small, and is parsed as in AbismalIndex::read
+  FILE *in = fopen(index_file.c_str(), "rb");
+  if (!in)
+    throw runtime_error("cannot open input file " + index_file);
+
+  const string id_found = read_internal_identifier(in);
+  if (!check_internal_identifier(id_found))
+    throw runtime_error("index file format problem: " + index_file);
+
+  // compressed indexes are read with parallel decompression instead
+  if (id_found == compressed_identifier) {
+    fclose(in);
+    read(index_file);
+    return;
+  }
+
+  seed::read(in);
+  cl.read(in);
+  const size_t genome_offset = ftell(in);
+  if (fclose(in) != 0)
+    throw runtime_error("problem closing file: " + index_file);
+
+  const int fd = open(index_file.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error("cannot open input file " + index_file);
+
+  const size_t genome_to_read = (cl.get_genome_size() + 15)/16;
+  const size_t genome_bytes = genome_to_read*sizeof(element_t);
+
+  // sizes of the counter and index vectors follow the genome
+  const size_t sizes_bytes = sizeof(uint32_t) + 4*sizeof(size_t);
+  char sizes[sizes_bytes];
+  read_file_range(fd, file_range(sizes, genome_offset + genome_bytes,
+                                 sizes_bytes), nullptr);
+  char *sizes_itr = sizes;
+  memcpy(&max_candidates, sizes_itr, sizeof(uint32_t));
+  sizes_itr += sizeof(uint32_t);
+  memcpy(&counter_size, sizes_itr, sizeof(size_t));
+  sizes_itr += sizeof(size_t);
+  memcpy(&counter_size_three, sizes_itr, sizeof(size_t));
+  sizes_itr += sizeof(size_t);
+  memcpy(&index_size, sizes_itr, sizeof(size_t));
+  sizes_itr += sizeof(size_t);
+  memcpy(&index_size_three, sizes_itr, sizeof(size_t));
+
+  genome.resize(genome_to_read);
+  counter = vector<uint32_t>(counter_size + 1);
+  counter_t = vector<uint32_t>(counter_size_three + 1);
+  counter_a = vector<uint32_t>(counter_size_three + 1);
+  index = vector<uint32_t>(index_size);
+  index_t = vector<uint32_t>(index_size_three);
+  index_a = vector<uint32_t>(index_size_three);
+
+  // sections in the order they are in the file, after the sizes
+  vector<pair<char*, size_t> > sections;
+  sections.push_back(make_pair((char*)&counter[0],
+                               counter.size()*sizeof(uint32_t)));
+  sections.push_back(make_pair((char*)&counter_t[0],
+                               counter_t.size()*sizeof(uint32_t)));
+  sections.push_back(make_pair((char*)&counter_a[0],
+                               counter_a.size()*sizeof(uint32_t)));
+  sections.push_back(make_pair((char*)&index[0],
+                               index.size()*sizeof(uint32_t)));
+  sections.push_back(make_pair((char*)&index_t[0],
+                               index_t.size()*sizeof(uint32_t)));
+  sections.push_back(make_pair((char*)&index_a[0],
+                               index_a.size()*sizeof(uint32_t)));
+
+  vector<file_range> ranges;
+  add_file_ranges((char*)&genome[0], genome_offset, genome_bytes, ranges);
+  size_t offset = genome_offset + genome_bytes + sizes_bytes;
+  for (size_t i = 0; i < sections.size(); ++i) {
+    add_file_ranges(sections[i].first, offset, sections[i].second, ranges);
+    offset += sections[i].second;
+  }
+
+  int read_fd = fd;
+  bool use_buffers = false;
+  if (direct_io) {
+#if defined(O_DIRECT)
+    read_fd = open(index_file.c_str(), O_RDONLY | O_DIRECT);
+    use_buffers = (read_fd >= 0);
+    if (read_fd < 0) {
+      // ADS: some file systems (e.g. tmpfs) do not support O_DIRECT
+      if (VERBOSE)
+        cerr << "[O_DIRECT not supported, using buffered reads]" << endl;
+      read_fd = fd;
+    }
+#elif defined(F_NOCACHE)
+    // macOS: no alignment is needed to bypass the cache
+    fcntl(fd, F_NOCACHE, 1);
+#endif
+  }
+
+  bool failed = false;
+#pragma omp parallel num_threads(n_threads)
+  {
+    void *buffer = nullptr;
+    if (use_buffers &&
+        posix_memalign(&buffer, direct_io_alignment,
+                       load_chunk_size + 2*direct_io_alignment) != 0)
+      buffer = nullptr;
+    const bool have_buffer = !use_buffers || buffer;
+
+#pragma omp for schedule(dynamic)
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      // exceptions cannot leave the parallel region
+      try {
+        if (!have_buffer)
+          throw runtime_error(error_msg);
+        read_file_range(read_fd, ranges[i], static_cast<char*>(buffer));
+      }
+      catch (const runtime_error &) {
+#pragma omp atomic write
+        failed = true;
+      }
+    }
+    free(buffer);
+  }
+
+  if (read_fd != fd)
+    close(read_fd);
+  if (close(fd) != 0)
+    throw runtime_error("problem closing file: " + index_file);
+  if (failed)
+    throw runtime_error(error_msg);
+}
+
+size_t
+ChromLookup::memory_bytes() const {
+  size_t n_bytes = names.capacity()*sizeof(string) +
+    starts.capacity()*sizeof(uint32_t) + tids.capacity()*sizeof(int32_t);
+  for (auto it(begin(names)); it != end(names); ++it)
+    n_bytes += it->capacity();
+  return n_bytes;
+}
+
+vector<pair<string, size_t> >
+AbismalIndex::memory_usage() const {
+  vector<pair<string, size_t> > usage;
+  usage.push_back(make_pair("genome", genome.capacity()*sizeof(element_t)));
+  usage.push_back(make_pair("counter", counter.capacity()*sizeof(uint32_t)));
+  usage.push_back(make_pair("counter_t",
+                            counter_t.capacity()*sizeof(uint32_t)));
+  usage.push_back(make_pair("counter_a",
+                            counter_a.capacity()*sizeof(uint32_t)));
+  usage.push_back(make_pair("index", index.capacity()*sizeof(uint32_t)));
+  usage.push_back(make_pair("index_t", index_t.capacity()*sizeof(uint32_t)));
+  usage.push_back(make_pair("index_a", index_a.capacity()*sizeof(uint32_t)));
+  // only allocated while the index is built
+  usage.push_back(make_pair("is_two_letter",
+                            is_two_letter.capacity()/CHAR_BIT));
+  usage.push_back(make_pair("keep", keep.capacity()/CHAR_BIT));
+  usage.push_back(make_pair("cl", cl.memory_bytes()));
+  return usage;
+}
+
+size_t
+get_peak_rss() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss; // bytes on macOS
+#else
+  return static_cast<size_t>(usage.ru_maxrss)*1024; // kilobytes on linux
+#endif
+}
+
+// page-aligned range covering a section, as required by madvise
+static void
+get_page_range(const index_section &sec, const size_t page_size,
+               char *&start, size_t &n_bytes) {
+  const uintptr_t first = reinterpret_cast<uintptr_t>(sec.data);
+  const uintptr_t aligned = first - first % page_size;
+  start = reinterpret_cast<char*>(aligned);
+  n_bytes = first + sec.n_bytes - aligned;
+}
+
+bool
+AbismalIndex::lock_in_memory() {
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  const vector<index_section> sections =
+    get_index_sections(genome, counter, counter_t, counter_a,
+                       index, index_t, index_a);
+
+  bool all_locked = true;
+  for (size_t i = 0; i < sections.size(); ++i) {
+    if (sections[i].n_bytes == 0) continue;
+    char *start = nullptr;
+    size_t n_bytes = 0;
+    get_page_range(sections[i], page_size, start, n_bytes);
+
+    // both are only hints, so failures are ignored
+    madvise(start, n_bytes, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    madvise(start, n_bytes, MADV_HUGEPAGE);
+#endif
+
+    // ADS: fault in every page from all threads in sequential ranges,
+    // so the first reads mapped do not fault pages in at random
+    const volatile char *data = sections[i].data;
+    const size_t n_pages = (sections[i].n_bytes + page_size - 1)/page_size;
+    size_t checksum = 0;
+#pragma omp parallel for schedule(static) reduction(+:checksum)
+    for (size_t j = 0; j < n_pages; ++j)
+      checksum += data[j*page_size];
+    (void)checksum;
+
+    if (mlock(start, n_bytes) != 0)
+      all_locked = false;
+  }
+  return all_locked;
+}
+
 bool
 ChromLookup::get_chrom_idx_and_offset(const uint32_t pos,
                                       const uint32_t readlen,
@@ -857,3 +1776,70 @@ ChromLookup::get_chrom_idx_and_offset(const uint32_t pos,
   offset = pos - starts[chrom_idx];
   return (pos + readlen <= starts[chrom_idx + 1]);
 }
+
+const string index_shards::identifier = "ABISMAL_SHARDS";
+
+// the directory of a file, ending with the separator
+static string
+directory_prefix(const string &filename) {
+  return filename.substr(0, filename.find_last_of('/') + 1);
+}
+
+bool
+index_shards::read(const string &manifest_file) {
+  ifstream in(manifest_file);
+  if (!in)
+    throw runtime_error("cannot open input file " + manifest_file);
+
+  // indexes are binary, so only the length of the identifier is read
+  string id_found(identifier.size(), '\0');
+  if (!in.read(&id_found[0], id_found.size()) || id_found != identifier)
+    return false;
+
+  const string dir = directory_prefix(manifest_file);
+  files.clear();
+  string line;
+  getline(in, line);  // the rest of the identifier line
+  while (getline(in, line))
+    if (!line.empty())
+      files.push_back(line[0] == '/' ? line : dir + line);
+  if (files.empty())
+    throw runtime_error("no shards in manifest: " + manifest_file);
+  return true;
+}
+
+void
+index_shards::write(const string &manifest_file) const {
+  ofstream out(manifest_file);
+  if (!out)
+    throw runtime_error("cannot open output file " + manifest_file);
+  const string dir = directory_prefix(manifest_file);
+  out << identifier << endl;
+  for (const string &f : files)
+    out << (!dir.empty() && f.compare(0, dir.size(), dir) == 0
+              ? f.substr(dir.size())
+              : f)
+        << endl;
+  if (!out)
+    throw runtime_error("failed writing manifest: " + manifest_file);
+}
+
+ChromLookup
+index_shards::chrom_lookup(vector<uint32_t> &offsets) const {
+  ChromLookup cl;
+  offsets.clear();
+  size_t offset = 0;
+  for (size_t i = 0; i < files.size(); ++i) {
+    ChromLookup shard_cl;
+    AbismalIndex::read_chrom_lookup(files[i], shard_cl);
+    if (offset + shard_cl.get_genome_size() >
+        std::numeric_limits<uint32_t>::max())
+      throw runtime_error("shards too large to combine: " + files[i]);
+    if (i == 0) cl = shard_cl;
+    else cl.append(shard_cl, offset);
+    offsets.push_back(offset);
+    // each genome takes whole words, as in AbismalIndex::append
+    offset += 16*((shard_cl.get_genome_size() + 15)/16);
+  }
+  return cl;
+}
@@ -30,6 +30,11 @@
 #include <climits>
 #include <cmath>
 #include <cstdint>
+#include <utility>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 #include "smithlab_utils.hpp"
 #include "dna_four_bit.hpp"
@@ -57,7 +62,12 @@ namespace seed {
   // window in which we select the best k-mer. The longer it is,
   // the longer the minimum read length that guarantees an exact
   // match will be mapped
-  static const uint32_t window_size = 20u;
+  static const uint32_t default_window_size = 20u;
+
+  // the window of the index being built or loaded; smaller windows
+  // keep more positions so shorter reads can be mapped, and a window
+  // of 1 keeps every position
+  extern uint32_t window_size;
 
   // number of positions to sort within buckets
   static const uint32_t n_sorting_positions = 256u;
@@ -71,6 +81,31 @@ namespace seed {
   // genome.
   static const size_t padding_size = std::numeric_limits<int16_t>::max();
 
+  // Spaced seeds hash key_weight (or key_weight_three) positions out
+  // of a span of consecutive bases, so a single mismatch affects fewer
+  // seeds. Bit (span - 1 - j) of a mask is set if position j of the
+  // span is hashed. For contiguous seeds the span is the key weight.
+  extern uint32_t span_two;
+  extern uint32_t span_three;
+  extern uint64_t mask_two;
+  extern uint64_t mask_three;
+  // mask_three with both bits set for each hashed base, as the
+  // three-letter bases of a span take two bits each
+  extern uint64_t lanes_three;
+
+  // patterns used by abismalidx -spaced-seeds
+  extern const char *default_pattern_two;
+  extern const char *default_pattern_three;
+
+  inline bool
+  is_spaced() {
+    return span_two != key_weight || span_three != key_weight_three;
+  }
+
+  // set the masks from strings of 1s (hashed) and 0s (skipped)
+  void set_patterns(const std::string &pattern_two,
+                    const std::string &pattern_three);
+
   void read(FILE* in);
   void write(FILE* out);
 };
@@ -79,6 +114,15 @@ struct ChromLookup {
   std::vector<std::string> names;
   std::vector<uint32_t> starts;
 
+  // SAM target id of each entry, -1 for padding. Only set when several
+  // genomes are combined, otherwise entry i has target id i - 1
+  std::vector<int32_t> tids;
+
+  int32_t
+  get_tid(const uint32_t chrom_idx) const {
+    return tids.empty() ? static_cast<int32_t>(chrom_idx) - 1 : tids[chrom_idx];
+  }
+
   void
   get_chrom_idx_and_offset(const uint32_t pos,
                            uint32_t &chrom_idx,
@@ -94,6 +138,10 @@ struct ChromLookup {
   uint32_t
   get_genome_size() const {return starts.back();}
 
+  // add the chromosomes of another genome, starting at offset, after
+  // those of this one, with padding between them mapped to no target
+  void append(const ChromLookup &other, const size_t offset);
+
   FILE * read(FILE *in);
   std::istream & read(std::istream &in);
   void read(const std::string &infile);
@@ -103,11 +151,18 @@ struct ChromLookup {
   void write(const std::string &outfile) const;
 
   std::string tostring() const;
+
+  // bytes held by names and starts
+  size_t memory_bytes() const;
 };
 
+// only the chromosomes numbered from first_chrom up to last_chrom, in
+// the order of the file, are loaded
 template <class G>
 void
-load_genome(const std::string &genome_file, G &genome, ChromLookup &cl) {
+load_genome(const std::string &genome_file, G &genome, ChromLookup &cl,
+            const size_t first_chrom = 0,
+            const size_t last_chrom = std::numeric_limits<size_t>::max()) {
   size_t num_ns = 0;
   std::ifstream in(genome_file);
   if (!in)
@@ -130,8 +185,11 @@ load_genome(const std::string &genome_file, G &genome, ChromLookup &cl) {
   cl.starts.push_back(genome.size());
 
   std::string line;
+  size_t n_chroms = 0;
+  bool in_range = false;
   while (getline(in, line))
     if (line[0] != '>') {
+      if (!in_range) continue;
       for (auto it(begin(line)); it != end(line); ++it) {
         if (base2int(*it) == 4) { // non-acgts become random bases
           ++num_ns;
@@ -141,8 +199,12 @@ load_genome(const std::string &genome_file, G &genome, ChromLookup &cl) {
       copy(std::begin(line), std::end(line), std::back_inserter(genome));
     }
     else {
-      cl.names.push_back(line.substr(1, line.find_first_of(" \t") - 1));
-      cl.starts.push_back(genome.size());
+      in_range = (n_chroms >= first_chrom && n_chroms < last_chrom);
+      ++n_chroms;
+      if (in_range) {
+        cl.names.push_back(line.substr(1, line.find_first_of(" \t") - 1));
+        cl.starts.push_back(genome.size());
+      }
     }
 
   if (cl.names.size() < 2)
@@ -160,10 +222,65 @@ std::ostream &
 operator<<(std::ostream &out, const ChromLookup &cl);
 
 enum three_conv_type { c_to_t, g_to_a};
+
+// Cost of using a position as a seed, used to choose between two- and
+// three-letter encodings and which positions to keep. Costs are in
+// units of verifying one candidate. Both buckets of a read are looked
+// up at every offset when mapping, whichever encoding is kept, so
+// lookups cost the same for every choice and are not counted. The
+// default model only counts candidates. A calibrated model follows
+// the mapper for buckets over max_candidates, which are narrowed by
+// one base at a time with binary searches until few enough candidates
+// are left, and adds the time of these searches measured on this
+// machine. The mapper skips a bucket that is not narrowed enough
+// within the first half of the read, which the model does not try to
+// predict.
+struct index_cost_model {
+  uint32_t max_candidates;  // 0 if every candidate is counted
+  double compare;           // one step of a binary search
+
+  index_cost_model() : max_candidates(0), compare(0.0) {}
+
+  uint32_t
+  two_letter_cost(const uint32_t count) const {
+    return verify_cost(count, 2);
+  }
+
+  // a read is looked up in only one of the three-letter encodings
+  uint32_t
+  three_letter_cost(const uint32_t count_t, const uint32_t count_a) const {
+    return verify_cost((count_t + count_a) >> 1, 3);
+  }
+
+  // each base narrows the bucket to one of n_letters parts, found with
+  // n_letters - 1 binary searches over what is left
+  uint32_t
+  verify_cost(const uint32_t count, const uint32_t n_letters) const {
+    if (max_candidates == 0 || count <= max_candidates) return count;
+    double left = count;
+    double narrowing = 0.0;
+    while (left > max_candidates) {
+      narrowing += (n_letters - 1)*std::log2(left)*compare;
+      left /= n_letters;
+    }
+    return static_cast<uint32_t>(narrowing + left + 0.5);
+  }
+};
+
+// wall time of one phase of building the index, and the peak memory
+// of the process once the phase is done
+struct build_phase {
+  std::string name;
+  double seconds;
+  size_t peak_rss;
+};
+
 struct AbismalIndex {
 
   static bool VERBOSE;
 
+  // candidates verified per bucket when mapping, unless set with -c
+  static const uint32_t default_max_candidates = 100u;
   uint32_t max_candidates;
 
   size_t counter_size; // number of kmers indexed
@@ -188,22 +305,44 @@ struct AbismalIndex {
   Genome genome; // the genome
   ChromLookup cl; // the starting position of each chromosome
 
-  void create_index(const std::string &genome_file);
+  // only used while the index is built
+  index_cost_model cost_model;
+  bool calibrate_costs;
+  std::vector<build_phase> build_phases;
+
+  // index the chromosomes numbered first_chrom up to last_chrom in
+  // the genome file, which by default is all of them
+  void create_index(const std::string &genome_file,
+                    const size_t first_chrom = 0,
+                    const size_t last_chrom =
+                      std::numeric_limits<size_t>::max());
+
+  // record a phase of building the index that started at start_time
+  // (omp_get_wtime), and return the time it ended
+  double end_build_phase(const std::string &name, const double start_time);
+
+  // time bucket lookups and candidate verification on this machine
+  // and set the lookup costs in cost_model; needs the bucket sizes
+  void calibrate_cost_model();
 
   // count how many positions must be stored for each hash value
-  template<const bool use_mask>
+  template<const bool use_mask, const bool spaced>
   void get_bucket_sizes();
 
-  template<const three_conv_type the_conv, const bool use_mask>
+  template<const three_conv_type the_conv, const bool use_mask,
+           const bool spaced>
   void get_bucket_sizes_three();
 
   // selects which positions go into two-letter
+  template<const bool spaced>
   void select_two_letter_positions();
 
   // selects which positions to keep based on k-mer frequencies
+  template<const bool spaced>
   void compress_dp();
 
   // put genome positions in the appropriate buckets
+  template<const bool spaced>
   void hash_genome();
 
   // Sort each bucket, if the seed length is more than
@@ -213,14 +352,66 @@ struct AbismalIndex {
   // convert the genome to 4-bit encoding
   void encode_genome(const std::vector<uint8_t> &input_genome);
 
-  // write index to disk
-  void write(const std::string &index_file) const;
+  // write index to disk, with n_threads writing sections at once to a
+  // temporary file that replaces index_file only once it is complete
+  void write(const std::string &index_file, const int n_threads = 1) const;
+
+  // write index to disk, with sections compressed in blocks that can
+  // be decompressed independently
+  void write_compressed(const std::string &index_file) const;
 
   // read index from disk
   void read(const std::string &index_file);
 
+  // read only the seeds and chromosomes of an index from disk
+  static void read_chrom_lookup(const std::string &index_file,
+                                ChromLookup &cl);
+
+  // read index from disk with n_threads issuing large reads at once,
+  // optionally bypassing the page cache (O_DIRECT)
+  void read_parallel(const std::string &index_file, const int n_threads,
+                     const bool direct_io);
+
+  // add the genome and buckets of another index after those of this
+  // one, leaving the other index empty
+  void append(AbismalIndex &other);
+
+  // fault in all pages of the index from all threads and lock them in
+  // memory; false if the locking limit (ulimit -l) did not allow it
+  bool lock_in_memory();
+
+  // bytes held by each member, in the order they are reported
+  std::vector<std::pair<std::string, size_t> > memory_usage() const;
+
+  // the part of a compressed index after the chromosome lookup
+  void read_compressed(FILE *in);
+  void write_compressed(FILE *out) const;
+
   static std::string internal_identifier;
-  AbismalIndex() {}
+  static std::string compressed_identifier;
+  AbismalIndex() : calibrate_costs(false) {}
+};
+
+// maximum resident set size of this process so far, in bytes
+size_t
+get_peak_rss();
+
+/* A genome too large to index in memory is split by abismalidx into
+ * shards, each an index of a range of whole chromosomes, listed in
+ * a manifest file in the order of the genome. Shard files are named
+ * relative to the directory of the manifest. */
+struct index_shards {
+  std::vector<std::string> files;
+
+  // false if the file is not a manifest, as for a regular index
+  bool read(const std::string &manifest_file);
+  void write(const std::string &manifest_file) const;
+
+  // the chromosomes of all shards, combined as if the genomes had been
+  // appended, and the offset of each shard in the combined genome
+  ChromLookup chrom_lookup(std::vector<uint32_t> &offsets) const;
+
+  static const std::string identifier;
 };
 
 // A/T nucleotide to 1-bit value (0100 | 0001 = 5) is for A or G.
@@ -248,6 +439,74 @@ shift_three_key(const uint8_t c, uint32_t &hash_key) {
   %seed::hash_mask_three;
 }
 
+// bits of x at the positions set in mask, in order from the highest
+inline uint32_t
+extract_masked_bits(const uint64_t x, const uint64_t mask) {
+#ifdef __BMI2__
+  return _pext_u64(x, mask);
+#else
+  uint32_t k = 0;
+  for (uint64_t m = mask; m != 0;) {
+    const uint64_t top = 1ull << (63 - __builtin_clzll(m));
+    k = (k << 1) | ((x & top) != 0);
+    m ^= top;
+  }
+  return k;
+#endif
+}
+
+// Rolling hash of the seed at consecutive positions, shifting in the
+// last base of the next seed. Contiguous seeds use shift_hash_key and
+// shift_three_key directly; spaced seeds keep the bases of the span
+// and hash the masked positions.
+template<const bool spaced>
+struct two_letter_key {
+  uint64_t bases; // one bit for each base in the span
+  uint32_t hash;
+  two_letter_key() : bases(0), hash(0) {}
+
+  void
+  shift(const uint8_t c) {
+    if (spaced) {
+      bases = (bases << 1) | get_bit(c);
+      hash = extract_masked_bits(bases, seed::mask_two);
+    }
+    else shift_hash_key(c, hash);
+  }
+};
+
+// the base-3 number with the same digits as the base-4 number x, whose
+// key_weight_three digits are at most 2, converted a byte at a time
+inline uint32_t
+base_4_to_base_3(const uint32_t x) {
+  struct byte_table {
+    uint8_t v[256];
+    byte_table() {
+      for (uint32_t b = 0; b < 256; ++b)
+        v[b] = (((b >> 6)*3 + ((b >> 4) & 3))*3 + ((b >> 2) & 3))*3 + (b & 3);
+    }
+  };
+  static const byte_table t;
+  return ((t.v[x >> 24]*81u + t.v[(x >> 16) & 255])*81u +
+          t.v[(x >> 8) & 255])*81u + t.v[x & 255];
+}
+
+template<const three_conv_type the_conv, const bool spaced>
+struct three_letter_key {
+  uint64_t bases; // two bits for each base in the span
+  uint32_t hash;
+  three_letter_key() : bases(0), hash(0) {}
+
+  void
+  shift(const uint8_t c) {
+    if (spaced) {
+      bases = (bases << 2) | get_three_letter_num<the_conv>(c);
+      hash = base_4_to_base_3(extract_masked_bits(bases, seed::lanes_three));
+    }
+    else shift_three_key<the_conv>(c, hash);
+  }
+};
+
 // get the hash value for a k-mer (specified as some iterator/pointer)
 // and the encoding for the function above
 template <class T>
@@ -272,4 +531,22 @@ get_base_3_hash(T r, uint32_t &k) {
   }
 }
 
+template <const bool spaced, class T>
+void
+get_1bit_hash(T r, two_letter_key<spaced> &k) {
+  const auto lim = r + seed::span_two;
+  k = two_letter_key<spaced>();
+  while (r != lim)
+    k.shift(*r++);
+}
+
+template <const three_conv_type the_conv, const bool spaced, class T>
+void
+get_base_3_hash(T r, three_letter_key<the_conv, spaced> &k) {
+  const auto lim = r + seed::span_three;
+  k = three_letter_key<the_conv, spaced>();
+  while (r != lim)
+    k.shift(*r++);
+}
+
 #endif
@@ -20,23 +20,41 @@
 #include <bamxx.hpp>
 #include <config.h>
 #include <htslib/bgzf.h>
+#include <htslib/cram.h>
 #include <htslib/hfile.h>
 #include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+#include <fcntl.h>
 #include <omp.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
 
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <numeric>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include "AbismalAlign.hpp"
 #include "AbismalIndex.hpp"
 #include "OptionParser.hpp"
+#include "abismal_alloc_trace.hpp"
+#include "abismal_compact.hpp"
+#include "abismal_trace.hpp"
 #include "bisulfite_utils.hpp"
 #include "dna_four_bit_bisulfite.hpp"
 #include "popcnt.hpp"
@@ -101,67 +119,535 @@ get_strand_code(const char strand, const conversion_type conv) {
           ((conv == a_rich) ? bsflags::read_is_a_rich : 0));
 }
 
+// unaligned SAM, BAM and CRAM are read through htslib records, while
+// FASTQ is read line by line. The handle used to detect the format is
+// kept for reading, and is null for FASTQ
+static htsFile *
+open_hts_reads_file(const string &filename) {
+  htsFile *hts = hts_open(filename.c_str(), "r");
+  if (!hts) return nullptr;
+  const htsExactFormat fmt = hts_get_format(hts)->format;
+  if (fmt == sam || fmt == bam || fmt == cram) return hts;
+  hts_close(hts);
+  return nullptr;
+}
+
+// Asks the kernel to read the input ahead of the reader, keeping
+// several large requests in flight, so reads from network or NVMe
+// storage overlap with mapping instead of stalling the thread that
+// loads the next batch. Does nothing for pipes and where
+// posix_fadvise is not available.
+struct input_readahead {
+  explicit input_readahead(const string &filename) : fd{-1}, issued{0} {
+#ifdef POSIX_FADV_WILLNEED
+    fd = open(filename.c_str(), O_RDONLY);
+#endif
+  }
+
+  ~input_readahead() {
+    if (fd >= 0) close(fd);
+  }
+
+  // the reader is at byte pos of the file
+  void advance(const size_t pos) {
+#ifdef POSIX_FADV_WILLNEED
+    while (fd >= 0 && issued < pos + n_in_flight * chunk_size) {
+      if (posix_fadvise(fd, issued, chunk_size, POSIX_FADV_WILLNEED) != 0) {
+        close(fd);
+        fd = -1;
+      }
+      issued += chunk_size;
+    }
+#endif
+  }
+
+  int fd;
+  size_t issued;  // bytes requested so far
+
+  static const size_t chunk_size = 16ul << 20;
+  static const size_t n_in_flight = 4;
+};
+
+/* A FASTQ file still being written, read with -follow. Only whole
+ * records are taken, so a record cut at the end of what has been
+ * written is read again once the rest of it is there. The file ends
+ * once the sentinel file exists and all that was written before the
+ * sentinel appeared has been read. */
+struct growing_file {
+  growing_file() : f{nullptr}, buf{nullptr}, buf_size{0}, done{false},
+                   finished{false}, notify_fd{-1} {}
+
+  ~growing_file() {
+    if (f) fclose(f);
+    free(buf);
+    if (notify_fd >= 0) close(notify_fd);
+  }
+
+  bool is_open() const { return f != nullptr; }
+
+  // waits for the file to be created, unless the run ends first
+  void open(const string &fn) {
+    filename = fn;
+    watch();
+    while (!(f = fopen(fn.c_str(), "r"))) {
+      if (sentinel_exists())
+        throw runtime_error("reads file was never written: " + fn);
+      wait_for_change();
+    }
+    if (getc(f) == 0x1f)
+      throw runtime_error("following needs uncompressed FASTQ: " + fn);
+    rewind(f);
+  }
+
+  // the next n lines, if all of them have been written in full
+  bool read_lines(string *lines, const size_t n) {
+    for (;;) {
+      const off_t start = ftello(f);
+      size_t i = 0;
+      while (i < n && read_line(lines[i])) ++i;
+      if (i == n) return true;
+      const bool partial = (ftello(f) > start);
+      clearerr(f);
+      seek(start);
+      if (finished) return false;
+      if (done) {
+        if (partial)
+          throw runtime_error("file " + filename +
+                              " ends in an incomplete record");
+        finished = true;
+        return false;
+      }
+      if (!sentinel_exists()) return false;
+      // all written before the sentinel is read once more
+      done = true;
+    }
+  }
+
+  off_t tell() const { return ftello(f); }
+
+  void seek(const off_t pos) {
+    if (fseeko(f, pos, SEEK_SET) != 0)
+      throw runtime_error("failed to seek in file: " + filename);
+  }
+
+  // waits for more of the file, or the sentinel, for at most
+  // max_wait_ms; without inotify, only for a short time. Changes since
+  // the last wait are still queued, so one made after the read that
+  // found nothing ends the wait at once. The queue is drained before
+  // the read is retried, and may be drained by another thread waiting
+  // at the same time, which then waits at most max_wait_ms
+  void wait_for_change() const {
+#ifdef __linux__
+    if (notify_fd >= 0) {
+      pollfd pfd = {notify_fd, POLLIN, 0};
+      poll(&pfd, 1, max_wait_ms);
+      char events[4096];
+      while (read(notify_fd, events, sizeof(events)) > 0)
+        ;
+      return;
+    }
+#endif
+    std::this_thread::sleep_for(std::chrono::milliseconds(min_wait_ms));
+  }
+
+  static bool following() { return !sentinel.empty(); }
+
+  static bool sentinel_exists() {
+    return access(sentinel.c_str(), F_OK) == 0;
+  }
+
+  FILE *f;
+  char *buf;  // used by getline
+  size_t buf_size;
+  string filename;
+  bool done;      // the sentinel was seen
+  bool finished;  // and all before it was read
+  int notify_fd;  // inotify watching the file and sentinel directories
+
+  static string sentinel;
+  static const int max_wait_ms = 1000;
+  static const int min_wait_ms = 100;
+
+private:
+  // the watches are made once, so no change between waits is missed
+  void watch() {
+#ifdef __linux__
+    static const uint32_t events =
+      IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO;
+    notify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (notify_fd < 0) return;
+    const string dirs[] = {directory(filename), directory(sentinel)};
+    for (const string &dir : dirs)
+      if (inotify_add_watch(notify_fd, dir.c_str(), events) < 0) {
+        close(notify_fd);
+        notify_fd = -1;
+        return;
+      }
+#endif
+  }
+
+  bool read_line(string &line) {
+    const ssize_t n = getline(&buf, &buf_size, f);
+    if (n <= 0 || buf[n - 1] != '\n') return false;
+    line.assign(buf, n - 1);
+    return true;
+  }
+
+  static string directory(const string &fn) {
+    const size_t slash = fn.find_last_of('/');
+    return slash == string::npos ? string(".") : fn.substr(0, slash + 1);
+  }
+};
+
+string growing_file::sentinel;
+
 struct ReadLoader {
-  ReadLoader(const string &fn): cur_line{0}, filename{fn}, in{fn, "r"} {}
+  ReadLoader(const string &fn, htsThreadPool *io_pool = nullptr)
+      : cur_line{0}, filename{fn},
+        hts{growing_file::following() ? nullptr : open_hts_reads_file(fn)},
+        hts_input{hts != nullptr},
+        in{(hts_input || growing_file::following()) ? string() : fn, "r"},
+        hts_hdr{nullptr}, rec{nullptr}, hts_good{false}, readahead{fn} {
+    if (growing_file::following()) growing.open(fn);
+    else if (hts_input) {
+      // decoding of BAM and CRAM blocks is done by the htslib threads
+      if (io_pool && hts_set_thread_pool(hts, io_pool) < 0)
+        throw runtime_error("failed to set threads for: " + filename);
+      hts_hdr = sam_hdr_read(hts);
+      if (!hts_hdr) throw runtime_error("failed to read header: " + filename);
+      rec = bam_init1();
+      hts_good = true;
+    }
+    else if (io_pool && in && bgzf_compression(in.f) == bgzf &&
+             bgzf_thread_pool(in.f, io_pool->pool, io_pool->qsize) < 0)
+      throw runtime_error("failed to set threads for: " + filename);
+  }
+
+  ~ReadLoader() {
+    if (rec) bam_destroy1(rec);
+    if (hts_hdr) sam_hdr_destroy(hts_hdr);
+    if (hts) hts_close(hts);
+  }
 
-  bool good() const { return in; }
+  bool good() const {
+    if (growing.is_open()) return !growing.finished;
+    return hts_input ? hts_good : bool(in);
+  }
 
-  operator bool() const { return in; }
+  operator bool() const { return good(); }
 
   size_t get_current_read() const { return cur_line / 4; }
 
-  size_t get_current_byte() const { return in.tellg(); }
+  size_t get_current_byte() const {
+    if (growing.is_open()) return growing.tell();
+    if (!hts_input) return in.tellg();
+    if (BGZF *bgz = hts_get_bgzfp(hts)) return bgzf_tell(bgz) >> 16;
+    if (hts->is_cram) return htell(cram_fd_get_fp(hts->fp.cram));
+    return 0;
+  }
 
-  void load_reads(vector<string> &names, vector<string> &reads) {
-    reads.clear();
-    names.clear();
+  // virtual offset (BGZF) of the next record, used in checkpoints
+  int64_t tell() const {
+    if (growing.is_open()) return growing.tell();
+    if (!hts_input) return bgzf_tell(in.f);
+    BGZF *bgz = hts_get_bgzfp(hts);
+    return bgz ? bgzf_tell(bgz) : -1;
+  }
 
-    size_t line_count = 0;
-    const size_t num_lines_to_read = 4 * batch_size;
-    string line;
-    while (line_count < num_lines_to_read && getline(in, line)) {
-      if (line_count % 4 == 0) {
-        if (line.empty())
-          throw runtime_error("file " + filename + " contains an empty " +
-                              "read name at line " + to_string(cur_line));
-        names.emplace_back(line.substr(1, line.find_first_of(" \t") - 1));
+  // ADS: gzip (not BGZF) and CRAM input cannot be seeked, so in those
+  // cases the records before the checkpoint are read and discarded.
+  void seek(const int64_t offset, const size_t n_reads) {
+    BGZF *bgz = hts_input ? hts_get_bgzfp(hts) : in.f;
+    if (bgz && offset >= 0 && bgzf_compression(bgz) != gzip) {
+      if (bgzf_seek(bgz, offset, SEEK_SET) < 0)
+        throw runtime_error("failed to seek in file: " + filename);
+    }
+    else {
+      string name, read, qual;
+      for (size_t i = 0; i < n_reads; ++i)
+        if (!read_record(name, read, qual))
+          throw runtime_error("file " + filename + " has fewer reads "
+                              "than expected: " + to_string(n_reads));
+    }
+    cur_line = 4 * n_reads;
+  }
+
+  // reads too long, or with too few valid bases, are rejected here,
+  // and qualities, if kept, are trimmed with the read
+  static void clean_read(string &read, string &qual) {
+    // read too long, may pass the end of the genome
+    if (read.size() >= seed::padding_size)
+      throw runtime_error(
+        "found a read of size " + to_string(read.size()) +
+        ", which is too long. Maximum allowed read size = " +
+        to_string(seed::padding_size));
+
+    if (count_if(begin(read), end(read),
+                 [](const char c) { return c != 'N'; }) < min_read_length) {
+      read.clear();
+      qual.clear();
+    }
+    else {
+      while (read.back() == 'N') read.pop_back();      // remove Ns from 3'
+      const size_t first = read.find_first_of("ACGT");
+      read.erase(0, first);  // removes Ns from 5'
+      if (!qual.empty()) {
+        qual.resize(first + read.size());
+        qual.erase(0, first);
       }
-      else if (line_count % 4 == 1) {
-        // read too long, may pass the end of the genome
-        if (line.size() >= seed::padding_size)
-          throw runtime_error(
-            "found a read of size " + to_string(line.size()) +
-            ", which is too long. Maximum allowed read size = " +
-            to_string(seed::padding_size));
-
-        if (count_if(begin(line), end(line),
-                     [](const char c) { return c != 'N'; }) < min_read_length)
-          line.clear();
-        else {
-          while (line.back() == 'N') line.pop_back();      // remove Ns from 3'
-          line = line.substr(line.find_first_of("ACGT"));  // removes Ns from 5'
+    }
+  }
+
+  // returns false if no record was left in the file. Qualities are
+  // kept, as phred values, only with a minimum seed quality
+  bool read_record(string &name, string &read, string &qual) {
+    if (hts_input) return read_hts_record(name, read, qual);
+    if (growing.is_open()) return read_growing_record(name, read, qual);
+
+    if (!getline(in, line)) return false;
+    if (line.empty())
+      throw runtime_error("file " + filename + " contains an empty " +
+                          "read name at line " + to_string(cur_line));
+    ++cur_line;
+    name.assign(line, 1, line.find_first_of(" \t") - 1);
+
+    if (!getline(in, read)) return false;
+    ++cur_line;
+
+    // the '+' and quality lines
+    for (size_t i = 0; i < 2 && getline(in, line); ++i) ++cur_line;
+    qual.clear();
+    if (min_seed_qual > 0 && line.size() == read.size()) {
+      qual = line;
+      for (auto &q : qual) q -= 33;
+    }
+    clean_read(read, qual);
+    return true;
+  }
+
+  // false if the next record is not all written yet
+  bool read_growing_record(string &name, string &read, string &qual) {
+    if (!growing.read_lines(record_lines, 4)) return false;
+    if (record_lines[0].empty())
+      throw runtime_error("file " + filename + " contains an empty " +
+                          "read name at line " + to_string(cur_line));
+    cur_line += 4;
+    name.assign(record_lines[0], 1,
+                record_lines[0].find_first_of(" \t") - 1);
+    read.swap(record_lines[1]);
+    qual.clear();
+    if (min_seed_qual > 0 && record_lines[3].size() == read.size()) {
+      qual = record_lines[3];
+      for (auto &q : qual) q -= 33;
+    }
+    clean_read(read, qual);
+    return true;
+  }
+
+  // with -follow, waits outside the lock of the loader until more of
+  // the input is written
+  void wait_for_input() const {
+    if (growing.is_open() && !growing.finished)
+      growing.wait_for_change();
+  }
+
+  // gives back the last n reads loaded, which are loaded again next
+  void unload(const size_t n, vector<string> &names, vector<string> &reads,
+              vector<string> &quals) {
+    const size_t n_kept = reads.size() - n;
+    growing.seek(record_starts[n_kept]);
+    cur_line -= 4 * n;
+    names.resize(n_kept);
+    reads.resize(n_kept);
+    quals.resize(n_kept);
+  }
+
+  // secondary and supplementary records repeat reads already seen
+  bool read_hts_record(string &name, string &read, string &qual) {
+    static const uint16_t not_primary = BAM_FSECONDARY | BAM_FSUPPLEMENTARY;
+    int ret = 0;
+    while ((ret = sam_read1(hts, hts_hdr, rec)) >= 0 &&
+           (rec->core.flag & not_primary))
+      ;
+    if (ret < -1) throw runtime_error("failed to read record: " + filename);
+    if (ret < 0) {
+      hts_good = false;
+      return false;
+    }
+    cur_line += 4;  // counting as if FASTQ so read counts agree
+
+    name = bam_get_qname(rec);
+    const uint8_t *seq = bam_get_seq(rec);
+    const int32_t read_len = rec->core.l_qseq;
+    read.resize(read_len);
+    for (int32_t i = 0; i < read_len; ++i)
+      read[i] = seq_nt16_str[bam_seqi(seq, i)];
+    qual.clear();
+    const uint8_t *rec_qual = bam_get_qual(rec);
+    // missing qualities are stored as 0xff
+    if (min_seed_qual > 0 && read_len > 0 && rec_qual[0] != 0xff)
+      qual.assign(rec_qual, rec_qual + read_len);
+    // restore the read as sequenced if it was stored reverse complemented
+    if (rec->core.flag & BAM_FREVERSE) {
+      revcomp_inplace(read);
+      std::reverse(begin(qual), end(qual));
+    }
+    clean_read(read, qual);
+    return true;
+  }
+
+  // strings in names and reads are kept between batches and reused,
+  // so after the first batch they rarely need to allocate
+  void load_reads(vector<string> &names, vector<string> &reads,
+                  vector<string> &quals, const size_t max_reads = batch_size) {
+    readahead.advance(get_current_byte());
+    record_starts.clear();
+    size_t n_reads = 0;
+    while (n_reads < max_reads) {
+      if (n_reads == reads.size()) {
+        names.emplace_back();
+        reads.emplace_back();
+        quals.emplace_back();
+      }
+      if (growing.is_open()) record_starts.push_back(growing.tell());
+      if (!read_record(names[n_reads], reads[n_reads], quals[n_reads])) break;
+      ++n_reads;
+    }
+    names.resize(n_reads);
+    reads.resize(n_reads);
+    quals.resize(n_reads);
+  }
+
+  // interleaved input: the two ends of each pair are consecutive
+  void load_read_pairs(vector<string> &names1, vector<string> &reads1,
+                       vector<string> &quals1, vector<string> &names2,
+                       vector<string> &reads2, vector<string> &quals2) {
+    readahead.advance(get_current_byte());
+    size_t n_reads = 0;
+    while (n_reads < batch_size) {
+      if (n_reads == reads1.size()) {
+        names1.emplace_back();
+        reads1.emplace_back();
+        quals1.emplace_back();
+        names2.emplace_back();
+        reads2.emplace_back();
+        quals2.emplace_back();
+      }
+      const off_t pair_start = growing.is_open() ? growing.tell() : 0;
+      if (!read_record(names1[n_reads], reads1[n_reads], quals1[n_reads]))
+        break;
+      const uint16_t flag1 = hts_input ? rec->core.flag : 0;
+      if (!read_record(names2[n_reads], reads2[n_reads], quals2[n_reads])) {
+        // the second end may not be written yet
+        if (growing.is_open() && !growing.finished) {
+          growing.seek(pair_start);
+          cur_line -= 4;
+          break;
         }
-        reads.emplace_back(line);
+        throw runtime_error("file " + filename + " has an odd number of " +
+                            "reads, but was given as interleaved pairs");
       }
-      ++line_count;
-      ++cur_line;
+      const bool mates =
+        hts_input ? ((flag1 & BAM_FREAD1) && (rec->core.flag & BAM_FREAD2) &&
+                     names1[n_reads] == names2[n_reads])
+                  : same_pair(names1[n_reads], names2[n_reads]);
+      if (!mates)
+        throw runtime_error("file " + filename + " was given as " +
+                            "interleaved pairs, but its records " +
+                            to_string(cur_line / 4 - 1) + " and " +
+                            to_string(cur_line / 4) + " (" +
+                            names1[n_reads] + " and " + names2[n_reads] +
+                            ") are not the two ends of a pair");
+      ++n_reads;
     }
+    names1.resize(n_reads);
+    reads1.resize(n_reads);
+    quals1.resize(n_reads);
+    names2.resize(n_reads);
+    reads2.resize(n_reads);
+    quals2.resize(n_reads);
   }
 
-  uint32_t cur_line;
+  // names of the two ends of a pair, which are the same or only
+  // differ by a mate number: "/1" and "/2", or ".1" and ".2" as
+  // written by simreads
+  static bool same_pair(const string &name1, const string &name2) {
+    const auto strip = [](const string &name, const char mate) {
+      const size_t n = name.size();
+      return (n > 2 && name[n - 1] == mate &&
+              (name[n - 2] == '/' || name[n - 2] == '.'))
+               ? name.substr(0, n - 2)
+               : name;
+    };
+    return name1 == name2 || strip(name1, '1') == strip(name2, '2');
+  }
+
+  size_t cur_line;
   string filename;
+  htsFile *hts;  // opened first, to tell how the file is read
+  bool hts_input;
   bamxx::bgzf_file in;
-
-  static const size_t batch_size;
-  static const uint32_t min_read_length;
+  sam_hdr_t *hts_hdr;
+  bam1_t *rec;
+  bool hts_good;
+  string line;
+  input_readahead readahead;
+  growing_file growing;
+  string record_lines[4];
+  vector<off_t> record_starts;  // of the reads of the last batch
+
+  // reads loaded by a thread at a time
+  static size_t batch_size;
+  static const size_t default_batch_size = 1000;
+  // set from the window of the index
+  static uint32_t min_read_length;
+  // qualities are kept only if this is not 0
+  static uint32_t min_seed_qual;
 };
 
-const size_t ReadLoader::batch_size = 1000;
+// both ends come from the same loader if the input is interleaved
+static void
+load_read_pairs(ReadLoader &rl1, ReadLoader &rl2, vector<string> &names1,
+                vector<string> &reads1, vector<string> &quals1,
+                vector<string> &names2, vector<string> &reads2,
+                vector<string> &quals2) {
+  if (&rl1 == &rl2)
+    rl1.load_read_pairs(names1, reads1, quals1, names2, reads2, quals2);
+  else {
+    rl1.load_reads(names1, reads1, quals1);
+    // files still being written can have more of one end than the
+    // other, and the extra reads are left for the next batch. Once an
+    // end is finished the sentinel exists, so the other end is written
+    // in full and any read left in it makes the batch sizes differ
+    if (!rl2.growing.is_open()) rl2.load_reads(names2, reads2, quals2);
+    else {
+      rl2.load_reads(names2, reads2, quals2,
+                     rl1 ? reads1.size() : ReadLoader::batch_size);
+      if (rl2) {
+        if (reads2.size() < reads1.size())
+          rl1.unload(reads1.size() - reads2.size(), names1, reads1, quals1);
+      }
+      else if (rl1 && reads2.size() == reads1.size()) {
+        vector<string> name, read, qual;
+        rl1.load_reads(name, read, qual, 1);
+        if (!read.empty()) {
+          names1.push_back(name.front());
+          reads1.push_back(read.front());
+          quals1.push_back(qual.front());
+        }
+      }
+    }
+  }
+}
+
+size_t ReadLoader::batch_size = ReadLoader::default_batch_size;
 
 // GS: minimum length which an exact match can be
 // guaranteed to map
-const uint32_t ReadLoader::min_read_length =
-  seed::key_weight + seed::window_size - 1;
+uint32_t ReadLoader::min_read_length =
+  seed::key_weight + seed::default_window_size - 1;
+
+uint32_t ReadLoader::min_seed_qual = 0;
 
 // GS: used to allocate the appropriate dimensions of the banded
 // alignment matrix for a batch of reads
@@ -379,15 +865,61 @@ chrom_and_posn(const ChromLookup &cl, const bam_cigar_t &cig, const uint32_t p,
   const uint32_t ref_ops = cigar_rseq_ops(cig);
   if (!cl.get_chrom_idx_and_offset(p, ref_ops, r_chr, r_p)) return false;
   r_e = r_p + ref_ops;
-  return true;
+  // padding between genomes of different indexes
+  return cl.get_tid(r_chr) >= 0;
 }
 
 enum map_type { map_unmapped, map_unique, map_ambig };
 
-static map_type
+/* Sets a mapped read in the record of the output format. The "CV" tag
+ * is 'A' or 'T' for the conversion, and "NM" has the edit distance.
+ */
+static void
+set_record(const string &name, const uint16_t flag, const int32_t tid,
+           const uint32_t pos, const bam_cigar_t &cigar, const int32_t mtid,
+           const int32_t mpos, const int isize, const string &read,
+           const score_t diffs, const bool a_rich, bam_rec &sr) {
+  sr.b = bam_init1();
+  int ret = bam_set1(sr.b,
+                     name.size(),    // size_t l_qname,
+                     name.data(),    // const char *qname,
+                     flag,           // uint16_t flag,
+                     tid,            // int32_t tid
+                     pos,            // hts_pos_t pos,
+                     255,            // uint8_t mapq,
+                     cigar.size(),   // size_t n_cigar,
+                     cigar.data(),   // const uint32_t *cigar,
+                     mtid,           // int32_t mtid,
+                     mpos,           //  hts_pos_t mpos,
+                     isize,          // hts_pos_t isize,
+                     read.size(),    // size_t l_seq,
+                     read.data(),    // const char *seq,
+                     nullptr,        // const char *qual,
+                     16);            // size_t l_aux);
+  if (ret < 0) throw runtime_error("failed to format bam");
+
+  ret = bam_aux_update_int(sr.b, "NM", diffs);
+  if (ret < 0) throw runtime_error("bam_aux_update_int");
+
+  ret = bam_aux_append(sr.b, "CV", 'A', 1,
+                       (uint8_t *)(a_rich ? "A" : "T"));
+  if (ret < 0) throw runtime_error("bam_aux_append");
+}
+
+// compact records have no name or mate, as the mate is the next record
+static void
+set_record(const string &, const uint16_t flag, const int32_t tid,
+           const uint32_t pos, const bam_cigar_t &cigar, const int32_t,
+           const int32_t, const int, const string &read, const score_t diffs,
+           const bool a_rich, compact::block &blk) {
+  blk.add(tid, pos, flag, diffs, a_rich ? 'A' : 'T', cigar.data(),
+          cigar.size(), read);
+}
+
+template<class rec_type> static map_type
 format_se(const bool allow_ambig, const se_element &res, const ChromLookup &cl,
           const string &read, const string &read_name, const bam_cigar_t &cigar,
-          bam_rec &sr) {
+          rec_type &sr) {
   const bool ambig = res.ambig();
   const bool valid = !res.empty();
   if (!allow_ambig && ambig) return map_ambig;
@@ -404,31 +936,8 @@ format_se(const bool allow_ambig, const se_element &res, const ChromLookup &cl,
 
   // flag |= BAM_FREAD1;  // ADS: this might be wrong...
 
-  sr.b = bam_init1();
-  int ret = bam_set1(sr.b,
-                     read_name.size(),  // size_t l_qname,
-                     read_name.data(),  // const char *qname,
-                     flag,              // uint16_t flag,
-                     chrom_idx - 1,     // int32_t tid (-1 for padding)
-                     ref_s,             // hts_pos_t pos,
-                     255,               // uint8_t mapq,
-                     cigar.size(),      // size_t n_cigar,
-                     cigar.data(),      // const uint32_t *cigar,
-                     -1,                // int32_t mtid,
-                     -1,                //  hts_pos_t mpos,
-                     0,                 // hts_pos_t isize,
-                     read.size(),       // size_t l_seq,
-                     read.data(),       // const char *seq,
-                     nullptr,           // const char *qual,
-                     16);               // size_t l_aux);
-  if (ret < 0) throw runtime_error("failed to format bam");
-
-  ret = bam_aux_update_int(sr.b, "NM", res.diffs);
-  if (ret < 0) throw runtime_error("bam_aux_update_int");
-
-  ret = bam_aux_append(sr.b, "CV", 'A', 1,
-                       (uint8_t *)(res.elem_is_a_rich() ? "A" : "T"));
-  if (ret < 0) throw runtime_error("bam_aux_append");
+  set_record(read_name, flag, cl.get_tid(chrom_idx), ref_s, cigar, -1, -1, 0,
+             read, res.diffs, res.elem_is_a_rich(), sr);
 
   return ambig ? map_ambig : map_unique;
 }
@@ -516,13 +1025,11 @@ valid_pair(const pe_element &best, const uint32_t readlen1,
  * Alphanumeric with value 'A' or 'T' to show whether the C->T
  * conversion was used or the G->A (for PBAT or 2nd end of PE reads).
  */
-static map_type
+template<class rec_type> static map_type
 format_pe(const bool allow_ambig, const pe_element &p, const ChromLookup &cl,
           const string &read1, const string &read2, const string &name1,
           const string &name2, const bam_cigar_t &cig1, const bam_cigar_t &cig2,
-          bam_rec &sr1, bam_rec &sr2) {
-  static const uint8_t cv[2] = {'T', 'A'};
-
+          rec_type &sr1, rec_type &sr2) {
   if (p.empty()) return map_unmapped;
 
   const bool ambig = p.ambig();
@@ -562,55 +1069,10 @@ format_pe(const bool allow_ambig, const pe_element &p, const ChromLookup &cl,
   flag1 |= BAM_FREAD1;
   flag2 |= BAM_FREAD2;
 
-  sr1.b = bam_init1();
-  int ret = bam_set1(sr1.b,
-                     name1.size(),  // size_t l_qname,
-                     name1.data(),  // const char *qname,
-                     flag1,         // uint16_t flag,
-                     chr1 - 1,      // (-1 for padding) int32_t tid
-                     r_s1,          // hts_pos_t pos,
-                     255,           // uint8_t mapq,
-                     cig1.size(),   // size_t n_cigar,
-                     cig1.data(),   // const uint32_t *cigar,
-                     chr2 - 1,      // (-1 for padding) int32_t mtid,
-                     r_s2,          //  hts_pos_t mpos,
-                     isize,         // hts_pos_t isize,
-                     read1.size(),  // size_t l_seq,
-                     read1.data(),  // const char *seq,
-                     nullptr,       // const char *qual,
-                     16);           // size_t l_aux);
-  if (ret < 0) throw runtime_error("error formatting bam");
-
-  ret = bam_aux_update_int(sr1.b, "NM", p.r1.diffs);
-  if (ret < 0) throw runtime_error("error adding aux field");
-
-  ret = bam_aux_append(sr1.b, "CV", 'A', 1, cv + p.r1.elem_is_a_rich());
-  if (ret < 0) throw runtime_error("error adding aux field");
-
-  sr2.b = bam_init1();
-  ret = bam_set1(sr2.b,
-                 name2.size(),  // size_t l_qname,
-                 name2.data(),  // const char *qname,
-                 flag2,         // uint16_t flag,
-                 chr2 - 1,      // (-1 for padding) int32_t tid
-                 r_s2,          // hts_pos_t pos,
-                 255,           // uint8_t mapq,
-                 cig2.size(),   // size_t n_cigar,
-                 cig2.data(),   // const uint32_t *cigar,
-                 chr1 - 1,      // (-1 for padding) int32_t mtid,
-                 r_s1,          //  hts_pos_t mpos,
-                 -isize,        // hts_pos_t isize,
-                 read2.size(),  // size_t l_seq,
-                 read2.data(),  // const char *seq,
-                 nullptr,       // const char *qual,
-                 16);           // size_t l_aux);
-  if (ret < 0) throw runtime_error("failed to format bam");
-
-  ret = bam_aux_update_int(sr2.b, "NM", p.r2.diffs);
-  if (ret < 0) throw runtime_error("error adding aux field");
-
-  ret = bam_aux_append(sr2.b, "CV", 'A', 1, cv + p.r2.elem_is_a_rich());
-  if (ret < 0) throw runtime_error("error adding aux field");
+  set_record(name1, flag1, cl.get_tid(chr1), r_s1, cig1, cl.get_tid(chr2),
+             r_s2, isize, read1, p.r1.diffs, p.r1.elem_is_a_rich(), sr1);
+  set_record(name2, flag2, cl.get_tid(chr2), r_s2, cig2, cl.get_tid(chr1),
+             r_s1, -isize, read2, p.r2.diffs, p.r2.elem_is_a_rich(), sr2);
 
   return ambig ? map_ambig : map_unique;
 }
@@ -685,26 +1147,186 @@ pct(const double a, const double b) {
   return ((b == 0) ? 0.0 : 100.0 * a / b);
 }
 
+// reads mapped uniquely to each reference, when several indexes are
+// mapped to at once
+struct reference_counts {
+  vector<string> labels;
+  vector<uint32_t> starts;  // first position of each genome
+  vector<uint32_t> n_unique;
+
+  bool empty() const { return labels.empty(); }
+
+  void count(const uint32_t pos) {
+    if (empty()) return;
+    ++n_unique[upper_bound(begin(starts), end(starts), pos) - begin(starts) -
+               1];
+  }
+
+  ostream &write(ostream &out) const {
+    for (size_t i = 0; i < n_unique.size(); ++i) out << ' ' << n_unique[i];
+    return out;
+  }
+
+  std::istream &read(std::istream &in) {
+    for (size_t i = 0; i < n_unique.size(); ++i) in >> n_unique[i];
+    return in;
+  }
+
+  string tostring(const string &t, const uint32_t total) const {
+    static const string tab = "    ";
+    if (empty()) return "";
+    ostringstream oss;
+    oss << t << "references:" << endl;
+    for (size_t i = 0; i < labels.size(); ++i)
+      oss << t + tab << labels[i] << ":" << endl
+          << t + tab + tab << "num_unique: " << n_unique[i] << endl
+          << t + tab + tab << "percent_unique: "
+          << pct(n_unique[i], total == 0 ? 1 : total) << endl;
+    return oss.str();
+  }
+};
+
+/* Drops reads that cannot map before any seed is looked up
+ * (-prefilter). Poly-T tails and other low complexity reads hit the
+ * largest buckets in every pass and are rarely mapped uniquely. Once
+ * converted, a read is hopeless if the entropy of its bases is below
+ * min_entropy bits, or its DUST score (pairs of equal triplets,
+ * scaled to the 64-base windows of sdust) is over max_dust. This is
+ * below the 20 of sdust, as dinucleotide repeats score about 15 and
+ * trinucleotide repeats about 10. With -prefilter-index, a read is
+ * also hopeless if no two-letter seed of either strand is in the
+ * index, which is probed in a bit set of the non-empty buckets, much
+ * smaller than the counts of the index. This catches adapter dimers,
+ * but also drops the few reads that only the three-letter seeds would
+ * map. */
+struct read_prefilter {
+  // a-rich reads have G converted to A, and others C to T
+  static bool hopeless(const string &read, const bool a_rich) {
+    if (read.empty()) return false;
+    return low_complexity(read, a_rich) || (!present.empty() && absent(read));
+  }
+
+  static bool low_complexity(const string &read, const bool a_rich) {
+    uint32_t counts[4] = {0, 0, 0, 0};
+    uint32_t triplets[64] = {0};
+    uint32_t t = 0;      // the last three bases, two bits each
+    uint32_t run = 0;    // bases since the last N
+    uint32_t n_triplets = 0;
+    for (const char c : read) {
+      const uint32_t b = converted_code(c, a_rich);
+      ++counts[b];
+      run = (b == 3) ? 0 : run + 1;
+      t = ((t << 2) | b) & 63u;
+      if (run >= 3) {
+        ++triplets[t];
+        ++n_triplets;
+      }
+    }
+    const double n_bases = counts[0] + counts[1] + counts[2];
+    if (n_bases == 0) return true;
+    double entropy = 0.0;
+    for (size_t i = 0; i < 3; ++i)
+      if (counts[i] > 0)
+        entropy -= (counts[i] / n_bases) * std::log2(counts[i] / n_bases);
+    if (entropy < min_entropy) return true;
+    if (n_triplets < 2) return false;
+    double pairs = 0.0;
+    for (size_t i = 0; i < 64; ++i)
+      pairs += triplets[i] * (triplets[i] - 1.0) / 2.0;
+    const double l = n_triplets - 1.0;
+    return pairs * dust_window / (l * l) > max_dust;
+  }
+
+  // true if no two-letter seed of the read or its reverse complement
+  // is in the index
+  static bool absent(const string &read) {
+    return seed::is_spaced() ? absent_impl<true>(read)
+                             : absent_impl<false>(read);
+  }
+
+  // marks the non-empty two-letter buckets of the index
+  static void build(const AbismalIndex &index) {
+    present.assign((index.counter_size + 63) / 64, 0);
+    for (size_t h = 0; h < index.counter_size; ++h)
+      if (index.counter[h + 1] > index.counter[h])
+        present[h >> 6] |= (1ull << (h & 63));
+  }
+
+  // fraction of two-letter buckets that are non-empty
+  static double fill() {
+    size_t n_set = 0;
+    for (const uint64_t w : present) n_set += __builtin_popcountll(w);
+    return present.empty() ? 0.0 : n_set / (64.0 * present.size());
+  }
+
+  static bool enabled;
+  static vector<uint64_t> present;
+  static constexpr double min_entropy = 0.5;
+  static constexpr double max_dust = 12.0;
+  static constexpr double dust_window = 61.0;
+
+private:
+  // A, the converted base and the other as 0, 1 and 2, and N as 3
+  static uint32_t converted_code(const char c, const bool a_rich) {
+    switch (c) {
+    case 'A': case 'a': return 0;
+    case 'C': case 'c': return a_rich ? 1 : 2;
+    case 'G': case 'g': return a_rich ? 0 : 1;
+    case 'T': case 't': return 2;
+    default: return 3;
+    }
+  }
+
+  static bool is_present(const uint32_t hash) {
+    return (present[hash >> 6] >> (hash & 63)) & 1ull;
+  }
+
+  template<const bool spaced> static bool absent_impl(const string &read) {
+    // C and T are 1 in two letters, so the reverse complement is the
+    // reversed read with bits flipped; N is 0 on both strands
+    static const uint8_t zero = 1, one = 8;  // A and T, as in the index
+    two_letter_key<spaced> fwd, rev;
+    const size_t n = read.size();
+    for (size_t i = 0; i < n; ++i) {
+      const char f = toupper(read[i]);
+      const char r = toupper(read[n - 1 - i]);
+      fwd.shift((f == 'C' || f == 'T') ? one : zero);
+      rev.shift((r == 'A' || r == 'G') ? one : zero);
+      if (i + 1 >= seed::span_two &&
+          (is_present(fwd.hash) || is_present(rev.hash)))
+        return false;
+    }
+    return true;
+  }
+};
+
+bool read_prefilter::enabled = false;
+vector<uint64_t> read_prefilter::present;
+
 struct se_map_stats {
   se_map_stats()
       : tot_rds(0), uniq_rds(0), ambig_rds(0), unmapped_rds(0), skipped_rds(0),
-        edit_distance(0), total_bases(0) {}
+        prefiltered_rds(0), edit_distance(0), total_bases(0) {}
 
   uint32_t tot_rds;
   uint32_t uniq_rds;
   uint32_t ambig_rds;
   uint32_t unmapped_rds;
   uint32_t skipped_rds;
+  uint32_t prefiltered_rds;  // also counted as unmapped
 
   size_t edit_distance;
   size_t total_bases;
 
+  reference_counts refs;
+
   void update(const bool allow_ambig, const string &read,
               const bam_cigar_t &cigar, const se_element s) {
     ++tot_rds;
     const bool valid = !s.empty();
     const bool ambig = s.ambig();
     uniq_rds += (valid && !ambig);
+    if (valid && !ambig) refs.count(s.pos);
     ambig_rds += (valid && ambig);
     unmapped_rds += !valid;
     skipped_rds += read.empty();
@@ -717,6 +1339,20 @@ struct se_map_stats {
     total_bases += cigar_rseq_ops(cigar);
   }
 
+  // raw counts, used to save and restore checkpoints
+  ostream &write(ostream &out) const {
+    out << tot_rds << ' ' << uniq_rds << ' ' << ambig_rds << ' '
+        << unmapped_rds << ' ' << skipped_rds << ' ' << prefiltered_rds << ' '
+        << edit_distance << ' ' << total_bases;
+    return refs.write(out);
+  }
+
+  std::istream &read(std::istream &in) {
+    in >> tot_rds >> uniq_rds >> ambig_rds >> unmapped_rds >> skipped_rds >>
+      prefiltered_rds >> edit_distance >> total_bases;
+    return refs.read(in);
+  }
+
   string tostring(const size_t n_tabs = 0) const {
     static const string tab = "    ";
     string t;
@@ -744,6 +1380,11 @@ struct se_map_stats {
         << t << "num_skipped: " << skipped_rds << endl
         << t << "percent_unmapped: " << pct(unmapped_rds, tot_rds) << endl
         << t << "percent_skipped: " << pct(skipped_rds, tot_rds) << endl;
+    if (read_prefilter::enabled)
+      oss << t << "num_prefiltered: " << prefiltered_rds << endl
+          << t << "percent_prefiltered: " << pct(prefiltered_rds, tot_rds)
+          << endl;
+    oss << refs.tostring(t, tot_rds);
     return oss.str();
   }
 };
@@ -751,13 +1392,15 @@ struct se_map_stats {
 struct pe_map_stats {
   pe_map_stats()
       : tot_pairs(0), uniq_pairs(0), ambig_pairs(0), unmapped_pairs(0),
-        skipped_pairs(0), edit_distance(0), total_bases(0) {}
+        skipped_pairs(0), prefiltered_pairs(0), edit_distance(0),
+        total_bases(0) {}
 
   uint32_t tot_pairs;
   uint32_t uniq_pairs;
   uint32_t ambig_pairs;
   uint32_t unmapped_pairs;
   uint32_t skipped_pairs;
+  uint32_t prefiltered_pairs;  // also counted as unmapped
 
   size_t edit_distance;
   size_t total_bases;
@@ -765,6 +1408,15 @@ struct pe_map_stats {
   se_map_stats end1_stats;
   se_map_stats end2_stats;
 
+  reference_counts refs;
+
+  // count mapped pairs and ends for each reference
+  void set_references(const reference_counts &r) {
+    refs = r;
+    end1_stats.refs = r;
+    end2_stats.refs = r;
+  }
+
   void update(const bool allow_ambig, const string &reads1,
               const string &reads2, const bam_cigar_t &cig1,
               const bam_cigar_t &cig2, const pe_element &p, const se_element s1,
@@ -774,6 +1426,7 @@ struct pe_map_stats {
     ++tot_pairs;
     ambig_pairs += (valid && ambig);
     uniq_pairs += (valid && !ambig);
+    if (valid && !ambig) refs.count(p.r1.pos);
     unmapped_pairs += !valid;
     skipped_pairs += (reads1.empty() || reads2.empty());
 
@@ -786,12 +1439,36 @@ struct pe_map_stats {
     }
   }
 
+  // the ends of prefiltered pairs are not mapped on their own either
+  void add_prefiltered(const uint32_t n_pairs) {
+    prefiltered_pairs += n_pairs;
+    end1_stats.prefiltered_rds += n_pairs;
+    end2_stats.prefiltered_rds += n_pairs;
+  }
+
   void update_error_rate(const score_t d1, const score_t d2,
                          const bam_cigar_t &cig1, const bam_cigar_t &cig2) {
     edit_distance += d1 + d2;
     total_bases += cigar_rseq_ops(cig1) + cigar_rseq_ops(cig2);
   }
 
+  ostream &write(ostream &out) const {
+    out << tot_pairs << ' ' << uniq_pairs << ' ' << ambig_pairs << ' '
+        << unmapped_pairs << ' ' << skipped_pairs << ' ' << prefiltered_pairs
+        << ' ' << edit_distance << ' ' << total_bases;
+    refs.write(out) << ' ';
+    end1_stats.write(out) << ' ';
+    return end2_stats.write(out);
+  }
+
+  std::istream &read(std::istream &in) {
+    in >> tot_pairs >> uniq_pairs >> ambig_pairs >> unmapped_pairs >>
+      skipped_pairs >> prefiltered_pairs >> edit_distance >> total_bases;
+    refs.read(in);
+    end1_stats.read(in);
+    return end2_stats.read(in);
+  }
+
   string tostring(const bool allow_ambig) const {
     ostringstream oss;
     static const string t = "    ";
@@ -816,6 +1493,11 @@ struct pe_map_stats {
         << t << "num_skipped: " << skipped_pairs << endl
         << t << "percent_unmapped: " << pct(unmapped_pairs, tot_pairs) << endl
         << t << "percent_skipped: " << pct(skipped_pairs, tot_pairs) << endl;
+    if (read_prefilter::enabled)
+      oss << t << "num_prefiltered: " << prefiltered_pairs << endl
+          << t << "percent_prefiltered: "
+          << pct(prefiltered_pairs, tot_pairs) << endl;
+    oss << refs.tostring(t, tot_pairs);
 
     if (!allow_ambig)
       oss << "mate1:" << endl
@@ -825,12 +1507,537 @@ struct pe_map_stats {
   }
 };
 
-static void
+/* The locality cache keeps the results of the last few reads mapped
+ * by a thread. In coordinate-sorted input, duplicate reads are
+ * adjacent, and a read identical to one mapped recently gets the same
+ * result without searching the index again. A read that only overlaps
+ * a recent hit still needs the full search: another location as good
+ * as the nearby one would make the read ambiguous, and one that is
+ * better would be reported instead, so neither can be ruled out
+ * locally without changing the output. Qualities are part of the key,
+ * as with -min-seed-qual they decide which seeds are looked up; they
+ * are empty otherwise.
+ */
+template<class result_type> struct locality_cache {
+  explicit locality_cache(const uint32_t max_size)
+      : entries(max_size), next(0) {}
+
+  // most recent entries are checked first
+  const result_type *find(const string &read1, const string &qual1,
+                          const string &read2 = string(),
+                          const string &qual2 = string()) const {
+    const size_t n = entries.size();
+    for (size_t j = 1; j <= n; ++j) {
+      const entry &e = entries[(next + n - j) % n];
+      if (e.used && e.read1 == read1 && e.read2 == read2 &&
+          e.qual1 == qual1 && e.qual2 == qual2)
+        return &e.result;
+    }
+    return nullptr;
+  }
+
+  void clear() {
+    for (entry &e : entries) e.used = false;
+    next = 0;
+  }
+
+  // replaces the oldest entry
+  void insert(const string &read1, const string &qual1,
+              const string &read2, const string &qual2,
+              const result_type &result) {
+    if (entries.empty()) return;
+    entry &e = entries[next];
+    e.used = true;
+    e.read1 = read1;
+    e.read2 = read2;
+    e.qual1 = qual1;
+    e.qual2 = qual2;
+    e.result = result;
+    next = (next + 1) % entries.size();
+  }
+
+  size_t memory_bytes() const {
+    size_t n_bytes = entries.capacity() * sizeof(entry);
+    for (size_t i = 0; i < entries.size(); ++i)
+      n_bytes += entries[i].read1.capacity() + entries[i].read2.capacity() +
+                 entries[i].qual1.capacity() + entries[i].qual2.capacity() +
+                 entries[i].result.memory_bytes();
+    return n_bytes;
+  }
+
+  struct entry {
+    entry(): used(false) {}
+    bool used;
+    string read1;
+    string read2;
+    string qual1;
+    string qual2;
+    result_type result;
+  };
+
+  vector<entry> entries;
+  size_t next;
+};
+
+// mapping results of a read, before formatting the SAM entry
+struct se_result {
+  se_result() {}
+  se_result(const se_element &b, const bam_cigar_t &c): best(b), cigar(c) {}
+  size_t memory_bytes() const { return cigar.capacity() * sizeof(uint32_t); }
+  se_element best;
+  bam_cigar_t cigar;
+};
+
+// mapping results of a pair, as ends can be reported as single-end
+struct pe_result {
+  pe_result() {}
+  pe_result(const pe_element &b, const se_element &b1, const se_element &b2,
+            const bam_cigar_t &c1, const bam_cigar_t &c2)
+      : best(b), best_se1(b1), best_se2(b2), cigar1(c1), cigar2(c2) {}
+  size_t memory_bytes() const {
+    return (cigar1.capacity() + cigar2.capacity()) * sizeof(uint32_t);
+  }
+  pe_element best;
+  se_element best_se1;
+  se_element best_se2;
+  bam_cigar_t cigar1;
+  bam_cigar_t cigar2;
+};
+
+template<class T> static size_t
+vector_bytes(const vector<T> &v) {
+  return v.capacity() * sizeof(T);
+}
+
+template<class T> static size_t
+vector_bytes(const vector<vector<T>> &v) {
+  size_t n_bytes = v.capacity() * sizeof(vector<T>);
+  for (size_t i = 0; i < v.size(); ++i) n_bytes += vector_bytes(v[i]);
+  return n_bytes;
+}
+
+static size_t
+vector_bytes(const vector<string> &v) {
+  size_t n_bytes = v.capacity() * sizeof(string);
+  for (size_t i = 0; i < v.size(); ++i) n_bytes += v[i].capacity();
+  return n_bytes;
+}
+
+static size_t
+vector_bytes(const vector<bam_rec> &v) {
+  size_t n_bytes = v.capacity() * sizeof(bam_rec);
+  for (size_t i = 0; i < v.size(); ++i)
+    if (v[i].b) n_bytes += sizeof(bam1_t) + v[i].b->m_data;
+  return n_bytes;
+}
+
+/* Bytes held by the buffers of the mapping threads, summed over the
+ * threads. Each thread adds its own once it has no more reads. */
+struct buffer_usage {
+  buffer_usage()
+      : n_threads(0), candidates(0), alignment(0), batch(0), records(0),
+        cache(0) {}
+
+  void add(const buffer_usage &u) {
+    ++n_threads;
+    candidates += u.candidates;
+    alignment += u.alignment;
+    batch += u.batch;
+    records += u.records;
+    cache += u.cache;
+  }
+
+  size_t n_threads;
+  size_t candidates;  // se_candidates and pe_candidates
+  size_t alignment;   // AbismalAlign table and traceback
+  size_t batch;       // reads, names, encoded reads and results
+  size_t records;     // largest batch of formatted bam records
+  size_t cache;       // locality cache
+};
+
+/* Settings and timing of the output file, reported with -v so
+ * compression levels can be compared on the same data. The write time
+ * is spent by mapping threads holding the output, and the flush time
+ * waits for blocks still queued for compression. */
+struct output_stats {
+  output_stats()
+      : bam(false), compact(false), compress_level(-1), n_bytes(0),
+        write_seconds(0.0), flush_seconds(0.0) {}
+
+  bool bam;
+  bool compact;
+  int compress_level;  // -1 for the htslib (or zlib) default
+  size_t n_bytes;      // 0 if the output is not a regular file
+  double write_seconds;
+  double flush_seconds;
+
+  static string deflate_backend() {
+    return (hts_features() & HTS_FEATURE_LIBDEFLATE) ? "libdeflate" : "zlib";
+  }
+
+  string tostring() const {
+    static const string tab = "    ";
+    ostringstream oss;
+    oss << "output:" << endl
+        << tab << "format: "
+        << (compact ? "compact" : (bam ? "BAM" : "SAM")) << endl;
+    if (bam || compact)
+      oss << tab << "compress_level: "
+          << (compress_level < 0 ? string("default")
+                                 : to_string(compress_level))
+          << endl
+          << tab << "deflate: "
+          << (compress_level == 0 ? string("none")
+                                  : (compact ? "zlib" : deflate_backend()))
+          << endl;
+    if (n_bytes > 0) oss << tab << "bytes: " << n_bytes << endl;
+    oss << tab << "write_seconds: " << write_seconds << endl
+        << tab << "flush_seconds: " << flush_seconds << endl;
+    return oss.str();
+  }
+};
+
+/* Mapped reads in the compact format of abismal_compact.hpp. The
+ * blocks are compressed by the mapping threads, and written as raw
+ * bytes to the file opened by htslib for the output, which is left as
+ * uncompressed SAM so htslib adds nothing else to it. */
+struct compact_output {
+  static void write(bamxx::bam_out &out, const vector<uint8_t> &bytes) {
+    if (hwrite(out.f->fp.hfile, bytes.data(), bytes.size()) !=
+        static_cast<ssize_t>(bytes.size()))
+      throw runtime_error("failed to write compact output");
+  }
+
+  // the targets are those of the SAM header, in the same order
+  static void
+  write_header(bamxx::bam_out &out, const bamxx::bam_header &hdr) {
+    vector<string> names;
+    vector<uint64_t> lengths;
+    for (int i = 0; i < sam_hdr_nref(hdr.h); ++i) {
+      names.push_back(sam_hdr_tid2name(hdr.h, i));
+      lengths.push_back(sam_hdr_tid2len(hdr.h, i));
+    }
+    write(out, compact::file_header(names, lengths));
+  }
+
+  // must be called inside the critical section that writes records
+  static size_t write_block(bamxx::bam_out &out, const compact::block &b) {
+    if (b.n_records > 0) write(out, b.sealed);
+    return b.n_records;
+  }
+
+  static bool enabled;
+  static int compress_level;
+};
+
+bool compact_output::enabled = false;
+int compact_output::compress_level = -1;
+
+/* With an index made in shards (abismalidx -shards), reads are mapped
+ * against one shard at a time, so only one shard is in memory. Nothing
+ * is formatted in these passes: the best hits of each read are written
+ * in input order to a file of hits for the shard, with positions moved
+ * to the genome of all shards together. The hits of each read in all
+ * shards are then merged and formatted in a last pass over the reads.
+ */
+struct shard_hits {
+  static bool active() { return out != nullptr; }
+
+  static void add(const se_element &s, const bam_cigar_t &cigar,
+                  vector<uint8_t> &buf) {
+    add_hit(s, buf);
+    add_cigar(cigar, buf);
+  }
+
+  static void add(const pe_element &p, const se_element &s1,
+                  const se_element &s2, const bam_cigar_t &cigar1,
+                  const bam_cigar_t &cigar2, vector<uint8_t> &buf) {
+    pe_element moved(p);
+    moved.r1 = shifted(p.r1);
+    moved.r2 = shifted(p.r2);
+    add_bytes(moved, buf);
+    add_hit(s1, buf);
+    add_hit(s2, buf);
+    add_cigar(cigar1, buf);
+    add_cigar(cigar2, buf);
+  }
+
+  // must be called inside the critical section that writes records
+  static void write(vector<uint8_t> &buf) {
+    if (!buf.empty() && fwrite(buf.data(), 1, buf.size(), out) != buf.size())
+      throw runtime_error("failed to write hits of shard");
+    buf.clear();
+  }
+
+  static void read(FILE *in, se_element &s, bam_cigar_t &cigar) {
+    read_bytes(in, s);
+    read_cigar(in, cigar);
+  }
+
+  static void read(FILE *in, pe_element &p, se_element &s1, se_element &s2,
+                   bam_cigar_t &cigar1, bam_cigar_t &cigar2) {
+    read_bytes(in, p);
+    read_bytes(in, s1);
+    read_bytes(in, s2);
+    read_cigar(in, cigar1);
+    read_cigar(in, cigar2);
+  }
+
+  static FILE *out;        // hits of the shard being mapped
+  static uint32_t offset;  // of the shard in the genome of all shards
+
+private:
+  template<class T> static void add_bytes(const T &x, vector<uint8_t> &buf) {
+    const uint8_t *b = reinterpret_cast<const uint8_t *>(&x);
+    buf.insert(end(buf), b, b + sizeof(T));
+  }
+
+  template<class T> static void read_bytes(FILE *in, T &x) {
+    if (fread(&x, sizeof(T), 1, in) != 1)
+      throw runtime_error("hits of shard are truncated");
+  }
+
+  static se_element shifted(se_element s) {
+    if (!s.empty()) s.pos += offset;
+    return s;
+  }
+
+  static void add_hit(const se_element &s, vector<uint8_t> &buf) {
+    add_bytes(shifted(s), buf);
+  }
+
+  static void add_cigar(const bam_cigar_t &cigar, vector<uint8_t> &buf) {
+    add_bytes(static_cast<uint16_t>(cigar.size()), buf);
+    for (const uint32_t op : cigar) add_bytes(op, buf);
+  }
+
+  static void read_cigar(FILE *in, bam_cigar_t &cigar) {
+    uint16_t n_ops = 0;
+    read_bytes(in, n_ops);
+    cigar.resize(n_ops);
+    if (n_ops > 0 && fread(cigar.data(), sizeof(uint32_t), n_ops, in) != n_ops)
+      throw runtime_error("hits of shard are truncated");
+  }
+};
+
+FILE *shard_hits::out = nullptr;
+uint32_t shard_hits::offset = 0;
+
+static inline string
+stats_text(const se_map_stats &stats, const bool) {
+  return stats.tostring();
+}
+
+static inline string
+stats_text(const pe_map_stats &stats, const bool allow_ambig) {
+  return stats.tostring(allow_ambig);
+}
+
+/* With -follow, the output is flushed and the statistics file is
+ * rewritten as batches are written, so both can be used while the
+ * input is still growing. This is done at most once per
+ * flush_interval, unless a batch is not full, which means it used up
+ * the input written so far. The statistics file is replaced with a
+ * rename, so it is never seen half written. */
+struct follow_output {
+  // must be called inside the critical section that writes records
+  template<class stats_type> static void
+  batch_written(const size_t n_reads, const bool allow_ambig,
+                const stats_type &stats, bamxx::bam_out &out) {
+    if (!growing_file::following()) return;
+    n_pending += n_reads;
+    const double now = omp_get_wtime();
+    if (n_pending == 0 || (n_reads == ReadLoader::batch_size &&
+                           now - last_flush < flush_interval))
+      return;
+    if (hts_flush(out.f) < 0) throw runtime_error("failed to flush output");
+    last_flush = now;
+    n_pending = 0;
+    if (stats_file.empty()) return;
+    const string tmp_file = stats_file + ".tmp";
+    std::ofstream stats_of(tmp_file);
+    if (!(stats_of << stats_text(stats, allow_ambig)))
+      throw runtime_error("failed to write stats file: " + tmp_file);
+    stats_of.close();
+    if (std::rename(tmp_file.c_str(), stats_file.c_str()) != 0)
+      throw runtime_error("failed to write stats file: " + stats_file);
+  }
+
+  static string stats_file;
+  static size_t n_pending;  // reads written since the last flush
+  static double last_flush;
+  static constexpr double flush_interval = 1.0;
+};
+
+string follow_output::stats_file;
+size_t follow_output::n_pending = 0;
+double follow_output::last_flush = 0.0;
+
+/* Position in the input files after a batch of reads is loaded. For
+ * single-end reads both offsets refer to the same file. */
+struct input_position {
+  input_position(): n_reads(0), offset1(0), offset2(0) {}
+  input_position(const ReadLoader &rl1, const ReadLoader &rl2)
+      : n_reads(rl1.get_current_read()), offset1(rl1.tell()),
+        offset2(rl2.tell()) {}
+
+  size_t n_reads;
+  int64_t offset1;
+  int64_t offset2;
+};
+
+/* The checkpoint keeps track of how much of the input has been mapped
+ * and written, so an interrupted run can be resumed. When it is
+ * active, batches are written in the same order they are loaded, and
+ * the map statistics are updated as each batch is written, so the
+ * saved counts always agree with the records in the output. Passes
+ * over the shards of an index also keep the order, without a file.
+ */
+struct map_checkpoint {
+  map_checkpoint()
+      : in_order(false), interval(1), n_records(0), output_offset(-1),
+        n_loaded(0), n_written(0) {}
+
+  bool active() const { return !filename.empty(); }
+
+  // batches are written in the order they are loaded
+  bool ordered() const { return active() || in_order; }
+
+  // must be called inside the critical section that loads reads
+  size_t next_batch() { return n_loaded++; }
+
+  // wait until all batches loaded before this one have been written;
+  // threads sleep meanwhile, since one slow batch holds up the others
+  void wait_turn(const size_t batch_id) const {
+    if (!ordered()) return;
+    std::unique_lock<std::mutex> lock(turn_mutex);
+    turn.wait(lock, [&] { return n_written == batch_id; });
+  }
+
+  // must be called inside the critical section that writes records
+  template<class stats_type> void
+  batch_written(const size_t batch_id, const input_position &batch_end,
+                const size_t n_batch_records, const stats_type &stats,
+                bamxx::bam_out &out) {
+    if (!ordered()) return;
+    if (active()) {
+      pos = batch_end;
+      n_records += n_batch_records;
+      if ((batch_id + 1) % interval == 0) save(stats, out);
+    }
+    {
+      std::lock_guard<std::mutex> lock(turn_mutex);
+      n_written = batch_id + 1;
+    }
+    turn.notify_all();
+  }
+
+  template<class stats_type> void
+  save(const stats_type &stats, bamxx::bam_out &out) const;
+
+  template<class stats_type> bool
+  load(stats_type &stats);
+
+  void remove() const { std::remove(filename.c_str()); }
+
+  string filename;
+  string reads_file1;
+  string reads_file2;
+  string outfile;
+  string index;         // index (or genome) file
+  string options;       // mapping options that change the output
+  bool in_order;        // keep the order without a checkpoint file
+  size_t interval;      // number of batches between checkpoints
+  input_position pos;   // input consumed up to the last batch written
+  size_t n_records;     // number of records written to the output
+  int64_t output_offset;  // output bytes up to the last checkpoint
+  size_t n_loaded;      // batches loaded so far in this run
+  size_t n_written;     // batches written so far in this run
+  mutable std::mutex turn_mutex;  // guards n_written
+  mutable std::condition_variable turn;
+
+  static const string identifier;
+};
+
+const string map_checkpoint::identifier = "ABISMAL_CHECKPOINT";
+
+template<class stats_type> void
+map_checkpoint::save(const stats_type &stats, bamxx::bam_out &out) const {
+  // records must reach the output file before the checkpoint counts
+  // them. The flush also ends the BGZF block of a BAM output, so the
+  // file can be cut at its size and appended to on resuming
+  if (hts_flush(out.f) < 0)
+    throw runtime_error("failed to flush output file: " + outfile);
+  const size_t offset = get_filesize(outfile);
+
+  // ADS: write then rename, so the previous checkpoint stays valid if
+  // the run is interrupted while the new one is written
+  const string tmp_filename = filename + ".tmp";
+  std::ofstream of(tmp_filename);
+  if (!of) throw runtime_error("cannot open checkpoint file: " + tmp_filename);
+  of << identifier << endl
+     << "reads_file1: " << reads_file1 << endl
+     << "reads_file2: " << reads_file2 << endl
+     << "outfile: " << outfile << endl
+     << "index: " << index << endl
+     << "options: " << options << endl
+     << "reads: " << pos.n_reads << endl
+     << "offset1: " << pos.offset1 << endl
+     << "offset2: " << pos.offset2 << endl
+     << "records: " << n_records << endl
+     << "output_offset: " << offset << endl
+     << "stats: ";
+  stats.write(of) << endl;
+  of.close();
+  if (!of) throw runtime_error("failed writing checkpoint: " + tmp_filename);
+
+  if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+    throw runtime_error("failed to update checkpoint: " + filename);
+}
+
+template<class stats_type> bool
+map_checkpoint::load(stats_type &stats) {
+  std::ifstream in(filename);
+  if (!in) return false;  // nothing to resume
+
+  string line;
+  if (!getline(in, line) || line != identifier)
+    throw runtime_error("bad checkpoint file: " + filename);
+
+  static const string sep = ": ";
+  while (getline(in, line)) {
+    const size_t sep_pos = line.find(sep);
+    if (sep_pos == string::npos)
+      throw runtime_error("bad line in checkpoint file: " + line);
+    const string key = line.substr(0, sep_pos);
+    const string val = line.substr(sep_pos + sep.size());
+    std::istringstream iss(val);
+    if ((key == "reads_file1" && val != reads_file1) ||
+        (key == "reads_file2" && val != reads_file2) ||
+        (key == "outfile" && val != outfile) ||
+        (key == "index" && val != index) ||
+        (key == "options" && val != options))
+      throw runtime_error("checkpoint " + filename + " was made for " + key +
+                          " " + val);
+    else if (key == "reads") iss >> pos.n_reads;
+    else if (key == "offset1") iss >> pos.offset1;
+    else if (key == "offset2") iss >> pos.offset2;
+    else if (key == "records") iss >> n_records;
+    else if (key == "output_offset") iss >> output_offset;
+    else if (key == "stats") stats.read(iss);
+    if (!iss) throw runtime_error("bad value in checkpoint file: " + line);
+  }
+  if (output_offset < 0)
+    throw runtime_error("no output offset in checkpoint file: " + filename);
+  return true;
+}
+
+template<class rec_type> static void
 select_output(const bool allow_ambig, const ChromLookup &cl,
               const string &read1, const string &name1, const string &read2,
               const string &name2, const bam_cigar_t &cig1,
               const bam_cigar_t &cig2, pe_element &best, se_element &se1,
-              se_element &se2, bam_rec &sr1, bam_rec &sr2) {
+              se_element &se2, rec_type &sr1, rec_type &sr2) {
   const map_type pe_map_type = format_pe(allow_ambig, best, cl, read1, read2,
                                          name1, name2, cig1, cig2, sr1, sr2);
 
@@ -846,6 +2053,33 @@ select_output(const bool allow_ambig, const ChromLookup &cl,
   }
 }
 
+// formats a read in its record of the output, or in the block of the
+// batch for compact output
+static map_type
+format_output(const bool allow_ambig, const se_element &res,
+              const ChromLookup &cl, const string &read,
+              const string &read_name, const bam_cigar_t &cigar, bam_rec &sr,
+              compact::block &blk) {
+  return compact_output::enabled
+           ? format_se(allow_ambig, res, cl, read, read_name, cigar, blk)
+           : format_se(allow_ambig, res, cl, read, read_name, cigar, sr);
+}
+
+static void
+format_output(const bool allow_ambig, const ChromLookup &cl,
+              const string &read1, const string &name1, const string &read2,
+              const string &name2, const bam_cigar_t &cig1,
+              const bam_cigar_t &cig2, pe_element &best, se_element &se1,
+              se_element &se2, bam_rec &sr1, bam_rec &sr2,
+              compact::block &blk) {
+  if (compact_output::enabled)
+    select_output(allow_ambig, cl, read1, name1, read2, name2, cig1, cig2,
+                  best, se1, se2, blk, blk);
+  else
+    select_output(allow_ambig, cl, read1, name1, read2, name2, cig1, cig2,
+                  best, se1, se2, sr1, sr2);
+}
+
 /* GS: this function counts mismatches between read and genome when
  * they are packed as 64-bit integers, with 16 characters per integer.
  * The number of ones in the AND operation is the number of matches,
@@ -877,6 +2111,26 @@ full_compare(const score_t cutoff, const PackedRead::const_iterator read_end,
   return d;
 }
 
+/* Candidates compared with the genome, counted by each thread and
+ * summed when its mapping is done. Reported with -v, so the
+ * verification work of two indexes can be compared on the same reads. */
+struct verify_count {
+  static size_t &local() {
+    static thread_local size_t n = 0;
+    return n;
+  }
+
+  static void collect() {
+#pragma omp atomic
+    total += local();
+    local() = 0;
+  }
+
+  static size_t total;
+};
+
+size_t verify_count::total = 0;
+
 template<const uint16_t strand_code, const bool specific, class result_type>
 static inline void
 check_hits(const uint32_t offset, const PackedRead::const_iterator read_st,
@@ -884,6 +2138,7 @@ check_hits(const uint32_t offset, const PackedRead::const_iterator read_st,
            const Genome::const_iterator genome_st,
            const vector<uint32_t>::const_iterator &end_idx,
            vector<uint32_t>::const_iterator start_idx, result_type &res) {
+  const auto first_idx = start_idx;
   for (; start_idx != end_idx && !res.sure_ambig; ++start_idx) {
     // GS: adds the next candidate to L1d cache while current is compared
     _mm_prefetch(&(*(genome_st + ((*(start_idx + 10) - offset) >> 4))),
@@ -900,6 +2155,7 @@ check_hits(const uint32_t offset, const PackedRead::const_iterator read_st,
 
     if (diffs <= res.cutoff) res.update(specific, diffs, strand_code, the_pos);
   }
+  verify_count::local() += start_idx - first_idx;
 }
 
 struct compare_bases {
@@ -1001,22 +2257,129 @@ get_conv_type(const uint16_t strand_code) {
             : (c_to_t));
 }
 
-template<const uint16_t strand_code, class result_type> static void
-process_seeds(const uint32_t max_candidates,
-              const vector<uint32_t>::const_iterator counter_st,
-              const vector<uint32_t>::const_iterator counter_three_st,
-              const vector<uint32_t>::const_iterator index_st,
-              const vector<uint32_t>::const_iterator index_three_st,
-              const genome_iterator genome_st, const Read &read_seed,
-              const PackedRead &packed_read, result_type &res) {
+/* Low quality bases of a read, in the orientation its seeds are taken.
+ * Seeds overlapping a base below the minimum seed quality are not
+ * looked up, as they mostly give false candidates. The number of low
+ * quality bases before each position is kept, so each seed is checked
+ * with one subtraction. Reads without qualities, or where every seed
+ * has a low quality base, have all seeds looked up. */
+struct seed_quality {
+  seed_quality() : use(false) {}
+
+  // reversed for reads whose seeds come from the reverse complement
+  void set(const string &qual, const bool reversed) {
+    use = false;
+    if (qual.empty()) return;
+    const uint32_t len = qual.size();
+    n_low.resize(len + 1);
+    n_low[0] = 0;
+    for (uint32_t i = 0; i < len; ++i) {
+      const uint8_t q = qual[reversed ? len - 1 - i : i];
+      n_low[i + 1] = n_low[i] + (q < ReadLoader::min_seed_qual);
+    }
+    if (n_low[len] == 0 || len < seed::span_two) return;
+    for (uint32_t i = 0; i + seed::span_two <= len && !use; ++i)
+      use = (n_low[i + seed::span_two] == n_low[i]);
+  }
+
+  bool skip(const uint32_t pos, const uint32_t span) const {
+    if (!use) return false;
+    const uint32_t lim = n_low.size() - 1;
+    return n_low[min(pos + span, lim)] != n_low[pos];
+  }
+
+  bool use;
+  vector<uint32_t> n_low;
+};
+
+/* Adapts the candidates verified for each read to what its seeds show
+ * (-adaptive). Every bucket looked up in the specific pass is verified,
+ * and exact hits survive the narrowing, so once a single-end read has
+ * an exact hit the sensitive pass only finds worse candidates, and is
+ * skipped. A read whose buckets all stay over max_candidates after
+ * narrowing is in a repeat: after a few of these huge buckets are
+ * verified the rest are not, and the sensitive pass gets a smaller
+ * budget. Each thread still runs the sensitive pass for one in
+ * probe_interval of the reads that would skip it, and stops skipping
+ * while too many of these probes change the result. The probes start
+ * over with each batch, so the output does not depend on which thread
+ * maps which batch, nor on the number of threads. */
+struct candidate_controller {
+  candidate_controller() : n_skippable(0), change_rate(0.0) {}
+
+  void start_batch() {
+    n_skippable = 0;
+    change_rate = 0.0;
+  }
+
+  // true if this read should run the sensitive pass to check skipping
+  bool probe() {
+    return change_rate > max_change_rate ||
+           (++n_skippable % probe_interval) == 0;
+  }
+
+  void observe(const bool changed) {
+    change_rate += (static_cast<double>(changed) - change_rate) / 16.0;
+  }
+
+  uint32_t n_skippable;
+  double change_rate;  // moving average over recent probes
+
+  static bool enabled;
+  static const uint32_t probe_interval = 32;
+  static const uint32_t max_huge_buckets = 4;
+  static const uint32_t repeat_budget_fraction = 4;
+  static constexpr double max_change_rate = 0.01;
+};
+
+bool candidate_controller::enabled = false;
+
+static candidate_controller &
+thread_controller() {
+  static thread_local candidate_controller ctl;
+  return ctl;
+}
+
+// paired-end candidates are all kept for mating, so only single-end
+// reads stop at an exact hit
+static inline bool
+stops_at_exact_hit(const se_candidates &res) {
+  return res.has_exact_match();
+}
+
+static inline bool
+stops_at_exact_hit(const pe_candidates &) {
+  return false;
+}
+
+static inline se_element
+result_summary(const se_candidates &res) {
+  return res.best;
+}
+
+static inline se_element
+result_summary(const pe_candidates &) {
+  return se_element();
+}
+
+template<const uint16_t strand_code, const bool spaced, class result_type>
+static void
+process_seeds_impl(const uint32_t max_candidates,
+                   const vector<uint32_t>::const_iterator counter_st,
+                   const vector<uint32_t>::const_iterator counter_three_st,
+                   const vector<uint32_t>::const_iterator index_st,
+                   const vector<uint32_t>::const_iterator index_three_st,
+                   const genome_iterator genome_st, const Read &read_seed,
+                   const PackedRead &packed_read, const seed_quality &sq,
+                   result_type &res) {
   static constexpr three_conv_type the_conv = get_conv_type(strand_code);
 
   const uint32_t readlen = read_seed.size();
   const PackedRead::const_iterator pack_s_idx(begin(packed_read));
   const PackedRead::const_iterator pack_e_idx(end(packed_read));
 
-  uint32_t k = 0u;
-  uint32_t k_three = 0u;
+  two_letter_key<spaced> k;
+  three_letter_key<the_conv, spaced> k_three;
   uint32_t i = 0u;
 
   Read::const_iterator read_idx(begin(read_seed));
@@ -1033,78 +2396,137 @@ process_seeds(const uint32_t max_candidates,
   get_1bit_hash(read_idx, k);
   get_base_3_hash<the_conv>(read_idx, k_three);
 
+  const uint32_t window_size = seed::window_size;
   const uint32_t specific_len =
-    min16(readlen - seed::window_size, readlen >> 1u);
-  const uint32_t specific_lim =
-    max16(seed::window_size, static_cast<uint32_t>(readlen >> 1u));
+    min16(readlen - window_size, readlen >> 1u);
+  uint32_t specific_lim =
+    max16(window_size, static_cast<uint32_t>(readlen >> 1u));
+  // spaced seeds must fit in the read
+  if (spaced)
+    specific_lim = min16(specific_lim, readlen - seed::span_two + 1);
+
+  // buckets over max_candidates after narrowing, and within it
+  const bool adaptive = candidate_controller::enabled;
+  uint32_t n_huge = 0;
+  uint32_t n_small = 0;
+  const uint32_t max_huge = adaptive ? candidate_controller::max_huge_buckets
+                                     : std::numeric_limits<uint32_t>::max();
 
   res.set_specific();
   for (i = 0; i < specific_lim && !res.sure_ambig; ++i, ++read_idx) {
-    s_idx = index_st + *(counter_st + k);
-    e_idx = index_st + *(counter_st + k + 1);
-    l_two = find_candidates<seed::key_weight>(
-      max_candidates, read_idx, genome_st, readlen - i, s_idx, e_idx);
-    d_two = (e_idx - s_idx);
-
-    s_idx_three = index_three_st + *(counter_three_st + k_three);
-    e_idx_three = index_three_st + *(counter_three_st + k_three + 1);
-    l_three = find_candidates_three<seed::key_weight_three, the_conv>(
-      max_candidates, read_idx, genome_st, readlen - i, s_idx_three,
-      e_idx_three);
-
-    d_three = (e_idx_three - s_idx_three);
-
     // two-letter seeds
-    if (d_two <= max_candidates || l_two >= specific_len)
-      check_hits<strand_code, true>(i, pack_s_idx, pack_e_idx, genome_st.itr,
-                                    e_idx, s_idx, res);
+    if (!sq.skip(i, seed::span_two)) {
+      s_idx = index_st + *(counter_st + k.hash);
+      e_idx = index_st + *(counter_st + k.hash + 1);
+      l_two = find_candidates<seed::key_weight>(
+        max_candidates, read_idx, genome_st, readlen - i, s_idx, e_idx);
+      d_two = (e_idx - s_idx);
+      const bool huge = (d_two > max_candidates);
+      n_huge += huge;
+      n_small += !huge;
+      if ((d_two <= max_candidates || l_two >= specific_len) &&
+          !(huge && n_huge > max_huge))
+        check_hits<strand_code, true>(i, pack_s_idx, pack_e_idx,
+                                      genome_st.itr, e_idx, s_idx, res);
+    }
 
     // three-letter seeds
-    if (d_three <= max_candidates || l_three >= specific_len)
-      check_hits<strand_code, true>(i, pack_s_idx, pack_e_idx, genome_st.itr,
-                                    e_idx_three, s_idx_three, res);
+    if (!sq.skip(i, seed::span_three)) {
+      s_idx_three = index_three_st + *(counter_three_st + k_three.hash);
+      e_idx_three = index_three_st + *(counter_three_st + k_three.hash + 1);
+      l_three = find_candidates_three<seed::key_weight_three, the_conv>(
+        max_candidates, read_idx, genome_st, readlen - i, s_idx_three,
+        e_idx_three);
+      d_three = (e_idx_three - s_idx_three);
+      const bool huge = (d_three > max_candidates);
+      n_huge += huge;
+      n_small += !huge;
+      if ((d_three <= max_candidates || l_three >= specific_len) &&
+          !(huge && n_huge > max_huge))
+        check_hits<strand_code, true>(i, pack_s_idx, pack_e_idx,
+                                      genome_st.itr, e_idx_three,
+                                      s_idx_three, res);
+    }
 
-    shift_hash_key(*(read_idx + seed::key_weight), k);
-    shift_three_key<the_conv>(*(read_idx + seed::key_weight_three), k_three);
+    k.shift(*(read_idx + seed::span_two));
+    k_three.shift(*(read_idx + seed::span_three));
   }
 
   if (!res.should_do_sensitive()) return;
 
+  uint32_t budget = max_candidates;
+  bool probing = false;
+  se_element before;
+  if (adaptive) {
+    candidate_controller &ctl = thread_controller();
+    if (stops_at_exact_hit(res)) {
+      if (!ctl.probe()) return;
+      probing = true;
+      before = result_summary(res);
+    }
+    else if (n_small == 0 && n_huge > 0)
+      budget = max(1u, max_candidates /
+                         candidate_controller::repeat_budget_fraction);
+  }
+
   read_idx = begin(read_seed);
   get_1bit_hash(read_idx, k);
   get_base_3_hash<the_conv>(read_idx, k_three);
 
   res.set_sensitive();
 
-  const uint32_t lim_two = readlen - seed::key_weight + 1;
+  const uint32_t lim_two = readlen - seed::span_two + 1;
 
   // GS: this is to avoid chasing down uninformative two-letter
   // seeds when there is a sufficiently high number of three
   // letter seeds that is lower than the number of two-letter hits
   static const uint32_t MIN_FOLD_SIZE = 10;
   for (i = 0; i < lim_two && !res.sure_ambig; ++i, ++read_idx) {
-    s_idx = index_st + *(counter_st + k);
-    e_idx = index_st + *(counter_st + k + 1);
+    s_idx = index_st + *(counter_st + k.hash);
+    e_idx = index_st + *(counter_st + k.hash + 1);
     d_two = (e_idx - s_idx);
 
-    s_idx_three = index_three_st + *(counter_three_st + k_three);
-    e_idx_three = index_three_st + *(counter_three_st + k_three + 1);
+    s_idx_three = index_three_st + *(counter_three_st + k_three.hash);
+    e_idx_three = index_three_st + *(counter_three_st + k_three.hash + 1);
     d_three = (e_idx_three - s_idx_three);
 
     // two-letter seeds
-    if (d_two != 0 && d_two <= max_candidates &&
-        (d_three == 0 || d_two <= MIN_FOLD_SIZE * d_three))
+    if (d_two != 0 && d_two <= budget &&
+        (d_three == 0 || d_two <= MIN_FOLD_SIZE * d_three) &&
+        !sq.skip(i, seed::span_two))
       check_hits<strand_code, true>(i, pack_s_idx, pack_e_idx, genome_st.itr,
                                     e_idx, s_idx, res);
 
     // three-letter seeds
-    if (d_three != 0 && d_three <= max_candidates)
+    if (d_three != 0 && d_three <= budget &&
+        !sq.skip(i, seed::span_three))
       check_hits<strand_code, true>(i, pack_s_idx, pack_e_idx, genome_st.itr,
                                     e_idx_three, s_idx_three, res);
 
-    shift_hash_key(*(read_idx + seed::key_weight), k);
-    shift_three_key<the_conv>(*(read_idx + seed::key_weight_three), k_three);
+    k.shift(*(read_idx + seed::span_two));
+    k_three.shift(*(read_idx + seed::span_three));
   }
+
+  if (probing) thread_controller().observe(result_summary(res) != before);
+}
+
+template<const uint16_t strand_code, class result_type> static inline void
+process_seeds(const uint32_t max_candidates,
+              const vector<uint32_t>::const_iterator counter_st,
+              const vector<uint32_t>::const_iterator counter_three_st,
+              const vector<uint32_t>::const_iterator index_st,
+              const vector<uint32_t>::const_iterator index_three_st,
+              const genome_iterator genome_st, const Read &read_seed,
+              const PackedRead &packed_read, const seed_quality &sq,
+              result_type &res) {
+  if (seed::is_spaced())
+    process_seeds_impl<strand_code, true>(
+      max_candidates, counter_st, counter_three_st, index_st, index_three_st,
+      genome_st, read_seed, packed_read, sq, res);
+  else
+    process_seeds_impl<strand_code, false>(
+      max_candidates, counter_st, counter_three_st, index_st, index_three_st,
+      genome_st, read_seed, packed_read, sq, res);
 }
 
 template<const bool convert_a_to_g> static void
@@ -1241,7 +2663,9 @@ template<const conversion_type conv> static void
 map_single_ended(const bool VERBOSE, const bool show_progress,
                  const bool allow_ambig, const AbismalIndex &abismal_index,
                  ReadLoader &rl, se_map_stats &se_stats, bamxx::bam_header &hdr,
-                 bamxx::bam_out &out, ProgressBar &progress) {
+                 bamxx::bam_out &out, ProgressBar &progress,
+                 map_checkpoint &ckpt, const uint32_t locality_cache_size,
+                 buffer_usage &usage, output_stats &ostats) {
   const auto counter_st(begin(abismal_index.counter));
   const auto counter_t_st(begin(abismal_index.counter_t));
   const auto counter_a_st(begin(abismal_index.counter_a));
@@ -1256,12 +2680,14 @@ map_single_ended(const bool VERBOSE, const bool show_progress,
   // batch variables used in reporting the SAM entry
   vector<string> names;
   vector<string> reads;
+  vector<string> quals;
   vector<bam_cigar_t> cigar;
   vector<se_element> bests;
   vector<bam_rec> mr;
 
   names.reserve(ReadLoader::batch_size);
   reads.reserve(ReadLoader::batch_size);
+  quals.reserve(ReadLoader::batch_size);
 
   cigar.resize(ReadLoader::batch_size);
   bests.resize(ReadLoader::batch_size);
@@ -1269,75 +2695,172 @@ map_single_ended(const bool VERBOSE, const bool show_progress,
 
   // pre-allocated variabes used idependently in each read
   Read pread, pread_rc;
+  seed_quality sq, sq_rc;
   PackedRead packed_pread;
+  string read_rc;
   se_candidates res;
   AbismalAlignSimple aln(genome_st);
+  locality_cache<se_result> cache(locality_cache_size);
+  buffer_usage thread_usage;
+  compact::block cblock;  // the records of a batch in compact output
+  vector<uint8_t> hits;   // the hits of a batch in a pass over a shard
 
   size_t the_byte = 0;
+  size_t batch_id = 0;
+  input_position batch_end;
 
   while (rl) {
+    const double load_wait = thread_trace::now();
 #pragma omp critical
     {
-      rl.load_reads(names, reads);
+      const double load_start = thread_trace::now();
+      alloc_trace::set_phase(alloc_trace::load);
+      rl.load_reads(names, reads, quals);
       the_byte = rl.get_current_byte();
+      batch_id = ckpt.next_batch();
+      batch_end = input_position(rl, rl);
+      thread_trace::span("load", load_start, thread_trace::now(), batch_id,
+                         reads.size(), load_start - load_wait);
     }
 
+    alloc_trace::set_phase(alloc_trace::map);
+    thread_controller().start_batch();
+    // a cached read skips the probes, which must depend only on the batch
+    if (candidate_controller::enabled) cache.clear();
+    const double map_start = thread_trace::now();
+    double format_us = 0.0;
     size_t max_batch_read_length = 0;
     update_max_read_length(max_batch_read_length, reads);
 
     aln.reset(max_batch_read_length);
 
     const size_t n_reads = reads.size();
+    uint32_t n_prefiltered = 0;
 
     for (size_t i = 0; i < n_reads; ++i) {
       res.reset(reads[i].size());
       bests[i].reset();
-      if (!reads[i].empty()) {
-        prep_read<conv>(reads[i], pread);
-        pack_read(pread, packed_pread);
-        process_seeds<get_strand_code('+', conv)>(
-          max_candidates, counter_st,
-          ((conv == t_rich) ? (counter_t_st) : (counter_a_st)),
-
-          index_st, ((conv == t_rich) ? (index_t_st) : (index_a_st)), genome_st,
-          pread, packed_pread, res);
-
-        const string read_rc(revcomp(reads[i]));
-        prep_read<!conv>(read_rc, pread_rc);
-        pack_read(pread_rc, packed_pread);
-
-        process_seeds<get_strand_code('-', conv)>(
-          max_candidates, counter_st,
-          (conv == t_rich) ? counter_a_st : counter_t_st, index_st,
-          (conv == t_rich) ? index_a_st : index_t_st, genome_st, pread_rc,
-          packed_pread, res);
-
-        align_se_candidates(pread, pread_rc, pread, pread_rc,
-                            se_element::valid_frac, res, bests[i], cigar[i],
-                            aln);
-        if (format_se(allow_ambig, bests[i], abismal_index.cl, reads[i],
-                      names[i], cigar[i], mr[i]) == map_unmapped)
+      if (read_prefilter::enabled &&
+          read_prefilter::hopeless(reads[i], conv == a_rich))
+        ++n_prefiltered;
+      else if (!reads[i].empty()) {
+        const se_result *cached = cache.find(reads[i], quals[i]);
+        if (cached) {
+          bests[i] = cached->best;
+          cigar[i] = cached->cigar;
+        }
+        else {
+          sq.set(quals[i], false);
+          sq_rc.set(quals[i], true);
+          prep_read<conv>(reads[i], pread);
+          pack_read(pread, packed_pread);
+          process_seeds<get_strand_code('+', conv)>(
+            max_candidates, counter_st,
+            ((conv == t_rich) ? (counter_t_st) : (counter_a_st)),
+
+            index_st, ((conv == t_rich) ? (index_t_st) : (index_a_st)),
+            genome_st, pread, packed_pread, sq, res);
+
+          read_rc = reads[i];
+          revcomp_inplace(read_rc);
+          prep_read<!conv>(read_rc, pread_rc);
+          pack_read(pread_rc, packed_pread);
+
+          process_seeds<get_strand_code('-', conv)>(
+            max_candidates, counter_st,
+            (conv == t_rich) ? counter_a_st : counter_t_st, index_st,
+            (conv == t_rich) ? index_a_st : index_t_st, genome_st, pread_rc,
+            packed_pread, sq_rc, res);
+
+          align_se_candidates(pread, pread_rc, pread, pread_rc,
+                              se_element::valid_frac, res, bests[i], cigar[i],
+                              aln);
+          cache.insert(reads[i], quals[i], string(), string(),
+                       se_result(bests[i], cigar[i]));
+        }
+        alloc_trace::set_phase(alloc_trace::format);
+        const double format_start = thread_trace::now();
+        // in a pass over one shard, reads are formatted after merging
+        if (!shard_hits::active() &&
+            format_output(allow_ambig, bests[i], abismal_index.cl, reads[i],
+                          names[i], cigar[i], mr[i],
+                          cblock) == map_unmapped)
           bests[i].reset();
+        format_us += thread_trace::now() - format_start;
+        alloc_trace::set_phase(alloc_trace::map);
       }
     }
+    if (compact_output::enabled) {
+      alloc_trace::set_phase(alloc_trace::format);
+      const double seal_start = thread_trace::now();
+      cblock.seal(compact_output::compress_level);
+      format_us += thread_trace::now() - seal_start;
+    }
+    if (shard_hits::active())
+      for (size_t i = 0; i < n_reads; ++i)
+        shard_hits::add(bests[i], cigar[i], hits);
+    alloc_trace::set_phase(alloc_trace::write);
+    // formatting is interleaved with mapping read by read, so its total
+    // for the batch is shown at the end of the mapping
+    const double write_wait = thread_trace::now();
+    thread_trace::span("map", map_start, write_wait - format_us, batch_id,
+                       n_reads);
+    thread_trace::span("format", write_wait - format_us, write_wait,
+                       batch_id, n_reads);
+    ckpt.wait_turn(batch_id);
 #pragma omp critical
     {
+      const double write_start = omp_get_wtime();
+      const double trace_write_start = thread_trace::now();
+      size_t n_records = 0;
       for (size_t i = 0; i < n_reads; ++i) {
-        if (valid_bam_rec(mr[i]) && !out.write(hdr, mr[i]))
-          throw runtime_error("failed to write bam");
+        if (valid_bam_rec(mr[i])) {
+          if (!out.write(hdr, mr[i]))
+            throw runtime_error("failed to write bam");
+          ++n_records;
+        }
+        se_stats.update(allow_ambig, reads[i], cigar[i], bests[i]);
       }
+      se_stats.prefiltered_rds += n_prefiltered;
+      n_records += compact_output::write_block(out, cblock);
+      shard_hits::write(hits);
+      ckpt.batch_written(batch_id, batch_end, n_records, se_stats, out);
+      follow_output::batch_written(n_reads, allow_ambig, se_stats, out);
+      ostats.write_seconds += omp_get_wtime() - write_start;
+      thread_trace::span("write", trace_write_start, thread_trace::now(),
+                         batch_id, n_reads, trace_write_start - write_wait);
     }
+    if (VERBOSE)
+      thread_usage.records = max(thread_usage.records,
+                                 vector_bytes(mr) + cblock.memory_bytes());
     for (size_t i = 0; i < n_reads; ++i) {
       if (valid_bam_rec(mr[i])) reset_bam_rec(mr[i]);
-      se_stats.update(allow_ambig, reads[i], cigar[i], bests[i]);
       cigar[i].clear();
     }
+    cblock.clear();
+    alloc_trace::batch_done(n_reads);
+    // a batch is empty at the end of the input, or when the input
+    // being followed has nothing new
+    if (n_reads == 0) rl.wait_for_input();
     if (show_progress)
 #pragma omp critical
     {
       if (progress.time_to_report(the_byte)) progress.report(cerr, the_byte);
     }
   }
+  if (VERBOSE) {
+    thread_usage.batch = vector_bytes(names) + vector_bytes(reads) +
+                         vector_bytes(cigar) + vector_bytes(bests) +
+                         vector_bytes(packed_pread) + vector_bytes(pread) +
+                         vector_bytes(pread_rc);
+    thread_usage.candidates = vector_bytes(res.v);
+    thread_usage.alignment =
+      vector_bytes(aln.table) + vector_bytes(aln.traceback);
+    thread_usage.cache = cache.memory_bytes();
+#pragma omp critical
+    usage.add(thread_usage);
+  }
+  verify_count::collect();
 }
 
 static void
@@ -1345,7 +2868,9 @@ map_single_ended_rand(const bool VERBOSE, const bool show_progress,
                       const bool allow_ambig, const AbismalIndex &abismal_index,
                       ReadLoader &rl, se_map_stats &se_stats,
                       bamxx::bam_header &hdr, bamxx::bam_out &out,
-                      ProgressBar &progress) {
+                      ProgressBar &progress, map_checkpoint &ckpt,
+                      const uint32_t locality_cache_size,
+                      buffer_usage &usage, output_stats &ostats) {
   const auto counter_st(begin(abismal_index.counter));
   const auto counter_t_st(begin(abismal_index.counter_t));
   const auto counter_a_st(begin(abismal_index.counter_a));
@@ -1360,12 +2885,14 @@ map_single_ended_rand(const bool VERBOSE, const bool show_progress,
 
   vector<string> names;
   vector<string> reads;
+  vector<string> quals;
   vector<bam_cigar_t> cigar;
   vector<se_element> bests;
   vector<bam_rec> mr;
 
   names.reserve(ReadLoader::batch_size);
   reads.reserve(ReadLoader::batch_size);
+  quals.reserve(ReadLoader::batch_size);
   cigar.resize(ReadLoader::batch_size);
   bests.resize(ReadLoader::batch_size);
   mr.resize(ReadLoader::batch_size);
@@ -1373,83 +2900,185 @@ map_single_ended_rand(const bool VERBOSE, const bool show_progress,
   // GS: pre-allocated variables used once per read
   // and not used for reporting
   Read pread_t, pread_t_rc, pread_a, pread_a_rc;
+  seed_quality sq, sq_rc;
   PackedRead packed_pread;
+  string read_rc;
   se_candidates res;
   AbismalAlignSimple aln(genome_st);
+  locality_cache<se_result> cache(locality_cache_size);
+  buffer_usage thread_usage;
+  compact::block cblock;  // the records of a batch in compact output
+  vector<uint8_t> hits;   // the hits of a batch in a pass over a shard
 
   size_t the_byte = 0;
+  size_t batch_id = 0;
+  input_position batch_end;
 
   while (rl) {
+    const double load_wait = thread_trace::now();
 #pragma omp critical
     {
-      rl.load_reads(names, reads);
+      const double load_start = thread_trace::now();
+      alloc_trace::set_phase(alloc_trace::load);
+      rl.load_reads(names, reads, quals);
       the_byte = rl.get_current_byte();
+      batch_id = ckpt.next_batch();
+      batch_end = input_position(rl, rl);
+      thread_trace::span("load", load_start, thread_trace::now(), batch_id,
+                         reads.size(), load_start - load_wait);
     }
 
+    alloc_trace::set_phase(alloc_trace::map);
+    thread_controller().start_batch();
+    // a cached read skips the probes, which must depend only on the batch
+    if (candidate_controller::enabled) cache.clear();
+    const double map_start = thread_trace::now();
+    double format_us = 0.0;
     size_t max_batch_read_length = 0;
     update_max_read_length(max_batch_read_length, reads);
 
     aln.reset(max_batch_read_length);
 
     const size_t n_reads = reads.size();
+    uint32_t n_prefiltered = 0;
     for (size_t i = 0; i < n_reads; ++i) {
       res.reset(reads[i].size());
       bests[i].reset();
-      if (!reads[i].empty()) {
-        // T-rich, + strand
-        prep_read<t_rich>(reads[i], pread_t);
-        pack_read(pread_t, packed_pread);
-        process_seeds<get_strand_code('+', t_rich)>(
-          max_candidates, counter_st, counter_t_st, index_st, index_t_st,
-          genome_st, pread_t, packed_pread, res);
-
-        // A-rich, + strand
-        prep_read<a_rich>(reads[i], pread_a);
-        pack_read(pread_a, packed_pread);
-        process_seeds<get_strand_code('+', a_rich)>(
-          max_candidates, counter_st, counter_a_st, index_st, index_a_st,
-          genome_st, pread_a, packed_pread, res);
-
-        // A-rich, - strand
-        const string read_rc(revcomp(reads[i]));
-        prep_read<t_rich>(read_rc, pread_t_rc);
-        pack_read(pread_t_rc, packed_pread);
-        process_seeds<get_strand_code('-', a_rich)>(
-          max_candidates, counter_st, counter_t_st, index_st, index_t_st,
-          genome_st, pread_t_rc, packed_pread, res);
-
-        // T-rich, - strand
-        prep_read<a_rich>(read_rc, pread_a_rc);
-        pack_read(pread_a_rc, packed_pread);
-        process_seeds<get_strand_code('-', t_rich)>(
-          max_candidates, counter_st, counter_a_st, index_st, index_a_st,
-          genome_st, pread_a_rc, packed_pread, res);
-
-        align_se_candidates(pread_t, pread_t_rc, pread_a, pread_a_rc,
-                            se_element::valid_frac, res, bests[i], cigar[i],
-                            aln);
-        if (format_se(allow_ambig, bests[i], abismal_index.cl, reads[i],
-                      names[i], cigar[i], mr[i]) == map_unmapped)
+      // either conversion may map, so both must be hopeless
+      if (read_prefilter::enabled &&
+          read_prefilter::hopeless(reads[i], false) &&
+          read_prefilter::hopeless(reads[i], true))
+        ++n_prefiltered;
+      else if (!reads[i].empty()) {
+        const se_result *cached = cache.find(reads[i], quals[i]);
+        if (cached) {
+          bests[i] = cached->best;
+          cigar[i] = cached->cigar;
+        }
+        else {
+          sq.set(quals[i], false);
+          sq_rc.set(quals[i], true);
+
+          // T-rich, + strand
+          prep_read<t_rich>(reads[i], pread_t);
+          pack_read(pread_t, packed_pread);
+          process_seeds<get_strand_code('+', t_rich)>(
+            max_candidates, counter_st, counter_t_st, index_st, index_t_st,
+            genome_st, pread_t, packed_pread, sq, res);
+
+          // A-rich, + strand
+          prep_read<a_rich>(reads[i], pread_a);
+          pack_read(pread_a, packed_pread);
+          process_seeds<get_strand_code('+', a_rich)>(
+            max_candidates, counter_st, counter_a_st, index_st, index_a_st,
+            genome_st, pread_a, packed_pread, sq, res);
+
+          // A-rich, - strand
+          read_rc = reads[i];
+          revcomp_inplace(read_rc);
+          prep_read<t_rich>(read_rc, pread_t_rc);
+          pack_read(pread_t_rc, packed_pread);
+          process_seeds<get_strand_code('-', a_rich)>(
+            max_candidates, counter_st, counter_t_st, index_st, index_t_st,
+            genome_st, pread_t_rc, packed_pread, sq_rc, res);
+
+          // T-rich, - strand
+          prep_read<a_rich>(read_rc, pread_a_rc);
+          pack_read(pread_a_rc, packed_pread);
+          process_seeds<get_strand_code('-', t_rich)>(
+            max_candidates, counter_st, counter_a_st, index_st, index_a_st,
+            genome_st, pread_a_rc, packed_pread, sq_rc, res);
+
+          align_se_candidates(pread_t, pread_t_rc, pread_a, pread_a_rc,
+                              se_element::valid_frac, res, bests[i], cigar[i],
+                              aln);
+          cache.insert(reads[i], quals[i], string(), string(),
+                       se_result(bests[i], cigar[i]));
+        }
+        alloc_trace::set_phase(alloc_trace::format);
+        const double format_start = thread_trace::now();
+        // in a pass over one shard, reads are formatted after merging
+        if (!shard_hits::active() &&
+            format_output(allow_ambig, bests[i], abismal_index.cl, reads[i],
+                          names[i], cigar[i], mr[i],
+                          cblock) == map_unmapped)
           bests[i].reset();
+        format_us += thread_trace::now() - format_start;
+        alloc_trace::set_phase(alloc_trace::map);
       }
     }
+    if (compact_output::enabled) {
+      alloc_trace::set_phase(alloc_trace::format);
+      const double seal_start = thread_trace::now();
+      cblock.seal(compact_output::compress_level);
+      format_us += thread_trace::now() - seal_start;
+    }
+    if (shard_hits::active())
+      for (size_t i = 0; i < n_reads; ++i)
+        shard_hits::add(bests[i], cigar[i], hits);
+    alloc_trace::set_phase(alloc_trace::write);
+    // formatting is interleaved with mapping read by read, so its total
+    // for the batch is shown at the end of the mapping
+    const double write_wait = thread_trace::now();
+    thread_trace::span("map", map_start, write_wait - format_us, batch_id,
+                       n_reads);
+    thread_trace::span("format", write_wait - format_us, write_wait,
+                       batch_id, n_reads);
+    ckpt.wait_turn(batch_id);
 #pragma omp critical
     {
-      for (size_t i = 0; i < n_reads; ++i)
-        if (valid_bam_rec(mr[i]) && !out.write(hdr, mr[i]))
-          throw runtime_error("failed to write bam");
+      const double write_start = omp_get_wtime();
+      const double trace_write_start = thread_trace::now();
+      size_t n_records = 0;
+      for (size_t i = 0; i < n_reads; ++i) {
+        if (valid_bam_rec(mr[i])) {
+          if (!out.write(hdr, mr[i]))
+            throw runtime_error("failed to write bam");
+          ++n_records;
+        }
+        se_stats.update(allow_ambig, reads[i], cigar[i], bests[i]);
+      }
+      se_stats.prefiltered_rds += n_prefiltered;
+      n_records += compact_output::write_block(out, cblock);
+      shard_hits::write(hits);
+      ckpt.batch_written(batch_id, batch_end, n_records, se_stats, out);
+      follow_output::batch_written(n_reads, allow_ambig, se_stats, out);
+      ostats.write_seconds += omp_get_wtime() - write_start;
+      thread_trace::span("write", trace_write_start, thread_trace::now(),
+                         batch_id, n_reads, trace_write_start - write_wait);
     }
+    if (VERBOSE)
+      thread_usage.records = max(thread_usage.records,
+                                 vector_bytes(mr) + cblock.memory_bytes());
     for (size_t i = 0; i < n_reads; ++i) {
       if (valid_bam_rec(mr[i])) reset_bam_rec(mr[i]);
-      se_stats.update(allow_ambig, reads[i], cigar[i], bests[i]);
       cigar[i].clear();
     }
+    cblock.clear();
+    alloc_trace::batch_done(n_reads);
+    // a batch is empty at the end of the input, or when the input
+    // being followed has nothing new
+    if (n_reads == 0) rl.wait_for_input();
     if (show_progress)
 #pragma omp critical
     {
       if (progress.time_to_report(the_byte)) progress.report(cerr, the_byte);
     }
   }
+  if (VERBOSE) {
+    thread_usage.batch = vector_bytes(names) + vector_bytes(reads) +
+                         vector_bytes(cigar) + vector_bytes(bests) +
+                         vector_bytes(packed_pread) + vector_bytes(pread_t) +
+                         vector_bytes(pread_t_rc) + vector_bytes(pread_a) +
+                         vector_bytes(pread_a_rc);
+    thread_usage.candidates = vector_bytes(res.v);
+    thread_usage.alignment =
+      vector_bytes(aln.table) + vector_bytes(aln.traceback);
+    thread_usage.cache = cache.memory_bytes();
+#pragma omp critical
+    usage.add(thread_usage);
+  }
+  verify_count::collect();
 }
 
 static string
@@ -1460,12 +3089,60 @@ format_time_in_sec(const double t) {
   return oss.str();
 }
 
+static string
+format_bytes(const size_t n_bytes) {
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(1) << n_bytes / (1024.0 * 1024.0)
+      << " MB";
+  return oss.str();
+}
+
+/* Memory held by the index, by the buffers of the mapping threads and
+ * for I/O, reported under -v so jobs can be sized before they run. */
+static void
+report_memory(const AbismalIndex &abismal_index, const buffer_usage &usage,
+              const size_t n_input_files) {
+  static const string t = "    ";
+  typedef vector<std::pair<string, size_t>> usage_list;
+  const usage_list index_usage(abismal_index.memory_usage());
+
+  size_t index_total = 0;
+  std::ostringstream oss;
+  oss << "memory usage:" << endl << t << "index:" << endl;
+  for (auto it(begin(index_usage)); it != end(index_usage); ++it) {
+    oss << t << t << it->first << ": " << format_bytes(it->second) << endl;
+    index_total += it->second;
+  }
+  oss << t << t << "total: " << format_bytes(index_total) << endl;
+
+  const size_t buffers_total = usage.candidates + usage.alignment +
+                               usage.batch + usage.records + usage.cache;
+  oss << t << "thread buffers (" << usage.n_threads << " threads):" << endl
+      << t << t << "candidates: " << format_bytes(usage.candidates) << endl
+      << t << t << "alignment: " << format_bytes(usage.alignment) << endl
+      << t << t << "batch: " << format_bytes(usage.batch) << endl
+      << t << t << "bam records: " << format_bytes(usage.records) << endl
+      << t << t << "locality cache: " << format_bytes(usage.cache) << endl
+      << t << t << "total: " << format_bytes(buffers_total) << endl;
+
+  // each BGZF stream, input or output, keeps a compressed and an
+  // uncompressed block; htslib thread queues are not counted
+  const size_t io_total = (n_input_files + 1) * 2 * BGZF_MAX_BLOCK_SIZE;
+  oss << t << "io buffers (estimate): " << format_bytes(io_total) << endl
+      << t << "peak RSS: " << format_bytes(get_peak_rss());
+  print_with_time(oss.str());
+}
+
 template<const conversion_type conv, const bool random_pbat> static void
 run_single_ended(const bool VERBOSE, const bool show_progress,
                  const bool allow_ambig, const string &reads_file,
                  const AbismalIndex &abismal_index, se_map_stats &se_stats,
-                 bamxx::bam_header &hdr, bamxx::bam_out &out) {
-  ReadLoader rl(reads_file);
+                 bamxx::bam_header &hdr, bamxx::bam_out &out,
+                 map_checkpoint &ckpt, htsThreadPool *io_pool,
+                 const uint32_t locality_cache_size, buffer_usage &usage,
+                 output_stats &ostats) {
+  ReadLoader rl(reads_file, io_pool);
+  if (ckpt.pos.n_reads > 0) rl.seek(ckpt.pos.offset1, ckpt.pos.n_reads);
   ProgressBar progress(get_filesize(reads_file), "mapping reads");
 
   const auto start_time = omp_get_wtime();
@@ -1474,10 +3151,12 @@ run_single_ended(const bool VERBOSE, const bool show_progress,
   for (int i = 0; i < omp_get_num_threads(); ++i) {
     if (random_pbat)
       map_single_ended_rand(VERBOSE, show_progress, allow_ambig, abismal_index,
-                            rl, se_stats, hdr, out, progress);
+                            rl, se_stats, hdr, out, progress, ckpt,
+                            locality_cache_size, usage, ostats);
     else
       map_single_ended<conv>(VERBOSE, show_progress, allow_ambig, abismal_index,
-                             rl, se_stats, hdr, out, progress);
+                             rl, se_stats, hdr, out, progress, ckpt,
+                             locality_cache_size, usage, ostats);
   }
   if (show_progress) {
     print_with_time("reads mapped: " + to_string(rl.get_current_read()));
@@ -1627,7 +3306,7 @@ template<const bool cmp, const bool swap_ends, const uint16_t strand_code1,
          const uint16_t strand_code2>
 static inline bool
 map_fragments(const uint32_t max_candidates, const string &read1,
-              const string &read2,
+              const string &read2, const string &qual1, const string &qual2,
               const vector<uint32_t>::const_iterator counter_st,
               const vector<uint32_t>::const_iterator counter_three_st,
               const vector<uint32_t>::const_iterator index_st,
@@ -1643,21 +3322,28 @@ map_fragments(const uint32_t max_candidates, const string &read1,
 
   if (read1.empty() && read2.empty()) return false;
 
+  // buffers reused across calls to avoid allocating for each read
+  static thread_local seed_quality sq;
+
   if (!read1.empty()) {
     prep_read<cmp>(read1, pread1);
     pack_read(pread1, packed_pread);
+    sq.set(qual1, false);
     process_seeds<strand_code1>(max_candidates, counter_st, counter_three_st,
                                 index_st, index_three_st, genome_st, pread1,
-                                packed_pread, res1);
+                                packed_pread, sq, res1);
   }
 
   if (!read2.empty()) {
-    const string read_rc(revcomp(read2));
+    static thread_local string read_rc;
+    read_rc = read2;
+    revcomp_inplace(read_rc);
     prep_read<cmp>(read_rc, pread2);
     pack_read(pread2, packed_pread);
+    sq.set(qual2, true);
     process_seeds<strand_code2>(max_candidates, counter_st, counter_three_st,
                                 index_st, index_three_st, genome_st, pread2,
-                                packed_pread, res2);
+                                packed_pread, sq, res2);
   }
 
   return select_maps<swap_ends>(pread1, pread2, cigar1, cigar2, res1, res2,
@@ -1669,7 +3355,9 @@ map_paired_ended(const bool VERBOSE, const bool show_progress,
                  const bool allow_ambig, const AbismalIndex &abismal_index,
                  ReadLoader &rl1, ReadLoader &rl2, pe_map_stats &pe_stats,
                  bamxx::bam_header &hdr, bamxx::bam_out &out,
-                 ProgressBar &progress) {
+                 ProgressBar &progress, map_checkpoint &ckpt,
+                 const uint32_t locality_cache_size,
+                 buffer_usage &usage, output_stats &ostats) {
   const auto counter_st(begin(abismal_index.counter));
   const auto counter_t_st(begin(abismal_index.counter_t));
   const auto counter_a_st(begin(abismal_index.counter_a));
@@ -1684,8 +3372,8 @@ map_paired_ended(const bool VERBOSE, const bool show_progress,
 
   // GS: objects used to report reads, need as many copies as
   // the batch size
-  vector<string> names1, reads1;
-  vector<string> names2, reads2;
+  vector<string> names1, reads1, quals1;
+  vector<string> names2, reads2, quals2;
 
   vector<bam_cigar_t> cigar1;
   vector<bam_cigar_t> cigar2;
@@ -1698,10 +3386,12 @@ map_paired_ended(const bool VERBOSE, const bool show_progress,
 
   names1.reserve(ReadLoader::batch_size);
   reads1.reserve(ReadLoader::batch_size);
+  quals1.reserve(ReadLoader::batch_size);
   cigar1.resize(ReadLoader::batch_size);
 
   names2.reserve(ReadLoader::batch_size);
   reads2.reserve(ReadLoader::batch_size);
+  quals2.reserve(ReadLoader::batch_size);
   cigar2.resize(ReadLoader::batch_size);
 
   bests.resize(ReadLoader::batch_size);
@@ -1723,15 +3413,28 @@ map_paired_ended(const bool VERBOSE, const bool show_progress,
   vector<score_t> mem_scr1(res1.v.size());
   se_candidates res_se1;
   se_candidates res_se2;
+  locality_cache<pe_result> cache(locality_cache_size);
+  buffer_usage thread_usage;
+  compact::block cblock;  // the records of a batch in compact output
+  vector<uint8_t> hits;   // the hits of a batch in a pass over a shard
 
   size_t the_byte = 0;
+  size_t batch_id = 0;
+  input_position batch_end;
 
   while (rl1 && rl2) {
+    const double load_wait = thread_trace::now();
 #pragma omp critical
     {
-      rl1.load_reads(names1, reads1);
-      rl2.load_reads(names2, reads2);
+      const double load_start = thread_trace::now();
+      alloc_trace::set_phase(alloc_trace::load);
+      load_read_pairs(rl1, rl2, names1, reads1, quals1, names2, reads2,
+                      quals2);
       the_byte = rl1.get_current_byte();
+      batch_id = ckpt.next_batch();
+      batch_end = input_position(rl1, rl2);
+      thread_trace::span("load", load_start, thread_trace::now(), batch_id,
+                         reads1.size(), load_start - load_wait);
     }
 
     if (reads1.size() != reads2.size()) {
@@ -1742,6 +3445,12 @@ map_paired_ended(const bool VERBOSE, const bool show_progress,
         "have the same number of reads?");
     }
 
+    alloc_trace::set_phase(alloc_trace::map);
+    thread_controller().start_batch();
+    // a cached read skips the probes, which must depend only on the batch
+    if (candidate_controller::enabled) cache.clear();
+    const double map_start = thread_trace::now();
+    double format_us = 0.0;
     size_t max_batch_read_length = 0;
     update_max_read_length(max_batch_read_length, reads1);
     update_max_read_length(max_batch_read_length, reads2);
@@ -1749,85 +3458,182 @@ map_paired_ended(const bool VERBOSE, const bool show_progress,
     aln.reset(max_batch_read_length);
 
     const size_t n_reads = reads1.size();
+    uint32_t n_prefiltered = 0;
     for (size_t i = 0; i < n_reads; ++i) {
       const uint32_t readlen1 = reads1[i].size();
       const uint32_t readlen2 = reads2[i].size();
 
-      res1.reset(readlen1);
-      res2.reset(readlen2);
-      res_se1.reset(readlen1);
-      res_se2.reset(readlen2);
-
-      bests[i].reset(readlen1, readlen2);
-      bests_se1[i].reset(readlen1);
-      bests_se2[i].reset(readlen2);
-
-      const bool strand_pm_success =
-        map_fragments<conv, false, get_strand_code('+', conv),
-                      get_strand_code('-', flip_conv(conv))>(
-          max_candidates, reads1[i], reads2[i], counter_st,
-          (conv == t_rich) ? counter_t_st : counter_a_st, index_st,
-          (conv == t_rich) ? index_t_st : index_a_st, genome_st, pread1,
-          pread2_rc, packed_pread, cigar1[i], cigar2[i], aln, res1, res2,
-          mem_scr1, res_se1, res_se2, bests[i]);
-
-      const bool strand_mp_success =
-        map_fragments<!conv, true, get_strand_code('+', flip_conv(conv)),
-                      get_strand_code('-', conv)>(
-          max_candidates, reads2[i], reads1[i], counter_st,
-          (conv == t_rich) ? counter_a_st : counter_t_st, index_st,
-          (conv == t_rich) ? index_a_st : index_t_st, genome_st, pread2,
-          pread1_rc, packed_pread, cigar2[i], cigar1[i], aln, res2, res1,
-          mem_scr1, res_se2, res_se1, bests[i]);
-
-      if (!strand_pm_success && !strand_mp_success) {
-        bests[i].reset();
-        res_se1.reset();
-        res_se2.reset();
+      // pairs are dropped only if both ends are hopeless
+      const bool prefiltered =
+        read_prefilter::enabled &&
+        read_prefilter::hopeless(reads1[i], conv == a_rich) &&
+        read_prefilter::hopeless(reads2[i], conv != a_rich);
+      const pe_result *cached =
+        prefiltered ? nullptr
+                    : cache.find(reads1[i], quals1[i], reads2[i], quals2[i]);
+      if (prefiltered) {
+        bests[i].reset(readlen1, readlen2);
+        bests_se1[i].reset(readlen1);
+        bests_se2[i].reset(readlen2);
+        ++n_prefiltered;
       }
+      else if (cached) {
+        bests[i] = cached->best;
+        bests_se1[i] = cached->best_se1;
+        bests_se2[i] = cached->best_se2;
+        cigar1[i] = cached->cigar1;
+        cigar2[i] = cached->cigar2;
+      }
+      else {
+        res1.reset(readlen1);
+        res2.reset(readlen2);
+        res_se1.reset(readlen1);
+        res_se2.reset(readlen2);
+
+        bests[i].reset(readlen1, readlen2);
+        bests_se1[i].reset(readlen1);
+        bests_se2[i].reset(readlen2);
+
+        const bool strand_pm_success =
+          map_fragments<conv, false, get_strand_code('+', conv),
+                        get_strand_code('-', flip_conv(conv))>(
+            max_candidates, reads1[i], reads2[i], quals1[i], quals2[i],
+            counter_st,
+            (conv == t_rich) ? counter_t_st : counter_a_st, index_st,
+            (conv == t_rich) ? index_t_st : index_a_st, genome_st, pread1,
+            pread2_rc, packed_pread, cigar1[i], cigar2[i], aln, res1, res2,
+            mem_scr1, res_se1, res_se2, bests[i]);
+
+        const bool strand_mp_success =
+          map_fragments<!conv, true, get_strand_code('+', flip_conv(conv)),
+                        get_strand_code('-', conv)>(
+            max_candidates, reads2[i], reads1[i], quals2[i], quals1[i],
+            counter_st,
+            (conv == t_rich) ? counter_a_st : counter_t_st, index_st,
+            (conv == t_rich) ? index_a_st : index_t_st, genome_st, pread2,
+            pread1_rc, packed_pread, cigar2[i], cigar1[i], aln, res2, res1,
+            mem_scr1, res_se2, res_se1, bests[i]);
+
+        if (!strand_pm_success && !strand_mp_success) {
+          bests[i].reset();
+          res_se1.reset();
+          res_se2.reset();
+        }
 
-      if (!valid_pair(bests[i], reads1[i].size(), reads2[i].size(),
-                      cigar_rseq_ops(cigar1[i]), cigar_rseq_ops(cigar2[i])))
-        bests[i].reset();
+        if (!valid_pair(bests[i], reads1[i].size(), reads2[i].size(),
+                        cigar_rseq_ops(cigar1[i]), cigar_rseq_ops(cigar2[i])))
+          bests[i].reset();
 
-      if (!bests[i].should_report(allow_ambig)) {
-        align_se_candidates(pread1, pread1_rc, pread1, pread1_rc,
-                            se_element::valid_frac / 2.0, res_se1, bests_se1[i],
-                            cigar1[i], aln);
+        if (!bests[i].should_report(allow_ambig)) {
+          align_se_candidates(pread1, pread1_rc, pread1, pread1_rc,
+                              se_element::valid_frac / 2.0, res_se1,
+                              bests_se1[i], cigar1[i], aln);
 
-        align_se_candidates(pread2, pread2_rc, pread2, pread2_rc,
-                            se_element::valid_frac / 2.0, res_se2, bests_se2[i],
-                            cigar2[i], aln);
+          align_se_candidates(pread2, pread2_rc, pread2, pread2_rc,
+                              se_element::valid_frac / 2.0, res_se2,
+                              bests_se2[i], cigar2[i], aln);
+        }
+        cache.insert(reads1[i], quals1[i], reads2[i], quals2[i],
+                     pe_result(bests[i], bests_se1[i], bests_se2[i],
+                               cigar1[i], cigar2[i]));
       }
 
-      select_output(allow_ambig, abismal_index.cl, reads1[i], names1[i],
-                    reads2[i], names2[i], cigar1[i], cigar2[i], bests[i],
-                    bests_se1[i], bests_se2[i], mr1[i], mr2[i]);
+      alloc_trace::set_phase(alloc_trace::format);
+      const double format_start = thread_trace::now();
+      // in a pass over one shard, reads are formatted after merging
+      if (!shard_hits::active())
+        format_output(allow_ambig, abismal_index.cl, reads1[i], names1[i],
+                      reads2[i], names2[i], cigar1[i], cigar2[i], bests[i],
+                      bests_se1[i], bests_se2[i], mr1[i], mr2[i], cblock);
+      format_us += thread_trace::now() - format_start;
+      alloc_trace::set_phase(alloc_trace::map);
     }
 
+    if (compact_output::enabled) {
+      alloc_trace::set_phase(alloc_trace::format);
+      const double seal_start = thread_trace::now();
+      cblock.seal(compact_output::compress_level);
+      format_us += thread_trace::now() - seal_start;
+    }
+    if (shard_hits::active())
+      for (size_t i = 0; i < n_reads; ++i)
+        shard_hits::add(bests[i], bests_se1[i], bests_se2[i], cigar1[i],
+                        cigar2[i], hits);
+    alloc_trace::set_phase(alloc_trace::write);
+    // formatting is interleaved with mapping read by read, so its total
+    // for the batch is shown at the end of the mapping
+    const double write_wait = thread_trace::now();
+    thread_trace::span("map", map_start, write_wait - format_us, batch_id,
+                       n_reads);
+    thread_trace::span("format", write_wait - format_us, write_wait,
+                       batch_id, n_reads);
+    ckpt.wait_turn(batch_id);
 #pragma omp critical
     {
+      const double write_start = omp_get_wtime();
+      const double trace_write_start = thread_trace::now();
+      size_t n_records = 0;
       for (size_t i = 0; i < n_reads; ++i) {
-        if (valid_bam_rec(mr1[i]) && !out.write(hdr, mr1[i]))
-          throw runtime_error("failed to write bam");
-        if (valid_bam_rec(mr2[i]) && !out.write(hdr, mr2[i]))
-          throw runtime_error("failed to write bam");
+        if (valid_bam_rec(mr1[i])) {
+          if (!out.write(hdr, mr1[i]))
+            throw runtime_error("failed to write bam");
+          ++n_records;
+        }
+        if (valid_bam_rec(mr2[i])) {
+          if (!out.write(hdr, mr2[i]))
+            throw runtime_error("failed to write bam");
+          ++n_records;
+        }
+        pe_stats.update(allow_ambig, reads1[i], reads2[i], cigar1[i],
+                        cigar2[i], bests[i], bests_se1[i], bests_se2[i]);
       }
+      pe_stats.add_prefiltered(n_prefiltered);
+      n_records += compact_output::write_block(out, cblock);
+      shard_hits::write(hits);
+      ckpt.batch_written(batch_id, batch_end, n_records, pe_stats, out);
+      follow_output::batch_written(n_reads, allow_ambig, pe_stats, out);
+      ostats.write_seconds += omp_get_wtime() - write_start;
+      thread_trace::span("write", trace_write_start, thread_trace::now(),
+                         batch_id, n_reads, trace_write_start - write_wait);
     }
+    if (VERBOSE)
+      thread_usage.records =
+        max(thread_usage.records, vector_bytes(mr1) + vector_bytes(mr2) +
+                                    cblock.memory_bytes());
     for (size_t i = 0; i < n_reads; ++i) {
       if (valid_bam_rec(mr1[i])) reset_bam_rec(mr1[i]);
       if (valid_bam_rec(mr2[i])) reset_bam_rec(mr2[i]);
-      pe_stats.update(allow_ambig, reads1[i], reads2[i], cigar1[i], cigar2[i],
-                      bests[i], bests_se1[i], bests_se2[i]);
       cigar1[i].clear();
       cigar2[i].clear();
     }
+    cblock.clear();
+    alloc_trace::batch_done(n_reads);
+    // a batch is empty at the end of the input, or when the input
+    // being followed has nothing new
+    if (n_reads == 0) rl1.wait_for_input();
     if (show_progress)
 #pragma omp critical
     {
       if (progress.time_to_report(the_byte)) progress.report(cerr, the_byte);
     }
   }
+  if (VERBOSE) {
+    thread_usage.batch =
+      vector_bytes(names1) + vector_bytes(reads1) + vector_bytes(names2) +
+      vector_bytes(reads2) + vector_bytes(cigar1) + vector_bytes(cigar2) +
+      vector_bytes(bests) + vector_bytes(bests_se1) + vector_bytes(bests_se2) +
+      vector_bytes(pread1) + vector_bytes(pread1_rc) + vector_bytes(pread2) +
+      vector_bytes(pread2_rc) + vector_bytes(packed_pread);
+    thread_usage.candidates = vector_bytes(res1.v) + vector_bytes(res2.v) +
+                              vector_bytes(mem_scr1) + vector_bytes(res_se1.v) +
+                              vector_bytes(res_se2.v);
+    thread_usage.alignment =
+      vector_bytes(aln.table) + vector_bytes(aln.traceback);
+    thread_usage.cache = cache.memory_bytes();
+#pragma omp critical
+    usage.add(thread_usage);
+  }
+  verify_count::collect();
 }
 
 static void
@@ -1835,7 +3641,9 @@ map_paired_ended_rand(const bool VERBOSE, const bool show_progress,
                       const bool allow_ambig, const AbismalIndex &abismal_index,
                       ReadLoader &rl1, ReadLoader &rl2, pe_map_stats &pe_stats,
                       bamxx::bam_header &hdr, bamxx::bam_out &out,
-                      ProgressBar &progress) {
+                      ProgressBar &progress, map_checkpoint &ckpt,
+                      const uint32_t locality_cache_size,
+                      buffer_usage &usage, output_stats &ostats) {
   const auto counter_st(begin(abismal_index.counter));
   const auto counter_t_st(begin(abismal_index.counter_t));
   const auto counter_a_st(begin(abismal_index.counter_a));
@@ -1848,8 +3656,8 @@ map_paired_ended_rand(const bool VERBOSE, const bool show_progress,
 
   const genome_iterator genome_st(begin(abismal_index.genome));
 
-  vector<string> names1, reads1;
-  vector<string> names2, reads2;
+  vector<string> names1, reads1, quals1;
+  vector<string> names2, reads2, quals2;
 
   vector<bam_cigar_t> cigar1;
   vector<bam_cigar_t> cigar2;
@@ -1862,10 +3670,12 @@ map_paired_ended_rand(const bool VERBOSE, const bool show_progress,
 
   names1.reserve(ReadLoader::batch_size);
   reads1.reserve(ReadLoader::batch_size);
+  quals1.reserve(ReadLoader::batch_size);
   cigar1.resize(ReadLoader::batch_size);
 
   names2.reserve(ReadLoader::batch_size);
   reads2.reserve(ReadLoader::batch_size);
+  quals2.reserve(ReadLoader::batch_size);
   cigar2.resize(ReadLoader::batch_size);
 
   bests.resize(ReadLoader::batch_size);
@@ -1885,15 +3695,28 @@ map_paired_ended_rand(const bool VERBOSE, const bool show_progress,
   vector<score_t> mem_scr1(res1.v.size());
   se_candidates res_se1;
   se_candidates res_se2;
+  locality_cache<pe_result> cache(locality_cache_size);
+  buffer_usage thread_usage;
+  compact::block cblock;  // the records of a batch in compact output
+  vector<uint8_t> hits;   // the hits of a batch in a pass over a shard
 
   size_t the_byte = 0;
+  size_t batch_id = 0;
+  input_position batch_end;
 
   while (rl1 && rl2) {
+    const double load_wait = thread_trace::now();
 #pragma omp critical
     {
-      rl1.load_reads(names1, reads1);
-      rl2.load_reads(names2, reads2);
+      const double load_start = thread_trace::now();
+      alloc_trace::set_phase(alloc_trace::load);
+      load_read_pairs(rl1, rl2, names1, reads1, quals1, names2, reads2,
+                      quals2);
       the_byte = rl1.get_current_byte();
+      batch_id = ckpt.next_batch();
+      batch_end = input_position(rl1, rl2);
+      thread_trace::span("load", load_start, thread_trace::now(), batch_id,
+                         reads1.size(), load_start - load_wait);
     }
 
     if (reads1.size() != reads2.size()) {
@@ -1904,6 +3727,12 @@ map_paired_ended_rand(const bool VERBOSE, const bool show_progress,
         "have the same number of reads?");
     }
 
+    alloc_trace::set_phase(alloc_trace::map);
+    thread_controller().start_batch();
+    // a cached read skips the probes, which must depend only on the batch
+    if (candidate_controller::enabled) cache.clear();
+    const double map_start = thread_trace::now();
+    double format_us = 0.0;
     size_t max_batch_read_length = 0;
     update_max_read_length(max_batch_read_length, reads1);
     update_max_read_length(max_batch_read_length, reads2);
@@ -1911,98 +3740,202 @@ map_paired_ended_rand(const bool VERBOSE, const bool show_progress,
     aln.reset(max_batch_read_length);
 
     const size_t n_reads = reads1.size();
+    uint32_t n_prefiltered = 0;
     for (size_t i = 0; i < n_reads; ++i) {
       const uint32_t readlen1 = reads1[i].size();
       const uint32_t readlen2 = reads2[i].size();
 
-      res1.reset(readlen1);
-      res2.reset(readlen2);
-      res_se1.reset(readlen1);
-      res_se2.reset(readlen2);
-      bests[i].reset(readlen1, readlen2);
-      bests_se1[i].reset(readlen1);
-      bests_se2[i].reset(readlen2);
-
-      // GS: (1) T/A-rich +/- strand
-      const bool richness_ta_strand_pm_success =
-        map_fragments<t_rich, false, get_strand_code('+', t_rich),
-                      get_strand_code('-', a_rich)>(
-          max_candidates, reads1[i], reads2[i], counter_st, counter_t_st,
-          index_st, index_t_st, genome_st, pread1_t, pread2_t_rc, packed_pread,
-          cigar1[i], cigar2[i], aln, res1, res2, mem_scr1, res_se1, res_se2,
-          bests[i]);
-      // GS: (2) T/A-rich, -/+ strand
-      const bool richness_ta_strand_mp_success =
-        map_fragments<a_rich, true, get_strand_code('+', a_rich),
-                      get_strand_code('-', t_rich)>(
-          max_candidates, reads2[i], reads1[i], counter_st, counter_a_st,
-          index_st, index_a_st, genome_st, pread2_a, pread1_a_rc, packed_pread,
-          cigar2[i], cigar1[i], aln, res2, res1, mem_scr1, res_se2, res_se1,
-          bests[i]);
-      // GS: (3) A/T-rich +/- strand
-      const bool richness_at_strand_pm_success =
-        map_fragments<a_rich, false, get_strand_code('+', a_rich),
-                      get_strand_code('-', t_rich)>(
-          max_candidates, reads1[i], reads2[i], counter_st, counter_a_st,
-          index_st, index_a_st, genome_st, pread1_a, pread2_a_rc, packed_pread,
-          cigar1[i], cigar2[i], aln, res1, res2, mem_scr1, res_se1, res_se2,
-          bests[i]);
-      // GS: (4) A/T-rich, -/+ strand
-      const bool richness_at_strand_mp_success =
-        map_fragments<t_rich, true, get_strand_code('+', t_rich),
-                      get_strand_code('-', a_rich)>(
-          max_candidates, reads2[i], reads1[i], counter_st, counter_t_st,
-          index_st, index_t_st, genome_st, pread2_t, pread1_t_rc, packed_pread,
-          cigar2[i], cigar1[i], aln, res2, res1, mem_scr1, res_se2, res_se1,
-          bests[i]);
-
-      if (!richness_ta_strand_pm_success && !richness_ta_strand_mp_success &&
-          !richness_at_strand_pm_success && !richness_at_strand_mp_success) {
-        bests[i].reset();
-        res_se1.reset();
-        res_se2.reset();
+      // pairs are dropped only if both ends are hopeless
+      const bool prefiltered =
+        read_prefilter::enabled &&
+        read_prefilter::hopeless(reads1[i], false) &&
+        read_prefilter::hopeless(reads1[i], true) &&
+        read_prefilter::hopeless(reads2[i], false) &&
+        read_prefilter::hopeless(reads2[i], true);
+      const pe_result *cached =
+        prefiltered ? nullptr
+                    : cache.find(reads1[i], quals1[i], reads2[i], quals2[i]);
+      if (prefiltered) {
+        bests[i].reset(readlen1, readlen2);
+        bests_se1[i].reset(readlen1);
+        bests_se2[i].reset(readlen2);
+        ++n_prefiltered;
       }
+      else if (cached) {
+        bests[i] = cached->best;
+        bests_se1[i] = cached->best_se1;
+        bests_se2[i] = cached->best_se2;
+        cigar1[i] = cached->cigar1;
+        cigar2[i] = cached->cigar2;
+      }
+      else {
+        res1.reset(readlen1);
+        res2.reset(readlen2);
+        res_se1.reset(readlen1);
+        res_se2.reset(readlen2);
+        bests[i].reset(readlen1, readlen2);
+        bests_se1[i].reset(readlen1);
+        bests_se2[i].reset(readlen2);
+
+        // GS: (1) T/A-rich +/- strand
+        const bool richness_ta_strand_pm_success =
+          map_fragments<t_rich, false, get_strand_code('+', t_rich),
+                        get_strand_code('-', a_rich)>(
+            max_candidates, reads1[i], reads2[i], quals1[i], quals2[i],
+            counter_st, counter_t_st,
+            index_st, index_t_st, genome_st, pread1_t, pread2_t_rc,
+            packed_pread, cigar1[i], cigar2[i], aln, res1, res2, mem_scr1,
+            res_se1, res_se2, bests[i]);
+        // GS: (2) T/A-rich, -/+ strand
+        const bool richness_ta_strand_mp_success =
+          map_fragments<a_rich, true, get_strand_code('+', a_rich),
+                        get_strand_code('-', t_rich)>(
+            max_candidates, reads2[i], reads1[i], quals2[i], quals1[i],
+            counter_st, counter_a_st,
+            index_st, index_a_st, genome_st, pread2_a, pread1_a_rc,
+            packed_pread, cigar2[i], cigar1[i], aln, res2, res1, mem_scr1,
+            res_se2, res_se1, bests[i]);
+        // GS: (3) A/T-rich +/- strand
+        const bool richness_at_strand_pm_success =
+          map_fragments<a_rich, false, get_strand_code('+', a_rich),
+                        get_strand_code('-', t_rich)>(
+            max_candidates, reads1[i], reads2[i], quals1[i], quals2[i],
+            counter_st, counter_a_st,
+            index_st, index_a_st, genome_st, pread1_a, pread2_a_rc,
+            packed_pread, cigar1[i], cigar2[i], aln, res1, res2, mem_scr1,
+            res_se1, res_se2, bests[i]);
+        // GS: (4) A/T-rich, -/+ strand
+        const bool richness_at_strand_mp_success =
+          map_fragments<t_rich, true, get_strand_code('+', t_rich),
+                        get_strand_code('-', a_rich)>(
+            max_candidates, reads2[i], reads1[i], quals2[i], quals1[i],
+            counter_st, counter_t_st,
+            index_st, index_t_st, genome_st, pread2_t, pread1_t_rc,
+            packed_pread, cigar2[i], cigar1[i], aln, res2, res1, mem_scr1,
+            res_se2, res_se1, bests[i]);
+
+        if (!richness_ta_strand_pm_success && !richness_ta_strand_mp_success &&
+            !richness_at_strand_pm_success && !richness_at_strand_mp_success) {
+          bests[i].reset();
+          res_se1.reset();
+          res_se2.reset();
+        }
+
+        if (!valid_pair(bests[i], reads1[i].size(), reads2[i].size(),
+                        cigar_rseq_ops(cigar1[i]), cigar_rseq_ops(cigar2[i])))
+          bests[i].reset();
 
-      if (!valid_pair(bests[i], reads1[i].size(), reads2[i].size(),
-                      cigar_rseq_ops(cigar1[i]), cigar_rseq_ops(cigar2[i])))
-        bests[i].reset();
-
-      if (!bests[i].should_report(allow_ambig)) {
-        align_se_candidates(pread1_t, pread1_t_rc, pread1_a, pread1_a_rc,
-                            se_element::valid_frac / 2.0, res_se1, bests_se1[i],
-                            cigar1[i], aln);
-        align_se_candidates(pread2_t, pread2_t_rc, pread2_a, pread2_a_rc,
-                            se_element::valid_frac / 2.0, res_se2, bests_se2[i],
-                            cigar2[i], aln);
+        if (!bests[i].should_report(allow_ambig)) {
+          align_se_candidates(pread1_t, pread1_t_rc, pread1_a, pread1_a_rc,
+                              se_element::valid_frac / 2.0, res_se1,
+                              bests_se1[i], cigar1[i], aln);
+          align_se_candidates(pread2_t, pread2_t_rc, pread2_a, pread2_a_rc,
+                              se_element::valid_frac / 2.0, res_se2,
+                              bests_se2[i], cigar2[i], aln);
+        }
+        cache.insert(reads1[i], quals1[i], reads2[i], quals2[i],
+                     pe_result(bests[i], bests_se1[i], bests_se2[i],
+                               cigar1[i], cigar2[i]));
       }
-      select_output(allow_ambig, abismal_index.cl, reads1[i], names1[i],
-                    reads2[i], names2[i], cigar1[i], cigar2[i], bests[i],
-                    bests_se1[i], bests_se2[i], mr1[i], mr2[i]);
+      alloc_trace::set_phase(alloc_trace::format);
+      const double format_start = thread_trace::now();
+      // in a pass over one shard, reads are formatted after merging
+      if (!shard_hits::active())
+        format_output(allow_ambig, abismal_index.cl, reads1[i], names1[i],
+                      reads2[i], names2[i], cigar1[i], cigar2[i], bests[i],
+                      bests_se1[i], bests_se2[i], mr1[i], mr2[i], cblock);
+      format_us += thread_trace::now() - format_start;
+      alloc_trace::set_phase(alloc_trace::map);
     }
 
+    if (compact_output::enabled) {
+      alloc_trace::set_phase(alloc_trace::format);
+      const double seal_start = thread_trace::now();
+      cblock.seal(compact_output::compress_level);
+      format_us += thread_trace::now() - seal_start;
+    }
+    if (shard_hits::active())
+      for (size_t i = 0; i < n_reads; ++i)
+        shard_hits::add(bests[i], bests_se1[i], bests_se2[i], cigar1[i],
+                        cigar2[i], hits);
+    alloc_trace::set_phase(alloc_trace::write);
+    // formatting is interleaved with mapping read by read, so its total
+    // for the batch is shown at the end of the mapping
+    const double write_wait = thread_trace::now();
+    thread_trace::span("map", map_start, write_wait - format_us, batch_id,
+                       n_reads);
+    thread_trace::span("format", write_wait - format_us, write_wait,
+                       batch_id, n_reads);
+    ckpt.wait_turn(batch_id);
 #pragma omp critical
     {
+      const double write_start = omp_get_wtime();
+      const double trace_write_start = thread_trace::now();
+      size_t n_records = 0;
       for (size_t i = 0; i < n_reads; ++i) {
-        if (valid_bam_rec(mr1[i]) && !out.write(hdr, mr1[i]))
-          throw runtime_error("failed to write bam");
-        if (valid_bam_rec(mr2[i]) && !out.write(hdr, mr2[i]))
-          throw runtime_error("failed to write bam");
+        if (valid_bam_rec(mr1[i])) {
+          if (!out.write(hdr, mr1[i]))
+            throw runtime_error("failed to write bam");
+          ++n_records;
+        }
+        if (valid_bam_rec(mr2[i])) {
+          if (!out.write(hdr, mr2[i]))
+            throw runtime_error("failed to write bam");
+          ++n_records;
+        }
+        pe_stats.update(allow_ambig, reads1[i], reads2[i], cigar1[i],
+                        cigar2[i], bests[i], bests_se1[i], bests_se2[i]);
       }
+      pe_stats.add_prefiltered(n_prefiltered);
+      n_records += compact_output::write_block(out, cblock);
+      shard_hits::write(hits);
+      ckpt.batch_written(batch_id, batch_end, n_records, pe_stats, out);
+      follow_output::batch_written(n_reads, allow_ambig, pe_stats, out);
+      ostats.write_seconds += omp_get_wtime() - write_start;
+      thread_trace::span("write", trace_write_start, thread_trace::now(),
+                         batch_id, n_reads, trace_write_start - write_wait);
     }
+    if (VERBOSE)
+      thread_usage.records =
+        max(thread_usage.records, vector_bytes(mr1) + vector_bytes(mr2) +
+                                    cblock.memory_bytes());
     for (size_t i = 0; i < n_reads; ++i) {
       if (valid_bam_rec(mr1[i])) reset_bam_rec(mr1[i]);
       if (valid_bam_rec(mr2[i])) reset_bam_rec(mr2[i]);
-      pe_stats.update(allow_ambig, reads1[i], reads2[i], cigar1[i], cigar2[i],
-                      bests[i], bests_se1[i], bests_se2[i]);
       cigar1[i].clear();
       cigar2[i].clear();
     }
+    cblock.clear();
+    alloc_trace::batch_done(n_reads);
+    // a batch is empty at the end of the input, or when the input
+    // being followed has nothing new
+    if (n_reads == 0) rl1.wait_for_input();
     if (show_progress)
 #pragma omp critical
     {
       if (progress.time_to_report(the_byte)) progress.report(cerr, the_byte);
     }
   }
+  if (VERBOSE) {
+    thread_usage.batch =
+      vector_bytes(names1) + vector_bytes(reads1) + vector_bytes(names2) +
+      vector_bytes(reads2) + vector_bytes(cigar1) + vector_bytes(cigar2) +
+      vector_bytes(bests) + vector_bytes(bests_se1) + vector_bytes(bests_se2) +
+      vector_bytes(pread1_t) + vector_bytes(pread1_t_rc) +
+      vector_bytes(pread2_t) + vector_bytes(pread2_t_rc) +
+      vector_bytes(pread1_a) + vector_bytes(pread1_a_rc) +
+      vector_bytes(pread2_a) + vector_bytes(pread2_a_rc) +
+      vector_bytes(packed_pread);
+    thread_usage.candidates = vector_bytes(res1.v) + vector_bytes(res2.v) +
+                              vector_bytes(mem_scr1) + vector_bytes(res_se1.v) +
+                              vector_bytes(res_se2.v);
+    thread_usage.alignment =
+      vector_bytes(aln.table) + vector_bytes(aln.traceback);
+    thread_usage.cache = cache.memory_bytes();
+#pragma omp critical
+    usage.add(thread_usage);
+  }
+  verify_count::collect();
 }
 
 template<const conversion_type conv, const bool random_pbat> static void
@@ -2010,9 +3943,19 @@ run_paired_ended(const bool VERBOSE, const bool show_progress,
                  const bool allow_ambig, const string &reads_file1,
                  const string &reads_file2, const AbismalIndex &abismal_index,
                  pe_map_stats &pe_stats, bamxx::bam_header &hdr,
-                 bamxx::bam_out &out) {
-  ReadLoader rl1(reads_file1);
-  ReadLoader rl2(reads_file2);
+                 bamxx::bam_out &out, map_checkpoint &ckpt,
+                 htsThreadPool *io_pool, const uint32_t locality_cache_size,
+                 buffer_usage &usage, output_stats &ostats) {
+  // without a second file, both ends are interleaved in the first
+  const bool interleaved = reads_file2.empty();
+  ReadLoader rl1(reads_file1, io_pool);
+  std::unique_ptr<ReadLoader> rl2_ptr(
+    interleaved ? nullptr : new ReadLoader(reads_file2, io_pool));
+  ReadLoader &rl2 = interleaved ? rl1 : *rl2_ptr;
+  if (ckpt.pos.n_reads > 0) {
+    rl1.seek(ckpt.pos.offset1, ckpt.pos.n_reads);
+    if (!interleaved) rl2.seek(ckpt.pos.offset2, ckpt.pos.n_reads);
+  }
   ProgressBar progress(get_filesize(reads_file1), "mapping reads");
 
   double start_time = omp_get_wtime();
@@ -2021,11 +3964,13 @@ run_paired_ended(const bool VERBOSE, const bool show_progress,
   for (int i = 0; i < omp_get_num_threads(); ++i) {
     if (random_pbat)
       map_paired_ended_rand(VERBOSE, show_progress, allow_ambig, abismal_index,
-                            rl1, rl2, pe_stats, hdr, out, progress);
+                            rl1, rl2, pe_stats, hdr, out, progress, ckpt,
+                            locality_cache_size, usage, ostats);
 
     else
       map_paired_ended<conv>(VERBOSE, show_progress, allow_ambig, abismal_index,
-                             rl1, rl2, pe_stats, hdr, out, progress);
+                             rl1, rl2, pe_stats, hdr, out, progress, ckpt,
+                             locality_cache_size, usage, ostats);
   }
   if (show_progress) {
     print_with_time("reads mapped: " + to_string(rl1.get_current_read()));
@@ -2034,6 +3979,252 @@ run_paired_ended(const bool VERBOSE, const bool show_progress,
   }
 }
 
+static inline bool
+valid_posn(const ChromLookup &cl, const bam_cigar_t &cig, const uint32_t p,
+           uint32_t &chrom) {
+  uint32_t r_s = 0, r_e = 0;
+  return chrom_and_posn(cl, cig, p, r_s, r_e, chrom);
+}
+
+/* The best hit of a read over all shards by edit distance, which is
+ * ambiguous if another shard has a hit with the same edit distance.
+ * Hits across the ends of chromosomes are dropped as in formatting.
+ */
+static void
+merge_se_hits(const ChromLookup &cl, const vector<se_element> &hits,
+              const vector<bam_cigar_t> &cigars, se_element &best,
+              bam_cigar_t &cigar) {
+  best.reset();
+  cigar.clear();
+  uint32_t chrom = 0;
+  for (size_t k = 0; k < hits.size(); ++k) {
+    if (hits[k].empty() || !valid_posn(cl, cigars[k], hits[k].pos, chrom))
+      continue;
+    if (best.empty() || hits[k].diffs < best.diffs) {
+      best = hits[k];
+      cigar = cigars[k];
+    }
+    else if (hits[k].diffs == best.diffs)
+      best.set_ambig();
+  }
+}
+
+/* The best concordant pair over all shards. A tie between shards makes
+ * the pair ambiguous, and its ends are then not reported on their own,
+ * since the shards that had the pair did not align the ends as
+ * single-end. Otherwise, if no pair is reported, each end gets its best
+ * single-end hit over the shards that aligned it.
+ */
+static void
+merge_pe_hits(const bool allow_ambig, const ChromLookup &cl,
+              const vector<pe_element> &pairs, const vector<se_element> &hits1,
+              const vector<se_element> &hits2,
+              const vector<bam_cigar_t> &cigars1,
+              const vector<bam_cigar_t> &cigars2, pe_element &best,
+              se_element &se1, se_element &se2, bam_cigar_t &cigar1,
+              bam_cigar_t &cigar2) {
+  best.reset();
+  se1.reset();
+  se2.reset();
+  size_t best_k = pairs.size();
+  bool tied = false;
+  uint32_t chrom1 = 0, chrom2 = 0;
+  for (size_t k = 0; k < pairs.size(); ++k) {
+    const pe_element &p = pairs[k];
+    if (p.empty() || !valid_posn(cl, cigars1[k], p.r1.pos, chrom1) ||
+        !valid_posn(cl, cigars2[k], p.r2.pos, chrom2) || chrom1 != chrom2)
+      continue;
+    if (p.aln_score > best.aln_score) {
+      best = p;
+      best_k = k;
+      tied = false;
+    }
+    else if (p.aln_score == best.aln_score)
+      tied = true;
+  }
+  if (tied) best.r1.set_ambig();
+  if (best_k < pairs.size() && (tied || best.should_report(allow_ambig))) {
+    cigar1 = cigars1[best_k];
+    cigar2 = cigars2[best_k];
+    return;
+  }
+  merge_se_hits(cl, hits1, cigars1, se1, cigar1);
+  merge_se_hits(cl, hits2, cigars2, se2, cigar2);
+}
+
+/* After the passes over the shards of an index, the reads are loaded
+ * again with their hits in each shard, which were written in the same
+ * order. The merged hits are formatted with the chromosomes of all
+ * shards and written, so the output and statistics are those of a
+ * single index.
+ */
+static void
+merge_single_ended(const bool VERBOSE, const bool show_progress,
+                   const bool allow_ambig, const ChromLookup &cl,
+                   const string &reads_file, vector<FILE *> &hits_in,
+                   se_map_stats &se_stats, bamxx::bam_header &hdr,
+                   bamxx::bam_out &out, htsThreadPool *io_pool,
+                   output_stats &ostats) {
+  ReadLoader rl(reads_file, io_pool);
+  ProgressBar progress(get_filesize(reads_file), "merging shards");
+  const size_t n_shards = hits_in.size();
+  const auto start_time = omp_get_wtime();
+
+#pragma omp parallel for
+  for (int t = 0; t < omp_get_num_threads(); ++t) {
+    vector<string> names, reads, quals;
+    vector<bam_cigar_t> cigar(ReadLoader::batch_size);
+    vector<se_element> bests(ReadLoader::batch_size);
+    vector<bam_rec> mr(ReadLoader::batch_size);
+    vector<vector<se_element>> hits(ReadLoader::batch_size,
+                                    vector<se_element>(n_shards));
+    vector<vector<bam_cigar_t>> hit_cigars(ReadLoader::batch_size,
+                                           vector<bam_cigar_t>(n_shards));
+    compact::block cblock;
+    size_t the_byte = 0;
+    while (rl) {
+#pragma omp critical
+      {
+        rl.load_reads(names, reads, quals);
+        the_byte = rl.get_current_byte();
+        for (size_t k = 0; k < n_shards; ++k)
+          for (size_t i = 0; i < reads.size(); ++i)
+            shard_hits::read(hits_in[k], hits[i][k], hit_cigars[i][k]);
+      }
+      const size_t n_reads = reads.size();
+      for (size_t i = 0; i < n_reads; ++i) {
+        merge_se_hits(cl, hits[i], hit_cigars[i], bests[i], cigar[i]);
+        if (format_output(allow_ambig, bests[i], cl, reads[i], names[i],
+                          cigar[i], mr[i], cblock) == map_unmapped)
+          bests[i].reset();
+      }
+      if (compact_output::enabled)
+        cblock.seal(compact_output::compress_level);
+#pragma omp critical
+      {
+        const double write_start = omp_get_wtime();
+        for (size_t i = 0; i < n_reads; ++i) {
+          if (valid_bam_rec(mr[i]) && !out.write(hdr, mr[i]))
+            throw runtime_error("failed to write bam");
+          se_stats.update(allow_ambig, reads[i], cigar[i], bests[i]);
+        }
+        compact_output::write_block(out, cblock);
+        ostats.write_seconds += omp_get_wtime() - write_start;
+      }
+      for (size_t i = 0; i < n_reads; ++i) {
+        if (valid_bam_rec(mr[i])) reset_bam_rec(mr[i]);
+        cigar[i].clear();
+      }
+      cblock.clear();
+      if (show_progress)
+#pragma omp critical
+      {
+        if (progress.time_to_report(the_byte)) progress.report(cerr, the_byte);
+      }
+    }
+  }
+  if (VERBOSE)
+    print_with_time("total merging time: " +
+                    format_time_in_sec(omp_get_wtime() - start_time));
+}
+
+static void
+merge_paired_ended(const bool VERBOSE, const bool show_progress,
+                   const bool allow_ambig, const ChromLookup &cl,
+                   const string &reads_file1, const string &reads_file2,
+                   vector<FILE *> &hits_in, pe_map_stats &pe_stats,
+                   bamxx::bam_header &hdr, bamxx::bam_out &out,
+                   htsThreadPool *io_pool, output_stats &ostats) {
+  const bool interleaved = reads_file2.empty();
+  ReadLoader rl1(reads_file1, io_pool);
+  std::unique_ptr<ReadLoader> rl2_ptr(
+    interleaved ? nullptr : new ReadLoader(reads_file2, io_pool));
+  ReadLoader &rl2 = interleaved ? rl1 : *rl2_ptr;
+  ProgressBar progress(get_filesize(reads_file1), "merging shards");
+  const size_t n_shards = hits_in.size();
+  const auto start_time = omp_get_wtime();
+
+#pragma omp parallel for
+  for (int t = 0; t < omp_get_num_threads(); ++t) {
+    vector<string> names1, reads1, quals1, names2, reads2, quals2;
+    vector<bam_cigar_t> cigar1(ReadLoader::batch_size);
+    vector<bam_cigar_t> cigar2(ReadLoader::batch_size);
+    vector<pe_element> bests(ReadLoader::batch_size);
+    vector<se_element> bests_se1(ReadLoader::batch_size);
+    vector<se_element> bests_se2(ReadLoader::batch_size);
+    vector<bam_rec> mr1(ReadLoader::batch_size);
+    vector<bam_rec> mr2(ReadLoader::batch_size);
+    // hits of each read of the batch in each shard
+    vector<vector<pe_element>> pairs(ReadLoader::batch_size,
+                                     vector<pe_element>(n_shards));
+    vector<vector<se_element>> hits1(ReadLoader::batch_size,
+                                     vector<se_element>(n_shards));
+    vector<vector<se_element>> hits2(hits1);
+    vector<vector<bam_cigar_t>> hit_cigars1(ReadLoader::batch_size,
+                                            vector<bam_cigar_t>(n_shards));
+    vector<vector<bam_cigar_t>> hit_cigars2(hit_cigars1);
+    compact::block cblock;
+    size_t the_byte = 0;
+    while (rl1 && rl2) {
+#pragma omp critical
+      {
+        load_read_pairs(rl1, rl2, names1, reads1, quals1, names2, reads2,
+                        quals2);
+        the_byte = rl1.get_current_byte();
+        if (reads1.size() != reads2.size())
+          throw runtime_error("paired-end batch sizes differ. Batch 1: " +
+                              to_string(reads1.size()) + ", batch 2: " +
+                              to_string(reads2.size()));
+        for (size_t k = 0; k < n_shards; ++k)
+          for (size_t i = 0; i < reads1.size(); ++i)
+            shard_hits::read(hits_in[k], pairs[i][k], hits1[i][k],
+                             hits2[i][k], hit_cigars1[i][k],
+                             hit_cigars2[i][k]);
+      }
+      const size_t n_reads = reads1.size();
+      for (size_t i = 0; i < n_reads; ++i) {
+        merge_pe_hits(allow_ambig, cl, pairs[i], hits1[i], hits2[i],
+                      hit_cigars1[i], hit_cigars2[i], bests[i], bests_se1[i],
+                      bests_se2[i], cigar1[i], cigar2[i]);
+        format_output(allow_ambig, cl, reads1[i], names1[i], reads2[i],
+                      names2[i], cigar1[i], cigar2[i], bests[i], bests_se1[i],
+                      bests_se2[i], mr1[i], mr2[i], cblock);
+      }
+      if (compact_output::enabled)
+        cblock.seal(compact_output::compress_level);
+#pragma omp critical
+      {
+        const double write_start = omp_get_wtime();
+        for (size_t i = 0; i < n_reads; ++i) {
+          if (valid_bam_rec(mr1[i]) && !out.write(hdr, mr1[i]))
+            throw runtime_error("failed to write bam");
+          if (valid_bam_rec(mr2[i]) && !out.write(hdr, mr2[i]))
+            throw runtime_error("failed to write bam");
+          pe_stats.update(allow_ambig, reads1[i], reads2[i], cigar1[i],
+                          cigar2[i], bests[i], bests_se1[i], bests_se2[i]);
+        }
+        compact_output::write_block(out, cblock);
+        ostats.write_seconds += omp_get_wtime() - write_start;
+      }
+      for (size_t i = 0; i < n_reads; ++i) {
+        if (valid_bam_rec(mr1[i])) reset_bam_rec(mr1[i]);
+        if (valid_bam_rec(mr2[i])) reset_bam_rec(mr2[i]);
+        cigar1[i].clear();
+        cigar2[i].clear();
+      }
+      cblock.clear();
+      if (show_progress)
+#pragma omp critical
+      {
+        if (progress.time_to_report(the_byte)) progress.report(cerr, the_byte);
+      }
+    }
+  }
+  if (VERBOSE)
+    print_with_time("total merging time: " +
+                    format_time_in_sec(omp_get_wtime() - start_time));
+}
+
 // this is used to fail before reading the index if any input FASTQ
 // file does not exist
 static inline bool
@@ -2041,15 +4232,40 @@ file_exists(const string &filename) {
   return (access(filename.c_str(), F_OK) == 0);
 }
 
+/* On resuming from a checkpoint, the output of the interrupted run
+ * was moved aside, and is moved back in place of the output just
+ * opened. It is cut where the checkpoint was saved, dropping anything
+ * written after it, since those reads will be mapped again, and the
+ * records of the resumed run are appended to it.
+ */
+static void
+resume_output(const string &partial_outfile, const string &outfile,
+              const int64_t offset, const bool bam_fmt,
+              bamxx::bam_out &out) {
+  hts_close(out.f);
+  out.f = nullptr;
+  if (std::rename(partial_outfile.c_str(), outfile.c_str()) != 0)
+    throw runtime_error("failed to restore output file: " + outfile);
+  if (truncate(outfile.c_str(), offset) != 0)
+    throw runtime_error("failed to truncate output file: " + outfile);
+  out.f = hts_open(outfile.c_str(), bam_fmt ? "ab" : "a");
+  if (!out.f) throw runtime_error("failed to open output file: " + outfile);
+}
+
 static int
-abismal_make_sam_header(const ChromLookup &cl, const int argc,
-                        const char **argv, bamxx::bam_header &hdr) {
+abismal_make_sam_header(const ChromLookup &cl, const vector<string> &comments,
+                        const int argc, const char **argv,
+                        bamxx::bam_header &hdr) {
   assert(cl.names.size() > 2);  // two entries exist for the padding
   assert(cl.starts.size() == cl.names.size() + 1);
-  const vector<string> names(begin(cl.names) + 1, end(cl.names) - 1);
-  vector<size_t> sizes(names.size());
-  for (size_t i = 0; i < names.size(); ++i)
-    sizes[i] = cl.starts[i + 2] - cl.starts[i + 1];
+  // entries without a target id are padding between genomes
+  vector<string> names;
+  vector<size_t> sizes;
+  for (size_t i = 1; i + 1 < cl.names.size(); ++i)
+    if (cl.get_tid(i) >= 0) {
+      names.push_back(cl.names[i]);
+      sizes.push_back(cl.starts[i + 1] - cl.starts[i]);
+    }
 
   static const std::string SAM_VERSION = "1.0";
 
@@ -2064,6 +4280,10 @@ abismal_make_sam_header(const ChromLookup &cl, const int argc,
     out << "@SQ" << '\t' << "SN:" << names[i] << '\t' << "LN:" << sizes[i]
         << '\n';
 
+  // indexes the sequences come from, if more than one
+  for (size_t i = 0; i < comments.size(); ++i)
+    out << "@CO" << '\t' << comments[i] << '\n';
+
   // program details
   out << "@PG" << '\t' << "ID:"
       << "ABISMAL" << '\t' << "VN:" << VERSION << '\t';
@@ -2078,6 +4298,379 @@ abismal_make_sam_header(const ChromLookup &cl, const int argc,
   return sam_hdr_add_lines(hdr.h, out.str().c_str(), out.str().size());
 }
 
+// a thread pool shared by all input and output files
+struct io_thread_pool {
+  explicit io_thread_pool(const int n_threads) : p{nullptr, 0} {
+    if (n_threads > 0 && !(p.pool = hts_tpool_init(n_threads)))
+      throw runtime_error("failed to start io threads");
+  }
+  ~io_thread_pool() {
+    if (p.pool) hts_tpool_destroy(p.pool);
+  }
+  htsThreadPool *get() { return p.pool ? &p : nullptr; }
+  htsThreadPool p;
+};
+
+// indexes given as a comma separated list, each as "label=file" or
+// just the file, labeled by its name up to the first dot
+static void
+parse_index_files(const string &arg, vector<string> &files,
+                  vector<string> &labels) {
+  std::istringstream iss(arg);
+  string entry;
+  while (getline(iss, entry, ',')) {
+    const size_t eq = entry.find('=');
+    const string file = (eq == string::npos) ? entry : entry.substr(eq + 1);
+    string label = entry.substr(0, eq);
+    if (eq == string::npos) {
+      label = strip_path(file);
+      label = label.substr(0, label.find('.'));
+    }
+    if (file.empty() || label.empty())
+      throw runtime_error("bad index file argument: " + entry);
+    if (find(begin(labels), end(labels), label) != end(labels))
+      throw runtime_error("duplicate index label: " + label);
+    files.push_back(file);
+    labels.push_back(label);
+  }
+}
+
+// seeds of indexes mapped to at once must be the same
+static string
+seed_settings() {
+  return to_string(seed::window_size) + " " + to_string(seed::span_two) + " " +
+         to_string(seed::span_three) + " " + to_string(seed::mask_two) + " " +
+         to_string(seed::mask_three);
+}
+
+// sequence names that appear in an earlier index are prefixed with
+// the label of the later one
+static void
+rename_duplicate_sequences(const ChromLookup &cl, const string &label,
+                           ChromLookup &other) {
+  std::unordered_set<string> names;
+  for (size_t i = 1; i + 1 < cl.names.size(); ++i)
+    if (cl.get_tid(i) >= 0) names.insert(cl.names[i]);
+  for (size_t i = 1; i + 1 < other.names.size(); ++i)
+    if (names.count(other.names[i]) > 0)
+      other.names[i] = label + "_" + other.names[i];
+}
+
+/* Settings that -autotune chooses, written as "name: value" lines
+ * (YAML) that -config loads in later runs. Lines starting with '#'
+ * are comments, where autotune records the trials it ran. */
+struct tuned_settings {
+  tuned_settings()
+      : n_threads(1), batch_size(ReadLoader::default_batch_size),
+        max_candidates(0),
+        band_width(AbismalAlignSimple::default_max_off_diag),
+        compress_level(-1) {}
+
+  int n_threads;
+  size_t batch_size;
+  uint32_t max_candidates;  // 0 for the estimate of the index
+  size_t band_width;        // bases off the diagonal of an alignment
+  int compress_level;       // -1 for the default
+
+  void read(const string &filename) {
+    std::ifstream in(filename);
+    if (!in) throw runtime_error("cannot open config file: " + filename);
+    string line;
+    size_t line_number = 0;
+    while (getline(in, line)) {
+      ++line_number;
+      if (line.empty() || line[0] == '#') continue;
+      const size_t colon = line.find(':');
+      std::istringstream iss(colon == string::npos ? string()
+                                                   : line.substr(colon + 1));
+      const string name = line.substr(0, colon);
+      bool good = false;
+      if (name == "threads") good = static_cast<bool>(iss >> n_threads);
+      else if (name == "batch_size")
+        good = static_cast<bool>(iss >> batch_size);
+      else if (name == "max_candidates")
+        good = static_cast<bool>(iss >> max_candidates);
+      else if (name == "band_width")
+        good = static_cast<bool>(iss >> band_width);
+      else if (name == "compress_level")
+        good = static_cast<bool>(iss >> compress_level);
+      if (!good)
+        throw runtime_error("bad line " + to_string(line_number) +
+                            " in config file " + filename + ": " + line);
+    }
+  }
+
+  // the compression level is only kept for compressed output
+  string tostring(const bool compressed) const {
+    ostringstream oss;
+    oss << "threads: " << n_threads << endl
+        << "batch_size: " << batch_size << endl
+        << "max_candidates: " << max_candidates << endl
+        << "band_width: " << band_width << endl;
+    if (compressed) oss << "compress_level: " << compress_level << endl;
+    return oss.str();
+  }
+
+  bool operator==(const tuned_settings &rhs) const {
+    return n_threads == rhs.n_threads && batch_size == rhs.batch_size &&
+           max_candidates == rhs.max_candidates &&
+           band_width == rhs.band_width &&
+           compress_level == rhs.compress_level;
+  }
+
+  // ADS: the settings are global, so they are set once before mapping
+  void apply(AbismalIndex &index) const {
+    omp_set_num_threads(n_threads);
+    ReadLoader::batch_size = batch_size;
+    index.max_candidates = max_candidates;
+    AbismalAlignSimple::max_off_diag = band_width;
+    compact_output::compress_level = compress_level;
+  }
+};
+
+// the result of mapping the sample with one choice of settings
+struct autotune_trial {
+  autotune_trial() : reads_per_sec(0.0), frac_mapped(0.0), n_bytes(0) {}
+  tuned_settings settings;
+  double reads_per_sec;
+  double frac_mapped;
+  size_t n_bytes;
+
+  string tostring() const {
+    ostringstream oss;
+    oss << settings.n_threads << '\t' << settings.batch_size << '\t'
+        << settings.max_candidates << '\t' << settings.band_width << '\t'
+        << settings.compress_level << '\t' << std::fixed
+        << std::setprecision(0) << reads_per_sec << '\t'
+        << std::setprecision(2) << 100.0 * frac_mapped << '\t' << n_bytes;
+    return oss.str();
+  }
+};
+
+/* Among trials that map as many reads as the best, up to this fraction
+ * of the sample, the fastest is kept, so fewer candidates or a
+ * narrower band are chosen only if they cost no mapped reads. A
+ * compression level is kept if it is within this fraction of the
+ * fastest level, and gives the smallest output. */
+static const double autotune_mapped_tolerance = 0.001;
+static const double autotune_speed_tolerance = 0.1;
+
+static size_t
+fastest_trial(const vector<autotune_trial> &trials) {
+  double max_mapped = 0.0;
+  for (size_t i = 0; i < trials.size(); ++i)
+    max_mapped = max(max_mapped, trials[i].frac_mapped);
+  size_t best = trials.size();
+  for (size_t i = 0; i < trials.size(); ++i)
+    if (trials[i].frac_mapped + autotune_mapped_tolerance >= max_mapped &&
+        (best == trials.size() ||
+         trials[i].reads_per_sec > trials[best].reads_per_sec))
+      best = i;
+  return best;
+}
+
+static size_t
+smallest_output_trial(const vector<autotune_trial> &trials) {
+  double max_speed = 0.0;
+  for (size_t i = 0; i < trials.size(); ++i)
+    max_speed = max(max_speed, trials[i].reads_per_sec);
+  size_t best = trials.size();
+  const double min_speed = (1.0 - autotune_speed_tolerance) * max_speed;
+  for (size_t i = 0; i < trials.size(); ++i)
+    if (trials[i].reads_per_sec >= min_speed &&
+        (best == trials.size() || trials[i].n_bytes < trials[best].n_bytes))
+      best = i;
+  return best;
+}
+
+// the first n_records reads of the input are copied to a FASTQ file,
+// so every trial maps the same reads, and the input can be BAM or gzip
+static size_t
+write_autotune_sample(const string &reads_file, const string &sample_file,
+                      const size_t n_records, htsThreadPool *io_pool) {
+  ReadLoader rl(reads_file, io_pool);
+  std::ofstream out(sample_file);
+  if (!out) throw runtime_error("cannot open sample file: " + sample_file);
+  vector<string> names, reads, quals;
+  size_t n_written = 0;
+  while (n_written < n_records) {
+    rl.load_reads(names, reads, quals,
+                  min(ReadLoader::batch_size, n_records - n_written));
+    if (reads.empty()) break;
+    for (size_t i = 0; i < reads.size(); ++i) {
+      // qualities are only kept with a minimum seed quality
+      string qual(reads[i].size(), 'I');
+      if (quals[i].size() == reads[i].size())
+        for (size_t j = 0; j < qual.size(); ++j) qual[j] = quals[i][j] + 33;
+      out << '@' << names[i] << '\n' << reads[i] << "\n+\n" << qual << '\n';
+    }
+    n_written += reads.size();
+  }
+  if (!out) throw runtime_error("failed to write sample file: " + sample_file);
+  return n_written;
+}
+
+/* Maps the sample under a search over the settings, one setting at a
+ * time with the others kept at the best so far: threads, batch size,
+ * max candidates, band width and, for BAM or compact output, the
+ * compression level. The map_sample function maps the sample to the
+ * output it is given, and the trials are kept in the order they ran. */
+template<class map_fun> static tuned_settings
+autotune(const bool VERBOSE, const tuned_settings &start,
+         const size_t n_sample, const bool write_bam_fmt,
+         const string &sample_outfile, AbismalIndex &index,
+         bamxx::bam_header &hdr, htsThreadPool *io_pool, map_fun map_sample,
+         vector<autotune_trial> &trials) {
+  const bool compressed = write_bam_fmt || compact_output::enabled;
+
+  const auto run_trial = [&](const tuned_settings &s) {
+    s.apply(index);
+    autotune_trial t;
+    t.settings = s;
+    se_map_stats se;
+    pe_map_stats pe;
+    output_stats os;
+    {
+      bamxx::bam_out out(sample_outfile, write_bam_fmt);
+      if (!out)
+        throw runtime_error("failed to open output file: " + sample_outfile);
+      if (io_pool && !compact_output::enabled &&
+          hts_set_thread_pool(out.f, io_pool) < 0)
+        throw runtime_error("failed to set threads for: " + sample_outfile);
+      if (s.compress_level >= 0 && write_bam_fmt &&
+          hts_set_opt(out.f, HTS_OPT_COMPRESSION_LEVEL, s.compress_level) < 0)
+        throw runtime_error("failed to set compression level for: " +
+                            sample_outfile);
+      if (compact_output::enabled) compact_output::write_header(out, hdr);
+      else if (!out.write(hdr)) throw runtime_error("error writing header");
+
+      const double start_time = omp_get_wtime();
+      map_sample(se, pe, out, os);
+      if (compact_output::enabled)
+        compact_output::write(out, compact::end_block());
+      if (hts_flush(out.f) < 0)
+        throw runtime_error("failed to flush output file: " + sample_outfile);
+      t.reads_per_sec = n_sample / max(omp_get_wtime() - start_time, 1e-6);
+    }
+    t.n_bytes = get_filesize(sample_outfile);
+    const size_t n_mapped = se.tot_rds > 0 ? se.uniq_rds + se.ambig_rds
+                                           : pe.uniq_pairs + pe.ambig_pairs;
+    t.frac_mapped = static_cast<double>(n_mapped) / max(n_sample, size_t(1));
+    return t;
+  };
+
+  const auto timed_trial = [&](const tuned_settings &s) {
+    const autotune_trial t = run_trial(s);
+    if (VERBOSE)
+      print_with_time("trial " + to_string(trials.size() + 1) + ": " +
+                      t.tostring());
+    trials.push_back(t);
+    return t;
+  };
+
+  // the values of one setting are tried, and choose picks the trial
+  const auto search = [&](const vector<tuned_settings> &candidates,
+                          size_t (*choose)(const vector<autotune_trial> &),
+                          autotune_trial &best) {
+    vector<autotune_trial> v(1, best);
+    for (size_t i = 0; i < candidates.size(); ++i)
+      if (!(candidates[i] == best.settings))
+        v.push_back(timed_trial(candidates[i]));
+    best = v[choose(v)];
+  };
+
+  // ADS: a first trial is not timed, since it faults in the pages of
+  // the index and brings the sample into the page cache
+  run_trial(start);
+  autotune_trial best = timed_trial(start);
+
+  // powers of two up to the number of processors, and that number
+  vector<int> thread_counts;
+  const int n_procs = omp_get_num_procs();
+  for (int t = 1; t < n_procs; t *= 2) thread_counts.push_back(t);
+  thread_counts.push_back(n_procs);
+
+  vector<tuned_settings> candidates;
+  for (const int t : thread_counts) {
+    candidates.push_back(best.settings);
+    candidates.back().n_threads = t;
+  }
+  search(candidates, fastest_trial, best);
+
+  candidates.clear();
+  for (const size_t b : {250ul, 1000ul, 4000ul}) {
+    candidates.push_back(best.settings);
+    candidates.back().batch_size = b;
+  }
+  search(candidates, fastest_trial, best);
+
+  candidates.clear();
+  const uint32_t base = best.settings.max_candidates;
+  for (const uint32_t c : {base / 2, 2 * base, 4 * base}) {
+    candidates.push_back(best.settings);
+    candidates.back().max_candidates = max(c, 1u);
+  }
+  search(candidates, fastest_trial, best);
+
+  candidates.clear();
+  for (const size_t w : {10ul, 20ul, 30ul, 50ul}) {
+    candidates.push_back(best.settings);
+    candidates.back().band_width = w;
+  }
+  search(candidates, fastest_trial, best);
+
+  if (compressed) {
+    candidates.clear();
+    for (const int level : {1, 3, 6}) {
+      candidates.push_back(best.settings);
+      candidates.back().compress_level = level;
+    }
+    search(candidates, smallest_output_trial, best);
+  }
+  return best.settings;
+}
+
+// true if an option is on the command line, by its long name (with
+// one or two dashes, and optionally "=value") or its short name
+static bool
+option_given(const int argc, const char **argv, const string &name,
+             const char short_name = '\0') {
+  for (int i = 1; i < argc; ++i) {
+    const string arg(argv[i]);
+    if (arg.size() < 2 || arg[0] != '-') continue;
+    const size_t start = (arg[1] == '-') ? 2 : 1;
+    const string given = arg.substr(start, arg.find('=') - start);
+    if (given == name ||
+        (short_name != '\0' && given == string(1, short_name)))
+      return true;
+  }
+  return false;
+}
+
+// options that change the records, so a run resumed from a
+// checkpoint must be given the same
+static string
+mapping_options(const bool allow_ambig, const bool pbat_mode,
+                const bool random_pbat, const bool GA_conversion,
+                const bool write_bam_fmt, const bool prefilter_index,
+                const uint32_t max_candidates) {
+  ostringstream oss;
+  oss << "-c " << max_candidates << " -l " << pe_element::min_dist
+      << " -L " << pe_element::max_dist << " -m " << se_element::valid_frac
+      << " -band-width " << AbismalAlignSimple::max_off_diag
+      << " -batch-size " << ReadLoader::batch_size
+      << " -min-seed-qual " << ReadLoader::min_seed_qual;
+  if (allow_ambig) oss << " -a";
+  if (pbat_mode) oss << " -P";
+  if (random_pbat) oss << " -R";
+  if (GA_conversion) oss << " -A";
+  if (write_bam_fmt) oss << " -B";
+  if (candidate_controller::enabled) oss << " -adaptive";
+  if (read_prefilter::enabled) oss << " -prefilter";
+  if (prefilter_index) oss << " -prefilter-index";
+  return oss.str();
+}
+
 int
 abismal(int argc, const char **argv) {
   try {
@@ -2087,23 +4680,47 @@ abismal(int argc, const char **argv) {
     bool pbat_mode = false;
     bool random_pbat = false;
     bool write_bam_fmt = false;
+    bool interleaved = false;
+    bool parallel_load = false;
+    bool direct_io = false;
+    bool lock_index = false;
+    bool prefilter_index = false;
     int n_threads = 1;
+    int n_io_threads = 0;
+    int compress_level = -1;
+    uint32_t locality_cache_size = 0;
     uint32_t max_candidates = 0;
     string index_file = "";
     string genome_file = "";
     string outfile("-");
     string stats_outfile = "";
+    string checkpoint_file = "";
+    size_t checkpoint_interval = 1000000;
+    string trace_file = "";
+    string config_file = "";
+    string autotune_file = "";
+    size_t autotune_reads = 100000;
 
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "map bisulfite converted reads",
-                           "<reads-fq1> [<reads-fq2>]");
+                           "<reads-fq1> [<reads-fq2>] (FASTQ or uBAM/CRAM)");
     opt_parse.set_show_defaults();
-    opt_parse.add_opt("index", 'i', "index file", false, index_file);
+    opt_parse.add_opt("index", 'i',
+                      "index file, or comma separated [label=]files to map "
+                      "to several at once",
+                      false, index_file);
     opt_parse.add_opt("genome", 'g', "genome file (FASTA)", false, genome_file);
     opt_parse.add_opt("outfile", 'o', "output file", false, outfile);
     opt_parse.add_opt("bam", 'B', "output BAM format", false, write_bam_fmt);
+    opt_parse.add_opt("compact", '\0',
+                      "output compact binary format (no names or qualities)",
+                      false, compact_output::enabled);
     opt_parse.add_opt("stats", 's', "map statistics file (YAML)", false,
                       stats_outfile);
+    opt_parse.add_opt("compress-level", '\0',
+                      "BAM or compact compression level, 0 "
+                      "(uncompressed) to 9 (-1 = default)",
+                      false, compress_level);
     opt_parse.add_opt("max-candidates", 'c',
                       "max candidates per seed "
                       "(0 = use index estimate)",
@@ -2123,6 +4740,65 @@ abismal(int argc, const char **argv) {
     opt_parse.add_opt("a-rich", 'A', "indicates reads are a-rich (se mode)",
                       false, GA_conversion);
     opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
+    opt_parse.add_opt("batch-size", '\0', "reads loaded by a thread at a time",
+                      false, ReadLoader::batch_size);
+    opt_parse.add_opt("band-width", '\0',
+                      "bases an alignment may shift off the diagonal", false,
+                      AbismalAlignSimple::max_off_diag);
+    opt_parse.add_opt("parallel-load", '\0',
+                      "load the index using all threads", false,
+                      parallel_load);
+    opt_parse.add_opt("direct-io", '\0',
+                      "load the index bypassing the page cache", false,
+                      direct_io);
+    opt_parse.add_opt("lock-index", '\0',
+                      "pre-fault and lock the index in memory", false,
+                      lock_index);
+    opt_parse.add_opt("io-threads", '\0',
+                      "extra threads shared by input decompression and "
+                      "output compression", false, n_io_threads);
+    opt_parse.add_opt("locality-cache", '\0',
+                      "recent reads per thread checked for duplicates "
+                      "(0 = off)",
+                      false, locality_cache_size);
+    opt_parse.add_opt("adaptive", '\0',
+                      "adapt candidates verified to each read's buckets",
+                      false, candidate_controller::enabled);
+    opt_parse.add_opt("prefilter", '\0',
+                      "skip low complexity reads before seeding", false,
+                      read_prefilter::enabled);
+    opt_parse.add_opt("prefilter-index", '\0',
+                      "also skip reads with no two-letter seed in the index",
+                      false, prefilter_index);
+    opt_parse.add_opt("min-seed-qual", '\0',
+                      "skip seeds with bases below this quality (0 = off)",
+                      false, ReadLoader::min_seed_qual);
+    opt_parse.add_opt("interleaved", '\0',
+                      "single input has both ends of each pair (pe mode)",
+                      false, interleaved);
+    opt_parse.add_opt("follow", '\0',
+                      "map FASTQ input as it is written, until this file "
+                      "exists",
+                      false, growing_file::sentinel);
+    opt_parse.add_opt("checkpoint", '\0',
+                      "checkpoint file to resume interrupted runs", false,
+                      checkpoint_file);
+    opt_parse.add_opt("checkpoint-interval", '\0',
+                      "reads mapped between checkpoints", false,
+                      checkpoint_interval);
+    opt_parse.add_opt("trace-file", '\0',
+                      "timeline of thread activity (Chrome trace JSON)",
+                      false, trace_file);
+    opt_parse.add_opt("config", '\0',
+                      "settings written by -autotune, for options not given",
+                      false, config_file);
+    opt_parse.add_opt("autotune", '\0',
+                      "map a sample of the input to choose settings, "
+                      "written to this file",
+                      false, autotune_file);
+    opt_parse.add_opt("autotune-reads", '\0',
+                      "reads (or pairs) in the autotune sample", false,
+                      autotune_reads);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -2145,29 +4821,126 @@ abismal(int argc, const char **argv) {
       cerr << opt_parse.help_message() << endl;
       return EXIT_SUCCESS;
     }
+    // settings from a config file are used for options not given, so
+    // those on the command line take precedence even at their defaults
+    if (!config_file.empty()) {
+      tuned_settings config;
+      config.read(config_file);
+      if (!option_given(argc, argv, "threads", 't'))
+        n_threads = config.n_threads;
+      if (!option_given(argc, argv, "batch-size"))
+        ReadLoader::batch_size = config.batch_size;
+      if (!option_given(argc, argv, "max-candidates", 'c'))
+        max_candidates = config.max_candidates;
+      if (!option_given(argc, argv, "band-width"))
+        AbismalAlignSimple::max_off_diag = config.band_width;
+      if (!option_given(argc, argv, "compress-level") &&
+          (write_bam_fmt || compact_output::enabled))
+        compress_level = config.compress_level;
+      if (VERBOSE) {
+        tuned_settings used;
+        used.n_threads = n_threads;
+        used.batch_size = ReadLoader::batch_size;
+        used.max_candidates = max_candidates;
+        used.band_width = AbismalAlignSimple::max_off_diag;
+        used.compress_level = compress_level;
+        string settings =
+          used.tostring(write_bam_fmt || compact_output::enabled);
+        settings.pop_back();
+        print_with_time("settings with config " + config_file + ":\n" +
+                        settings);
+      }
+    }
     if (n_threads <= 0) {
       cerr << "please choose a positive number of threads" << endl;
       return EXIT_SUCCESS;
     }
+    if (n_io_threads < 0) {
+      cerr << "please choose a non-negative number of io threads" << endl;
+      return EXIT_SUCCESS;
+    }
+    if (compress_level < -1 || compress_level > 9) {
+      cerr << "please choose a compression level from -1 to 9" << endl;
+      return EXIT_SUCCESS;
+    }
+    if (write_bam_fmt && compact_output::enabled) {
+      cerr << "please choose either BAM (-B) or compact output" << endl;
+      return EXIT_SUCCESS;
+    }
+    if (compress_level >= 0 && !write_bam_fmt && !compact_output::enabled) {
+      cerr << "a compression level requires BAM (-B) or compact output"
+           << endl;
+      return EXIT_SUCCESS;
+    }
+    if (ReadLoader::batch_size == 0) {
+      cerr << "please choose a positive batch size" << endl;
+      return EXIT_SUCCESS;
+    }
+    if (AbismalAlignSimple::max_off_diag == 0 ||
+        AbismalAlignSimple::max_off_diag > 1000) {
+      cerr << "please choose a band width from 1 to 1000" << endl;
+      return EXIT_SUCCESS;
+    }
+    if (ReadLoader::min_seed_qual > 93) {
+      cerr << "please choose a minimum seed quality from 0 to 93" << endl;
+      return EXIT_SUCCESS;
+    }
+    // the index is probed by the complexity prefilter
+    if (prefilter_index) read_prefilter::enabled = true;
+    if (interleaved && leftover_args.size() != 1) {
+      cerr << "interleaved input must be a single reads file" << endl;
+      return EXIT_SUCCESS;
+    }
     if (index_file.empty() == genome_file.empty()) {
       cerr << "please select either an index file (-i) or a genome file (-g)"
            << endl;
       return EXIT_SUCCESS;
     }
 
+    if (!checkpoint_file.empty() && outfile == "-") {
+      cerr << "an output file (-o) is required with a checkpoint" << endl;
+      return EXIT_SUCCESS;
+    }
+    // ADS: resuming cuts the output where the checkpoint was saved,
+    // which is only kept track of for SAM and BAM
+    if (!checkpoint_file.empty() && compact_output::enabled) {
+      cerr << "checkpoints are not available with compact output" << endl;
+      return EXIT_SUCCESS;
+    }
+
+    // input being followed is read from the start as it is written
+    if (growing_file::following() && !checkpoint_file.empty()) {
+      cerr << "checkpoints are not available when following input" << endl;
+      return EXIT_SUCCESS;
+    }
+
+    // the sample is taken from the start of the input, and nothing is
+    // mapped to the output
+    if (!autotune_file.empty() &&
+        (growing_file::following() || !checkpoint_file.empty())) {
+      cerr << "-autotune is not available when following input or with a "
+           << "checkpoint" << endl;
+      return EXIT_SUCCESS;
+    }
+    if (!autotune_file.empty() && autotune_reads == 0) {
+      cerr << "please choose a positive number of autotune reads" << endl;
+      return EXIT_SUCCESS;
+    }
+
     const string reads_file = leftover_args.front();
     string reads_file2;
 
-    if (!file_exists(reads_file)) {
+    // input being followed may not have been created yet
+    if (!growing_file::following() && !file_exists(reads_file)) {
       cerr << "cannot open read 1 FASTQ file: " << reads_file << endl;
       return EXIT_FAILURE;
     }
-    bool paired_end = false;
+    bool paired_end = interleaved;
     if (leftover_args.size() == 2) {
       paired_end = true;
       reads_file2 = leftover_args.back();
 
-      if (!file_exists(reads_file2)) {
+      if (!growing_file::following() && !file_exists(reads_file2)) {
         cerr << "cannot open read 2 FASTQ file: " << reads_file2 << endl;
         return EXIT_FAILURE;
       }
@@ -2194,18 +4967,27 @@ abismal(int argc, const char **argv) {
                       " threads to map reads.");
     /****************** END THREAD VALIDATION *****************/
 
-    const bool show_progress = VERBOSE && isatty(fileno(stderr));
+    // the size of input being followed is not known
+    const bool show_progress = VERBOSE && isatty(fileno(stderr)) &&
+                               !growing_file::following() &&
+                               autotune_file.empty();
 
     AbismalIndex::VERBOSE = VERBOSE;
 
     if (VERBOSE) {
-      if (paired_end)
+      if (interleaved)
+        print_with_time("input (PE, interleaved): " + reads_file);
+      else if (paired_end)
         print_with_time("input (PE): " + reads_file + ", " + reads_file2);
       else
         print_with_time("input (SE): " + reads_file);
+      if (growing_file::following())
+        print_with_time("following input until: " + growing_file::sentinel);
 
       string output_msg = "output ";
-      output_msg += (write_bam_fmt ? "(BAM): " : "(SAM): ");
+      output_msg += (compact_output::enabled
+                       ? "(compact): "
+                       : (write_bam_fmt ? "(BAM): " : "(SAM): "));
       output_msg += (outfile == "-" ? "[stdout]" : outfile);
       print_with_time(output_msg.c_str());
 
@@ -2213,12 +4995,84 @@ abismal(int argc, const char **argv) {
         print_with_time("map statistics (YAML): " + stats_outfile);
     }
 
+    if (!trace_file.empty()) thread_trace::start();
+
     AbismalIndex abismal_index;
 
+    // several indexes are combined into one, and reads are mapped to
+    // all of them at once
+    vector<string> index_files, index_labels, header_comments;
+    reference_counts refs;
+
+    // an index made in shards is mapped to one shard at a time, with
+    // positions in the genome of all shards
+    index_shards shards;
+    ChromLookup all_cl;
+    vector<uint32_t> shard_offsets;
+
     const double start_time = omp_get_wtime();
+    const double trace_index_start = thread_trace::now();
     if (!index_file.empty()) {
-      if (VERBOSE) print_with_time("loading index " + index_file);
-      abismal_index.read(index_file);
+      parse_index_files(index_file, index_files, index_labels);
+      for (size_t i = 0; i < index_files.size(); ++i)
+        if (shards.read(index_files[i])) {
+          if (index_files.size() > 1)
+            throw runtime_error("index shards cannot be combined with "
+                                "other indexes: " + index_files[i]);
+          if (outfile == "-")
+            throw runtime_error("an output file (-o) is required with "
+                                "index shards");
+          if (!checkpoint_file.empty())
+            throw runtime_error("checkpoints are not available with "
+                                "index shards");
+          if (growing_file::following())
+            throw runtime_error("index shards cannot be used when "
+                                "following input");
+          if (!autotune_file.empty())
+            throw runtime_error("-autotune is not available with index "
+                                "shards");
+          // a seed missing from one shard may be in another
+          if (prefilter_index)
+            throw runtime_error("the index prefilter is not available "
+                                "with index shards");
+          all_cl = shards.chrom_lookup(shard_offsets);
+          if (VERBOSE)
+            print_with_time("index shards: " + to_string(shards.files.size()));
+          index_files[0] = shards.files[0];
+        }
+      string first_seed_settings;
+      for (size_t i = 0; i < index_files.size(); ++i) {
+        if (VERBOSE) print_with_time("loading index " + index_files[i]);
+        AbismalIndex other;
+        AbismalIndex &target = (i == 0) ? abismal_index : other;
+        if (parallel_load || direct_io)
+          target.read_parallel(index_files[i], n_threads, direct_io);
+        else
+          target.read(index_files[i]);
+
+        if (i == 0) first_seed_settings = seed_settings();
+        else if (seed_settings() != first_seed_settings)
+          throw runtime_error("index built with different seeds: " +
+                              index_files[i]);
+
+        const size_t n_seqs = target.cl.names.size() - 2;
+        if (i > 0) {
+          rename_duplicate_sequences(abismal_index.cl, index_labels[i],
+                                     other.cl);
+          refs.starts.push_back(abismal_index.genome.size() * 16);
+          abismal_index.append(other);
+        }
+        else refs.starts.push_back(0);
+        header_comments.push_back("reference: " + index_labels[i] +
+                                  ", index: " + index_files[i] +
+                                  ", sequences: " + to_string(n_seqs));
+      }
+      // a single index is reported as before
+      if (index_files.size() > 1) {
+        refs.labels = index_labels;
+        refs.n_unique.resize(index_labels.size(), 0);
+      }
+      else header_comments.clear();
 
       if (VERBOSE)
         print_with_time("loading time: " +
@@ -2231,6 +5085,27 @@ abismal(int argc, const char **argv) {
         print_with_time("indexing time: " +
                         format_time_in_sec(omp_get_wtime() - start_time));
     }
+    thread_trace::span(index_file.empty() ? "build_index" : "load_index",
+                       trace_index_start, thread_trace::now());
+
+    // indexes built with a smaller window can map shorter reads, and
+    // spaced seeds need a longer span of the read
+    ReadLoader::min_read_length = seed::span_two + seed::window_size - 1;
+    if (VERBOSE && (seed::window_size != seed::default_window_size ||
+                    seed::is_spaced()))
+      print_with_time("index window: " + to_string(seed::window_size) +
+                      ", minimum read length: " +
+                      to_string(ReadLoader::min_read_length));
+
+    if (lock_index) {
+      const double lock_start = omp_get_wtime();
+      if (!abismal_index.lock_in_memory())
+        print_with_time("[WARNING] index could not be locked in memory, "
+                        "check the limit given by ulimit -l");
+      if (VERBOSE)
+        print_with_time("pre-fault time: " +
+                        format_time_in_sec(omp_get_wtime() - lock_start));
+    }
 
     if (max_candidates != 0) {
       print_with_time("manually setting max_candidates to " +
@@ -2238,57 +5113,318 @@ abismal(int argc, const char **argv) {
       abismal_index.max_candidates = max_candidates;
     }
 
+    if (prefilter_index) {
+      read_prefilter::build(abismal_index);
+      if (VERBOSE)
+        print_with_time("prefilter buckets present: " +
+                        to_string(100.0 * read_prefilter::fill()) + "%");
+    }
+
+    buffer_usage usage;
+
+    // declared before the output, so it outlives the output file
+    io_thread_pool io_pool(n_io_threads);
+
+    // maps the reads in r1 (and r2) to the output o
+    const auto map_reads = [&](const string &r1, const string &r2,
+                               const AbismalIndex &index, se_map_stats &se,
+                               pe_map_stats &pe, map_checkpoint &c,
+                               bamxx::bam_header &h, bamxx::bam_out &o,
+                               output_stats &os) {
+      if (!paired_end) {
+        if (GA_conversion || pbat_mode)
+          run_single_ended<a_rich, false>(VERBOSE, show_progress, allow_ambig,
+                                          r1, index, se, h, o, c,
+                                          io_pool.get(), locality_cache_size,
+                                          usage, os);
+        else if (random_pbat)
+          run_single_ended<t_rich, true>(VERBOSE, show_progress, allow_ambig,
+                                         r1, index, se, h, o, c,
+                                         io_pool.get(), locality_cache_size,
+                                         usage, os);
+        else
+          run_single_ended<t_rich, false>(VERBOSE, show_progress, allow_ambig,
+                                          r1, index, se, h, o, c,
+                                          io_pool.get(), locality_cache_size,
+                                          usage, os);
+      }
+      else {
+        if (pbat_mode)
+          run_paired_ended<a_rich, false>(
+            VERBOSE, show_progress, allow_ambig, r1, r2, index, pe, h, o, c,
+            io_pool.get(), locality_cache_size, usage, os);
+        else if (random_pbat)
+          run_paired_ended<t_rich, true>(
+            VERBOSE, show_progress, allow_ambig, r1, r2, index, pe, h, o, c,
+            io_pool.get(), locality_cache_size, usage, os);
+        else
+          run_paired_ended<t_rich, false>(
+            VERBOSE, show_progress, allow_ambig, r1, r2, index, pe, h, o, c,
+            io_pool.get(), locality_cache_size, usage, os);
+      }
+    };
+
+
+    if (!autotune_file.empty()) {
+      tuned_settings start;
+      start.n_threads = n_threads;
+      start.batch_size = ReadLoader::batch_size;
+      start.max_candidates = abismal_index.max_candidates;
+      start.band_width = AbismalAlignSimple::max_off_diag;
+      start.compress_level = compress_level;
+
+      // interleaved input keeps both ends of each pair in one sample
+      const string sample_file1 = autotune_file + ".sample_1.fq";
+      const string sample_file2 =
+        (paired_end && !interleaved) ? autotune_file + ".sample_2.fq" : "";
+      const string sample_outfile = autotune_file + ".sample.out";
+      const auto remove_sample = [&]() {
+        std::remove(sample_file1.c_str());
+        if (!sample_file2.empty()) std::remove(sample_file2.c_str());
+        std::remove(sample_outfile.c_str());
+      };
+
+      bamxx::bam_header sample_hdr;
+      if (abismal_make_sam_header(abismal_index.cl, header_comments, argc,
+                                  argv, sample_hdr) < 0)
+        throw runtime_error("error formatting header");
+
+      vector<autotune_trial> trials;
+      tuned_settings best;
+      size_t n_sample = 0;
+      try {
+        n_sample = write_autotune_sample(
+                     reads_file, sample_file1,
+                     (interleaved ? 2 : 1) * autotune_reads, io_pool.get()) /
+                   (interleaved ? 2 : 1);
+        if (!sample_file2.empty() &&
+            write_autotune_sample(reads_file2, sample_file2, autotune_reads,
+                                  io_pool.get()) != n_sample)
+          throw runtime_error("reads files have different numbers of reads");
+        if (n_sample == 0)
+          throw runtime_error("no reads to sample in: " + reads_file);
+        if (VERBOSE)
+          print_with_time("autotune sample: " + to_string(n_sample) +
+                          (paired_end ? " pairs" : " reads") + "\n" +
+                          "trials: threads, batch_size, max_candidates, "
+                          "band_width, compress_level, reads_per_sec, "
+                          "percent_mapped, output_bytes");
+        const auto map_sample = [&](se_map_stats &se, pe_map_stats &pe,
+                                    bamxx::bam_out &o, output_stats &os) {
+          map_checkpoint c;
+          map_reads(sample_file1, sample_file2, abismal_index, se, pe, c,
+                    sample_hdr, o, os);
+        };
+        best = autotune(VERBOSE, start, n_sample, write_bam_fmt,
+                        sample_outfile, abismal_index, sample_hdr,
+                        io_pool.get(), map_sample, trials);
+      }
+      catch (const runtime_error &) {
+        remove_sample();
+        throw;
+      }
+      remove_sample();
+
+      std::ofstream config(autotune_file);
+      config << "# abismal -autotune: " << n_sample
+             << (paired_end ? " pairs" : " reads") << " of " << reads_file
+             << (sample_file2.empty() ? "" : " " + reads_file2) << endl
+             << "# threads\tbatch_size\tmax_candidates\tband_width\t"
+             << "compress_level\treads_per_sec\tpercent_mapped\t"
+             << "output_bytes" << endl;
+      for (size_t i = 0; i < trials.size(); ++i)
+        config << "# " << trials[i].tostring() << endl;
+      config << best.tostring(write_bam_fmt || compact_output::enabled);
+      if (!config)
+        throw runtime_error("failed to write config file: " + autotune_file);
+      if (VERBOSE)
+        print_with_time("settings written to: " + autotune_file);
+      return EXIT_SUCCESS;
+    }
+
     // avoiding opening the stats output file until mapping is done
     se_map_stats se_stats;
     pe_map_stats pe_stats;
+    se_stats.refs = refs;
+    pe_stats.set_references(refs);
+
+    map_checkpoint ckpt;
+    bool resuming = false;
+    const string partial_outfile = outfile + ".partial";
+    if (!checkpoint_file.empty()) {
+      ckpt.filename = checkpoint_file;
+      ckpt.reads_file1 = reads_file;
+      ckpt.reads_file2 = reads_file2;
+      ckpt.outfile = outfile;
+      ckpt.index = index_file.empty() ? genome_file : index_file;
+      ckpt.options = mapping_options(allow_ambig, pbat_mode, random_pbat,
+                                     GA_conversion, write_bam_fmt,
+                                     prefilter_index, max_candidates);
+      ckpt.interval = max(static_cast<size_t>(1),
+                          checkpoint_interval / ReadLoader::batch_size);
+      resuming =
+        paired_end ? ckpt.load(pe_stats) : ckpt.load(se_stats);
+      if (resuming) {
+        if (VERBOSE)
+          print_with_time("resuming from checkpoint after " +
+                          to_string(ckpt.pos.n_reads) + " reads");
+        // ADS: if the partial output exists, a previous attempt to
+        // resume was interrupted, and the partial output is still good
+        if (!file_exists(partial_outfile) && file_exists(outfile) &&
+            std::rename(outfile.c_str(), partial_outfile.c_str()) != 0)
+          throw runtime_error("failed to move output file: " + outfile);
+      }
+    }
 
     bamxx::bam_out out(outfile, write_bam_fmt);
     if (!out) throw runtime_error("failed to open output file: " + outfile);
-
+    if (resuming)
+      resume_output(partial_outfile, outfile, ckpt.output_offset,
+                    write_bam_fmt, out);
+    // records are compressed and written by the pool threads, so the
+    // mapping threads only queue them inside the critical section;
+    // compact blocks are compressed by the mapping threads instead
+    if (io_pool.get() && !compact_output::enabled &&
+        hts_set_thread_pool(out.f, io_pool.get()) < 0)
+      throw runtime_error("failed to set threads for: " + outfile);
+    // level 0 gives uncompressed BGZF blocks, for piping into a sorter
+    if (compress_level >= 0 && write_bam_fmt &&
+        hts_set_opt(out.f, HTS_OPT_COMPRESSION_LEVEL, compress_level) < 0)
+      throw runtime_error("failed to set compression level for: " + outfile);
+    compact_output::compress_level = compress_level;
+    follow_output::stats_file = stats_outfile;
+
+    output_stats ostats;
+    ostats.bam = write_bam_fmt;
+    ostats.compact = compact_output::enabled;
+    ostats.compress_level = compress_level;
+
+    const double trace_header_start = thread_trace::now();
     bamxx::bam_header hdr;
-    int ret = abismal_make_sam_header(abismal_index.cl, argc, argv, hdr);
+    const ChromLookup &out_cl =
+      shards.files.empty() ? abismal_index.cl : all_cl;
+    int ret =
+      abismal_make_sam_header(out_cl, header_comments, argc, argv, hdr);
 
     if (ret < 0) throw runtime_error("error formatting header");
 
-    if (!out.write(hdr)) throw runtime_error("error writing header");
-
-    if (reads_file2.empty()) {
-      if (GA_conversion || pbat_mode)
-        run_single_ended<a_rich, false>(VERBOSE, show_progress, allow_ambig,
-                                        reads_file, abismal_index, se_stats,
-                                        hdr, out);
-      else if (random_pbat)
-        run_single_ended<t_rich, true>(VERBOSE, show_progress, allow_ambig,
-                                       reads_file, abismal_index, se_stats, hdr,
-                                       out);
-      else
-        run_single_ended<t_rich, false>(VERBOSE, show_progress, allow_ambig,
-                                        reads_file, abismal_index, se_stats,
-                                        hdr, out);
+    // a resumed output already has its header
+    if (!resuming) {
+      if (compact_output::enabled) compact_output::write_header(out, hdr);
+      else if (!out.write(hdr)) throw runtime_error("error writing header");
     }
+    thread_trace::span("header", trace_header_start, thread_trace::now());
+
+    if (shards.files.empty())
+      map_reads(reads_file, reads_file2, abismal_index, se_stats, pe_stats,
+                ckpt, hdr, out, ostats);
     else {
-      if (pbat_mode)
-        run_paired_ended<a_rich, false>(VERBOSE, show_progress, allow_ambig,
-                                        reads_file, reads_file2, abismal_index,
-                                        pe_stats, hdr, out);
-      else if (random_pbat)
-        run_paired_ended<t_rich, true>(VERBOSE, show_progress, allow_ambig,
-                                       reads_file, reads_file2, abismal_index,
-                                       pe_stats, hdr, out);
-      else
-        run_paired_ended<t_rich, false>(VERBOSE, show_progress, allow_ambig,
-                                        reads_file, reads_file2, abismal_index,
-                                        pe_stats, hdr, out);
+      // the hits of each shard are kept in the order of the input, so
+      // they can be read back along with the reads
+      vector<string> hits_files;
+      vector<FILE *> hits_in;
+      // the hits files are removed whether or not the run succeeds
+      const auto remove_hits = [&]() {
+        if (shard_hits::out) fclose(shard_hits::out);
+        shard_hits::out = nullptr;
+        for (FILE *f : hits_in)
+          if (f) fclose(f);
+        for (const string &f : hits_files) std::remove(f.c_str());
+      };
+      try {
+        for (size_t k = 0; k < shards.files.size(); ++k) {
+          if (k > 0) {
+            if (VERBOSE) print_with_time("loading index " + shards.files[k]);
+            abismal_index = AbismalIndex();
+            if (parallel_load || direct_io)
+              abismal_index.read_parallel(shards.files[k], n_threads,
+                                          direct_io);
+            else
+              abismal_index.read(shards.files[k]);
+            if (max_candidates != 0)
+              abismal_index.max_candidates = max_candidates;
+            if (lock_index && !abismal_index.lock_in_memory())
+              print_with_time(
+                "[WARNING] index could not be locked in memory");
+          }
+          hits_files.push_back(outfile + ".hits." + to_string(k));
+          shard_hits::out = fopen(hits_files.back().c_str(), "wb");
+          if (!shard_hits::out)
+            throw runtime_error("cannot open hits file: " +
+                                hits_files.back());
+          shard_hits::offset = shard_offsets[k];
+          se_map_stats shard_se_stats;
+          pe_map_stats shard_pe_stats;
+          map_checkpoint shard_ckpt;
+          shard_ckpt.in_order = true;
+          map_reads(reads_file, reads_file2, abismal_index, shard_se_stats,
+                    shard_pe_stats, shard_ckpt, hdr, out, ostats);
+          // the same reads are prefiltered in every shard
+          if (k == 0) {
+            se_stats.prefiltered_rds = shard_se_stats.prefiltered_rds;
+            pe_stats.add_prefiltered(shard_pe_stats.prefiltered_pairs);
+          }
+          const bool closed = (fclose(shard_hits::out) == 0);
+          shard_hits::out = nullptr;
+          if (!closed)
+            throw runtime_error("failed to write hits file: " +
+                                hits_files.back());
+        }
+        for (size_t k = 0; k < hits_files.size(); ++k) {
+          hits_in.push_back(fopen(hits_files[k].c_str(), "rb"));
+          if (!hits_in.back())
+            throw runtime_error("cannot open hits file: " + hits_files[k]);
+        }
+        if (paired_end)
+          merge_paired_ended(VERBOSE, show_progress, allow_ambig, all_cl,
+                             reads_file, reads_file2, hits_in, pe_stats, hdr,
+                             out, io_pool.get(), ostats);
+        else
+          merge_single_ended(VERBOSE, show_progress, allow_ambig, all_cl,
+                             reads_file, hits_in, se_stats, hdr, out,
+                             io_pool.get(), ostats);
+      }
+      catch (const runtime_error &) {
+        remove_hits();
+        throw;
+      }
+      remove_hits();
     }
 
+    if (compact_output::enabled)
+      compact_output::write(out, compact::end_block());
+
+    // waits for the blocks still being compressed by the io threads
+    const double flush_start = omp_get_wtime();
+    if (hts_flush(out.f) < 0)
+      throw runtime_error("failed to flush output file: " + outfile);
+    ostats.flush_seconds = omp_get_wtime() - flush_start;
+    if (outfile != "-") ostats.n_bytes = get_filesize(outfile);
+
+    // the run is complete, so there is nothing left to resume
+    if (ckpt.active()) ckpt.remove();
+
+    if (VERBOSE) report_memory(abismal_index, usage, leftover_args.size());
+    if (VERBOSE) alloc_trace::report(cerr);
+    // timings differ between runs, so they are only in the stats when
+    // asked for by setting the compression level
+    const bool report_output = option_given(argc, argv, "compress-level");
+    if (VERBOSE) cerr << ostats.tostring();
+    if (VERBOSE)
+      cerr << "candidates verified: " << verify_count::total << endl;
+
     if (!stats_outfile.empty()) {
       std::ofstream stats_of(stats_outfile);
       if (stats_of)
-        stats_of << (reads_file2.empty() ? se_stats.tostring()
-                                         : pe_stats.tostring(allow_ambig));
+        stats_of << (paired_end ? pe_stats.tostring(allow_ambig)
+                                : se_stats.tostring())
+                 << (report_output ? ostats.tostring() : string());
       else
         cerr << "failed to open stats output file: " << stats_outfile << endl;
     }
+
+    if (!trace_file.empty() && !thread_trace::write(trace_file))
+      throw runtime_error("failed to write trace file: " + trace_file);
   }
   catch (const runtime_error &e) {
     cerr << e.what() << endl;
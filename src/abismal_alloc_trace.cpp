@@ -0,0 +1,187 @@
+/* Copyright (C) 2018-2023 Andrew D. Smith and Guilherme Sena
+ *
+ * Authors: Andrew D. Smith and Guilherme Sena
+ *
+ * This file is part of ABISMAL.
+ *
+ * ABISMAL is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ABISMAL is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "abismal_alloc_trace.hpp"
+
+#ifdef ABISMAL_ALLOC_TRACE
+
+#include <atomic>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+
+using std::atomic;
+using std::endl;
+using std::ostream;
+using std::size_t;
+
+namespace alloc_trace {
+
+enum source { from_new, from_malloc, n_sources };
+
+// ADS: zero-initialized before any constructor runs, so allocations
+// made during static initialization are counted safely
+static atomic<size_t> counts[n_sources][n_phases][2];
+static atomic<size_t> steady_reads;
+
+static thread_local phase current_phase = other;
+static thread_local size_t thread_batches = 0;
+
+static inline void
+count(const source s) {
+  const size_t steady = (thread_batches > 0);
+  counts[s][current_phase][steady].fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+set_phase(const phase p) {
+  current_phase = p;
+}
+
+void
+batch_done(const size_t n_reads) {
+  if (thread_batches++ > 0)
+    steady_reads.fetch_add(n_reads, std::memory_order_relaxed);
+}
+
+void
+report(ostream &out) {
+  static const char *phase_names[] = {"other", "load", "map", "format",
+                                      "write"};
+  static const char *t = "    ";
+  out << "allocation trace:" << endl;
+  size_t steady_mapping = 0;
+  for (size_t p = 0; p < n_phases; ++p) {
+    size_t first = 0, steady = 0;
+    for (size_t s = 0; s < n_sources; ++s) {
+      first += counts[s][p][0];
+      steady += counts[s][p][1];
+    }
+    out << t << phase_names[p] << ":" << endl
+        << t << t << "first_batch: " << first << endl
+        << t << t << "steady_state: " << steady << endl;
+    if (p != other) steady_mapping += steady;
+  }
+  size_t total_new = 0, total_malloc = 0;
+  for (size_t p = 0; p < n_phases; ++p)
+    for (size_t k = 0; k < 2; ++k) {
+      total_new += counts[from_new][p][k];
+      total_malloc += counts[from_malloc][p][k];
+    }
+  out << t << "operator_new: " << total_new << endl
+      << t << "malloc: " << total_malloc << endl
+      << t << "steady_state_reads: " << steady_reads << endl
+      << t << "allocations_per_read: " << std::fixed << std::setprecision(3)
+      << (steady_reads > 0 ? static_cast<double>(steady_mapping) / steady_reads
+                           : 0.0)
+      << endl;
+}
+
+}  // namespace alloc_trace
+
+#ifdef __GLIBC__
+// glibc keeps these entry points so malloc can be wrapped without
+// looking up the next symbol with dlsym
+extern "C" {
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void __libc_free(void *);
+
+void *
+malloc(size_t n) {
+  alloc_trace::count(alloc_trace::from_malloc);
+  return __libc_malloc(n);
+}
+
+void *
+calloc(size_t n, size_t size) {
+  alloc_trace::count(alloc_trace::from_malloc);
+  return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t n) {
+  alloc_trace::count(alloc_trace::from_malloc);
+  return __libc_realloc(ptr, n);
+}
+
+void
+free(void *ptr) {
+  __libc_free(ptr);
+}
+}
+#define raw_malloc __libc_malloc
+#define raw_free __libc_free
+#else
+// elsewhere only allocations through operator new are counted
+#define raw_malloc std::malloc
+#define raw_free std::free
+#endif
+
+// operator new goes to the unwrapped malloc so it is not counted twice
+static void *
+traced_new(const size_t n) {
+  alloc_trace::count(alloc_trace::from_new);
+  void *ptr = raw_malloc(n == 0 ? 1 : n);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void *
+operator new(size_t n) {
+  return traced_new(n);
+}
+
+void *
+operator new[](size_t n) {
+  return traced_new(n);
+}
+
+void *
+operator new(size_t n, const std::nothrow_t &) noexcept {
+  alloc_trace::count(alloc_trace::from_new);
+  return raw_malloc(n == 0 ? 1 : n);
+}
+
+void *
+operator new[](size_t n, const std::nothrow_t &) noexcept {
+  alloc_trace::count(alloc_trace::from_new);
+  return raw_malloc(n == 0 ? 1 : n);
+}
+
+void
+operator delete(void *ptr) noexcept {
+  raw_free(ptr);
+}
+
+void
+operator delete[](void *ptr) noexcept {
+  raw_free(ptr);
+}
+
+void
+operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  raw_free(ptr);
+}
+
+void
+operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  raw_free(ptr);
+}
+
+#endif
@@ -0,0 +1,67 @@
+/* Copyright (C) 2018-2023 Andrew D. Smith and Guilherme Sena
+ *
+ * Authors: Andrew D. Smith and Guilherme Sena
+ *
+ * This file is part of ABISMAL.
+ *
+ * ABISMAL is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ABISMAL is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef ABISMAL_ALLOC_TRACE_HPP
+#define ABISMAL_ALLOC_TRACE_HPP
+
+#include <cstddef>
+#include <iostream>
+
+/* Counting of heap allocations by phase of the mapping, enabled by
+ * building with ALLOC_TRACE=1 (defines ABISMAL_ALLOC_TRACE). The
+ * global operator new is replaced and, with glibc, malloc, calloc and
+ * realloc are interposed, so allocations made inside htslib are also
+ * counted. Without ABISMAL_ALLOC_TRACE these functions do nothing.
+ *
+ * The phase is kept per thread. Allocations made in the first batch
+ * of each thread are counted separately, as that is where buffers
+ * grow to their working size, and the rest are the steady state.
+ */
+namespace alloc_trace {
+
+enum phase { other, load, map, format, write, n_phases };
+
+#ifdef ABISMAL_ALLOC_TRACE
+
+// the phase of the calling thread
+void
+set_phase(const phase p);
+
+// a batch of n_reads was written by the calling thread
+void
+batch_done(const size_t n_reads);
+
+// allocation counts for each phase and per read in the steady state
+void
+report(std::ostream &out);
+
+#else
+
+inline void
+set_phase(const phase) {}
+
+inline void
+batch_done(const size_t) {}
+
+inline void
+report(std::ostream &) {}
+
+#endif
+
+}  // namespace alloc_trace
+
+#endif
@@ -0,0 +1,320 @@
+/* Copyright (C) 2018-2023 Andrew D. Smith and Guilherme Sena
+ *
+ * Authors: Andrew D. Smith and Guilherme Sena
+ *
+ * This file is part of ABISMAL.
+ *
+ * ABISMAL is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ABISMAL is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef ABISMAL_COMPACT_HPP
+#define ABISMAL_COMPACT_HPP
+
+#include <zlib.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/* A compact binary format for mapped reads, for tools that only need
+ * the position, strand, conversion, CIGAR and sequence of each read.
+ * This file has all that is needed to read it, and depends only on
+ * zlib, so downstream tools can include it without HTSlib.
+ *
+ * Records are grouped in blocks, each compressed on its own by the
+ * mapping thread that formatted it. Read names and qualities are not
+ * kept, and the two ends of a pair are adjacent, first end first. All
+ * integers are little-endian.
+ *
+ * file:   magic "ABSMCMP1", uint32 n_targets, then for each target a
+ *         uint32 name length, the name and a uint64 length, followed
+ *         by blocks, the last of which has no records
+ * block:  uint32 n_records, uint32 raw bytes, uint32 stored bytes and
+ *         the stored bytes, which are not compressed if stored == raw
+ * record: int32 tid, uint32 pos (0-based), uint16 flags (as in SAM),
+ *         uint16 edit distance, uint16 n_cigar, uint8 conversion ('T'
+ *         or 'A'), uint8 unused, uint32 read length, then n_cigar
+ *         uint32 ops (as in BAM) and the sequence, 2 bases per byte
+ *         with the high 4 bits first (as in BAM)
+ */
+namespace compact {
+
+static const char magic[] = "ABSMCMP1";
+static const size_t magic_size = 8;
+static const size_t block_header_size = 12;
+static const size_t record_header_size = 20;
+
+// the 4-bit codes of BAM, where only A, C, G and T are not N
+static const char nt16_bases[] = "=ACMGRSVTWYHKDBN";
+
+inline uint8_t
+nt16_code(const char c) {
+  switch (c) {
+  case 'A': case 'a': return 1;
+  case 'C': case 'c': return 2;
+  case 'G': case 'g': return 4;
+  case 'T': case 't': return 8;
+  default: return 15;
+  }
+}
+
+inline void
+put16(std::vector<uint8_t> &v, const uint16_t x) {
+  v.push_back(x & 0xff);
+  v.push_back(x >> 8);
+}
+
+inline void
+put32(std::vector<uint8_t> &v, const uint32_t x) {
+  for (size_t i = 0; i < 32; i += 8) v.push_back((x >> i) & 0xff);
+}
+
+inline void
+put64(std::vector<uint8_t> &v, const uint64_t x) {
+  for (size_t i = 0; i < 64; i += 8) v.push_back((x >> i) & 0xff);
+}
+
+inline uint16_t
+get16(const uint8_t *p) {
+  return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+inline uint32_t
+get32(const uint8_t *p) {
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+         (static_cast<uint32_t>(p[2]) << 16) |
+         (static_cast<uint32_t>(p[3]) << 24);
+}
+
+inline uint64_t
+get64(const uint8_t *p) {
+  return static_cast<uint64_t>(get32(p)) |
+         (static_cast<uint64_t>(get32(p + 4)) << 32);
+}
+
+struct record {
+  record(): tid(-1), pos(0), flags(0), diffs(0), conversion('T') {}
+
+  bool rc() const { return flags & 0x10; }
+  bool a_rich() const { return conversion == 'A'; }
+
+  int32_t tid;
+  uint32_t pos;
+  uint16_t flags;
+  uint16_t diffs;
+  char conversion;
+  std::vector<uint32_t> cigar;
+  std::string seq;
+};
+
+// the start of the file, with the names and lengths of the targets
+inline std::vector<uint8_t>
+file_header(const std::vector<std::string> &names,
+            const std::vector<uint64_t> &lengths) {
+  std::vector<uint8_t> v(magic, magic + magic_size);
+  put32(v, names.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    put32(v, names[i].size());
+    v.insert(end(v), begin(names[i]), end(names[i]));
+    put64(v, lengths[i]);
+  }
+  return v;
+}
+
+/* The records of one batch. Records are added to the raw bytes, and
+ * seal() makes the bytes written to the file, with the block header,
+ * so only copying them out is left for the thread that writes. A block
+ * without records ends the file, so those are not written. */
+struct block {
+  block(): n_records(0) {}
+
+  void clear() {
+    n_records = 0;
+    raw.clear();
+    sealed.clear();
+  }
+
+  void add(const int32_t tid, const uint32_t pos, const uint16_t flags,
+           const uint16_t diffs, const char conversion,
+           const uint32_t *cigar, const size_t n_cigar,
+           const std::string &seq) {
+    put32(raw, static_cast<uint32_t>(tid));
+    put32(raw, pos);
+    put16(raw, flags);
+    put16(raw, diffs);
+    put16(raw, n_cigar);
+    raw.push_back(conversion);
+    raw.push_back(0);
+    put32(raw, seq.size());
+    for (size_t i = 0; i < n_cigar; ++i) put32(raw, cigar[i]);
+    for (size_t i = 0; i < seq.size(); i += 2)
+      raw.push_back((nt16_code(seq[i]) << 4) |
+                    (i + 1 < seq.size() ? nt16_code(seq[i + 1]) : 0));
+    ++n_records;
+  }
+
+  // level 0 stores the records as they are, and -1 is the zlib default
+  void seal(const int level) {
+    sealed.clear();
+    put32(sealed, n_records);
+    put32(sealed, raw.size());
+    uLongf n_stored = 0;
+    if (level != 0 && !raw.empty()) {
+      n_stored = compressBound(raw.size());
+      sealed.resize(block_header_size + n_stored);
+      if (compress2(sealed.data() + block_header_size, &n_stored, raw.data(),
+                    raw.size(), level < 0 ? Z_DEFAULT_COMPRESSION : level) !=
+          Z_OK)
+        throw std::runtime_error("failed to compress block");
+    }
+    // records that do not shrink are kept as they are
+    if (n_stored == 0 || n_stored >= raw.size()) {
+      sealed.resize(block_header_size - 4);
+      put32(sealed, raw.size());
+      sealed.insert(end(sealed), begin(raw), end(raw));
+    }
+    else {
+      sealed.resize(block_header_size + n_stored);
+      for (size_t i = 0; i < 4; ++i)
+        sealed[block_header_size - 4 + i] = (n_stored >> (8 * i)) & 0xff;
+    }
+  }
+
+  size_t memory_bytes() const { return raw.capacity() + sealed.capacity(); }
+
+  uint32_t n_records;
+  std::vector<uint8_t> raw;
+  std::vector<uint8_t> sealed;
+};
+
+// the block with no records that ends the file
+inline std::vector<uint8_t>
+end_block() {
+  return std::vector<uint8_t>(block_header_size, 0);
+}
+
+/* Reads the records of a file one at a time, decompressing a block
+ * when the previous one is used up. The file "-" is standard input.
+ * Errors in the file throw runtime_error. */
+class reader {
+public:
+  explicit reader(const std::string &filename)
+      : f(filename == "-" ? stdin : std::fopen(filename.c_str(), "rb")),
+        n_left(0), offset(0), done(false) {
+    if (!f) throw std::runtime_error("cannot open file: " + filename);
+    try {
+      if (std::string(reinterpret_cast<const char *>(read_bytes(magic_size)),
+                      magic_size) != magic)
+        throw std::runtime_error("not a compact mapped reads file: " +
+                                 filename);
+      const uint32_t n_targets = get32(read_bytes(4));
+      for (uint32_t i = 0; i < n_targets; ++i) {
+        const uint32_t name_size = get32(read_bytes(4));
+        const uint8_t *name = read_bytes(name_size);
+        names.push_back(std::string(name, name + name_size));
+        lengths.push_back(get64(read_bytes(8)));
+      }
+    }
+    catch (const std::runtime_error &) {
+      if (f != stdin) std::fclose(f);
+      throw;
+    }
+  }
+
+  ~reader() {
+    if (f && f != stdin) std::fclose(f);
+  }
+
+  reader(const reader &) = delete;
+  reader &operator=(const reader &) = delete;
+
+  // false once the last block has been read
+  bool read(record &r) {
+    while (n_left == 0)
+      if (done || !next_block()) return false;
+    const uint8_t *p = raw.data() + offset;
+    check(record_header_size);
+    r.tid = static_cast<int32_t>(get32(p));
+    r.pos = get32(p + 4);
+    r.flags = get16(p + 8);
+    r.diffs = get16(p + 10);
+    const uint16_t n_cigar = get16(p + 12);
+    r.conversion = static_cast<char>(p[14]);
+    const uint32_t l_seq = get32(p + 16);
+    offset += record_header_size;
+    check(4 * n_cigar + (l_seq + 1) / 2);
+    p = raw.data() + offset;
+    r.cigar.resize(n_cigar);
+    for (uint16_t i = 0; i < n_cigar; ++i, p += 4) r.cigar[i] = get32(p);
+    r.seq.resize(l_seq);
+    for (uint32_t i = 0; i < l_seq; ++i)
+      r.seq[i] = nt16_bases[(i & 1) ? (p[i / 2] & 0xf) : (p[i / 2] >> 4)];
+    offset += 4 * n_cigar + (l_seq + 1) / 2;
+    --n_left;
+    return true;
+  }
+
+  std::vector<std::string> names;
+  std::vector<uint64_t> lengths;
+
+private:
+  // the next n bytes of the file, used before the first block
+  const uint8_t *read_bytes(const size_t n) {
+    stored.resize(n);
+    if (std::fread(stored.data(), 1, n, f) != n)
+      throw std::runtime_error("compact mapped reads header is truncated");
+    return stored.data();
+  }
+
+  bool next_block() {
+    uint8_t hdr[block_header_size];
+    if (std::fread(hdr, 1, block_header_size, f) != block_header_size)
+      throw std::runtime_error("compact mapped reads file is truncated");
+    n_left = get32(hdr);
+    const uint32_t n_raw = get32(hdr + 4);
+    const uint32_t n_stored = get32(hdr + 8);
+    if (n_left == 0) {
+      done = true;
+      return false;
+    }
+    stored.resize(n_stored);
+    if (std::fread(stored.data(), 1, n_stored, f) != n_stored)
+      throw std::runtime_error("compact mapped reads file is truncated");
+    if (n_stored == n_raw) raw.swap(stored);
+    else {
+      raw.resize(n_raw);
+      uLongf n_out = n_raw;
+      if (uncompress(raw.data(), &n_out, stored.data(), n_stored) != Z_OK ||
+          n_out != n_raw)
+        throw std::runtime_error("corrupt block in compact mapped reads");
+    }
+    offset = 0;
+    return true;
+  }
+
+  void check(const size_t n) const {
+    if (offset + n > raw.size())
+      throw std::runtime_error("corrupt record in compact mapped reads");
+  }
+
+  std::FILE *f;
+  std::vector<uint8_t> stored;
+  std::vector<uint8_t> raw;
+  uint32_t n_left;
+  size_t offset;
+  bool done;
+};
+
+}  // namespace compact
+
+#endif
@@ -0,0 +1,117 @@
+/* Copyright (C) 2018-2023 Andrew D. Smith and Guilherme Sena
+ *
+ * Authors: Andrew D. Smith and Guilherme Sena
+ *
+ * This file is part of ABISMAL.
+ *
+ * ABISMAL is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ABISMAL is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "abismal_trace.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace thread_trace {
+
+struct event {
+  const char *name;
+  double ts;
+  double dur;
+  int64_t batch;
+  int64_t n_reads;
+  double wait;
+};
+
+typedef std::chrono::steady_clock trace_clock;
+
+static bool active = false;
+static trace_clock::time_point start_time;
+
+// ADS: each thread appends to its own vector, and only registering a
+// new thread takes the lock
+static std::mutex threads_mutex;
+static vector<std::unique_ptr<vector<event>>> thread_events;
+static thread_local vector<event> *events = nullptr;
+
+void
+start() {
+  start_time = trace_clock::now();
+  active = true;
+}
+
+bool
+enabled() {
+  return active;
+}
+
+double
+now() {
+  if (!active) return 0.0;
+  return std::chrono::duration<double, std::micro>(trace_clock::now() -
+                                                   start_time)
+    .count();
+}
+
+void
+span(const char *name, const double start, const double end,
+     const int64_t batch, const int64_t n_reads, const double wait) {
+  if (!active) return;
+  if (events == nullptr) {
+    std::lock_guard<std::mutex> lock(threads_mutex);
+    thread_events.emplace_back(new vector<event>);
+    events = thread_events.back().get();
+  }
+  events->push_back({name, start, end - start, batch, n_reads, wait});
+}
+
+bool
+write(const string &filename) {
+  std::ofstream out(filename);
+  if (!out) return false;
+  std::lock_guard<std::mutex> lock(threads_mutex);
+  out << std::fixed << std::setprecision(3);
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  bool first = true;
+  for (size_t tid = 0; tid < thread_events.size(); ++tid) {
+    out << (first ? "" : ",") << "\n{\"name\": \"thread_name\", "
+        << "\"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+        << ", \"args\": {\"name\": \"thread " << tid << "\"}}";
+    first = false;
+    for (const event &e : *thread_events[tid]) {
+      out << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"X\", "
+          << "\"pid\": 1, \"tid\": " << tid << ", \"ts\": " << e.ts
+          << ", \"dur\": " << e.dur << ", \"args\": {";
+      string sep;
+      if (e.batch >= 0) {
+        out << "\"batch\": " << e.batch;
+        sep = ", ";
+      }
+      if (e.n_reads >= 0) {
+        out << sep << "\"reads\": " << e.n_reads;
+        sep = ", ";
+      }
+      if (e.wait >= 0.0) out << sep << "\"wait_us\": " << e.wait;
+      out << "}}";
+    }
+  }
+  out << "\n]}\n";
+  return static_cast<bool>(out);
+}
+
+}  // namespace thread_trace
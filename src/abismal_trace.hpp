@@ -0,0 +1,61 @@
+/* Copyright (C) 2018-2023 Andrew D. Smith and Guilherme Sena
+ *
+ * Authors: Andrew D. Smith and Guilherme Sena
+ *
+ * This file is part of ABISMAL.
+ *
+ * ABISMAL is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ABISMAL is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef ABISMAL_TRACE_HPP
+#define ABISMAL_TRACE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/* A timeline of what each thread is doing, written in the Chrome trace
+ * event format so it can be viewed in Perfetto or chrome://tracing.
+ * Events are kept in memory by the thread that records them, so no
+ * lock is taken while mapping, and are written once the run is done.
+ * Until start() is called, nothing is recorded and now() returns 0.
+ *
+ * The time spent waiting for a lock before a span started can be
+ * given, so lock convoys show up as the wait of the spans after them.
+ */
+namespace thread_trace {
+
+// starts recording, with times measured from this call
+void
+start();
+
+bool
+enabled();
+
+// microseconds since start()
+double
+now();
+
+// a span of the calling thread, with the batch, number of reads and
+// microseconds spent waiting as arguments when they are not negative
+void
+span(const char *name, const double start_time, const double end_time,
+     const int64_t batch = -1, const int64_t n_reads = -1,
+     const double wait = -1.0);
+
+// writes the events recorded by all threads, and returns false if the
+// file could not be written
+bool
+write(const std::string &filename);
+
+}  // namespace thread_trace
+
+#endif
@@ -31,6 +31,8 @@
 #include <stdexcept>
 #include <algorithm>
 #include <unordered_set>
+#include <numeric>
+#include <limits>
 
 using std::vector;
 using std::runtime_error;
@@ -38,6 +40,43 @@ using std::string;
 using std::cerr;
 using std::endl;
 using std::unordered_set;
+using std::to_string;
+
+// number of bases in each chromosome of a FASTA file
+static vector<size_t>
+chrom_sizes(const string &genome_file) {
+  std::ifstream in(genome_file);
+  if (!in)
+    throw runtime_error("bad genome file: " + genome_file);
+  vector<size_t> sizes;
+  string line;
+  while (getline(in, line))
+    if (line[0] == '>') sizes.push_back(0);
+    else if (!sizes.empty()) sizes.back() += line.size();
+  return sizes;
+}
+
+// splits the chromosomes, in order, into ranges of similar total size,
+// each with at least one chromosome; range i is from bounds[i] up to
+// bounds[i + 1]. A range ends where the middle of the next chromosome
+// would pass its share of the genome.
+static vector<size_t>
+shard_bounds(const vector<size_t> &sizes, size_t n_shards) {
+  n_shards = std::min(n_shards, sizes.size());
+  const size_t total = std::accumulate(begin(sizes), end(sizes), size_t(0));
+  vector<size_t> bounds(1, 0);
+  size_t so_far = 0;
+  for (size_t i = 0; i + 1 < sizes.size(); ++i) {
+    so_far += sizes[i];
+    const size_t chroms_left = sizes.size() - (i + 1);
+    if (bounds.size() < n_shards &&
+        ((2*so_far + sizes[i + 1])*n_shards >= 2*total*bounds.size() ||
+         chroms_left == n_shards - bounds.size()))
+      bounds.push_back(i + 1);
+  }
+  bounds.push_back(sizes.size());
+  return bounds;
+}
 
 int
 abismalidx(int argc, const char **argv) {
@@ -45,12 +84,41 @@ abismalidx(int argc, const char **argv) {
   try {
     bool VERBOSE = false;
     size_t n_threads = 1;
+    bool compress = false;
+    string cost_model = "counts";
+    uint32_t window_size = seed::default_window_size;
+    bool spaced_seeds = false;
+    string seed_pattern;
+    string seed_pattern_three;
+    string profile_file;
+    size_t n_shards = 1;
 
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "build abismal index",
                            "<genome-fasta> <abismal-index-file>", 2);
     opt_parse.set_show_defaults();
     opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
+    opt_parse.add_opt("compress", '\0', "write a compressed index, "
+                      "decompressed in parallel when loaded", false, compress);
+    opt_parse.add_opt("cost-model", '\0', "seed cost model: counts or "
+                      "calibrated (benchmark lookups on this machine)",
+                      false, cost_model);
+    opt_parse.add_opt("window", 'w', "window with at least one indexed "
+                      "position; smaller maps shorter reads, 1 keeps all",
+                      false, window_size);
+    opt_parse.add_opt("spaced-seeds", '\0', "use spaced seeds, which "
+                      "tolerate mismatches better", false, spaced_seeds);
+    opt_parse.add_opt("seed-pattern", '\0', "two-letter spaced seed "
+                      "(1 = hashed, 0 = skipped; implies -spaced-seeds)",
+                      false, seed_pattern);
+    opt_parse.add_opt("seed-pattern-three", '\0', "three-letter spaced "
+                      "seed (implies -spaced-seeds)", false,
+                      seed_pattern_three);
+    opt_parse.add_opt("profile", '\0', "time and peak memory of each "
+                      "phase of the build (YAML)", false, profile_file);
+    opt_parse.add_opt("shards", '\0', "split the genome into this many "
+                      "indexes of whole chromosomes, listed in the output "
+                      "file, to map with less memory", false, n_shards);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
 
     vector<string> leftover_args;
@@ -73,22 +141,97 @@ abismalidx(int argc, const char **argv) {
     }
     const string genome_file = leftover_args.front();
     const string outfile = leftover_args.back();
+    if (cost_model != "counts" && cost_model != "calibrated")
+      throw runtime_error("unknown cost model: " + cost_model);
+    if (window_size == 0 || window_size > seed::default_window_size)
+      throw runtime_error("window must be between 1 and " +
+                          std::to_string(seed::default_window_size));
     /****************** END COMMAND LINE OPTIONS *****************/
 
     omp_set_num_threads(n_threads);
     const double start_time = omp_get_wtime();
     AbismalIndex::VERBOSE = VERBOSE;
+    seed::window_size = window_size;
+    if (spaced_seeds || !seed_pattern.empty() || !seed_pattern_three.empty())
+      seed::set_patterns(
+        seed_pattern.empty() ? seed::default_pattern_two : seed_pattern,
+        seed_pattern_three.empty() ? seed::default_pattern_three
+                                   : seed_pattern_three);
 
     /****************** START BUILDING INDEX *************/
-    AbismalIndex abismal_index;
-    abismal_index.create_index(genome_file);
+    // a single index is the one shard of the whole genome
+    vector<size_t> bounds = {0, std::numeric_limits<size_t>::max()};
+    if (n_shards > 1)
+      bounds = shard_bounds(chrom_sizes(genome_file), n_shards);
+    const bool sharded = (bounds.size() > 2);
+
+    index_shards shards;
+    vector<build_phase> phases;
+    size_t genome_size = 0;
+    size_t index_bytes = 0;
+    for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+      const string index_file =
+        sharded ? outfile + "." + to_string(i) : outfile;
+      if (VERBOSE && sharded)
+        cerr << "[shard " << i << ": chromosomes " << bounds[i] + 1
+             << " to " << bounds[i + 1] << "]" << endl;
 
-    if (VERBOSE)
-      cerr << "[writing abismal index to: " << outfile << "]\n";
+      AbismalIndex abismal_index;
+      abismal_index.calibrate_costs = (cost_model == "calibrated");
+      abismal_index.create_index(genome_file, bounds[i], bounds[i + 1]);
 
-    abismal_index.write(outfile);
-    if (VERBOSE)
+      if (VERBOSE)
+        cerr << "[writing abismal index to: " << index_file << "]\n";
+
+      const double write_start = omp_get_wtime();
+      if (compress)
+        abismal_index.write_compressed(index_file);
+      else
+        abismal_index.write(index_file, n_threads);
+      abismal_index.end_build_phase("write", write_start);
+
+      // phases of all shards are added up, keeping the largest peak
+      for (const build_phase &p : abismal_index.build_phases) {
+        auto it = std::find_if(begin(phases), end(phases),
+                               [&p](const build_phase &q) {
+                                 return q.name == p.name;
+                               });
+        if (it == end(phases)) phases.push_back(p);
+        else {
+          it->seconds += p.seconds;
+          it->peak_rss = std::max(it->peak_rss, p.peak_rss);
+        }
+      }
+      genome_size += abismal_index.cl.get_genome_size();
+      index_bytes += get_filesize(index_file);
+      shards.files.push_back(index_file);
+    }
+    if (sharded)
+      shards.write(outfile);
+
+    if (!profile_file.empty()) {
+      std::ofstream profile(profile_file);
+      if (!profile)
+        throw runtime_error("failed to open profile file: " + profile_file);
+      profile << "genome_size: " << genome_size << endl
+              << "threads: " << n_threads << endl;
+      if (sharded)
+        profile << "shards: " << shards.files.size() << endl;
+      profile << "phases:" << endl;
+      for (const build_phase &p : phases)
+        profile << "    " << p.name << ":" << endl
+                << "        seconds: " << p.seconds << endl
+                << "        peak_rss: " << p.peak_rss << endl;
+      profile << "total_seconds: " << omp_get_wtime() - start_time << endl
+              << "peak_rss: " << get_peak_rss() << endl
+              << "index_bytes: " << index_bytes << endl;
+    }
+    if (VERBOSE) {
       cerr << "[total indexing time: " << omp_get_wtime() - start_time << "]" << endl;
+      cerr << "[index file size: " << index_bytes << " bytes, "
+           << "minimum read length: "
+           << seed::span_two + seed::window_size - 1 << "]" << endl;
+    }
     /****************** END BUILDING INDEX *************/
 
   }
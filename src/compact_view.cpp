@@ -0,0 +1,56 @@
+/* Copyright (C) 2018-2023 Andrew D. Smith and Guilherme Sena
+ *
+ * Authors: Andrew D. Smith and Guilherme Sena
+ *
+ * This file is part of ABISMAL.
+ *
+ * ABISMAL is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ABISMAL is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Prints the records of a compact output file with only the fields of
+ * SAM it keeps: RNAME, POS, FLAG, CIGAR and SEQ, then the NM and CV
+ * tags. Used by the tests to check the reader of abismal_compact.hpp
+ * against the SAM output, and depends on nothing but that header. */
+
+#include "abismal_compact.hpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+
+int
+main(int argc, const char **argv) {
+  if (argc != 2) {
+    std::cerr << "usage: " << argv[0] << " <compact-file>" << std::endl;
+    return EXIT_FAILURE;
+  }
+  static const char cigar_ops[] = "MIDNSHP=X";
+  try {
+    compact::reader in(argv[1]);
+    compact::record r;
+    while (in.read(r)) {
+      if (r.tid < 0 || static_cast<size_t>(r.tid) >= in.names.size())
+        throw std::runtime_error("bad target id: " + std::to_string(r.tid));
+      std::cout << in.names[r.tid] << '\t' << r.pos + 1 << '\t' << r.flags
+                << '\t';
+      for (size_t i = 0; i < r.cigar.size(); ++i)
+        std::cout << (r.cigar[i] >> 4) << cigar_ops[r.cigar[i] & 0xf];
+      if (r.cigar.empty()) std::cout << '*';
+      std::cout << '\t' << r.seq << '\t' << "NM:i:" << r.diffs << '\t'
+                << "CV:A:" << r.conversion << '\n';
+    }
+  }
+  catch (const std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
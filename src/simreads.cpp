@@ -384,10 +384,220 @@ extract_change_type_vals(const string &change_type_vals,
 }
 
 
+/* Synthetic genomes for stress-testing the seeds. The background is
+ * random sequence with a given GC content, in which a fraction of the
+ * CpGs are turned into CpA, as happens by deamination in mammalian
+ * genomes. Copies of interspersed repeat families (like transposons)
+ * and tandem arrays (like satellites) are written over the background,
+ * each copy diverged from its consensus by random substitutions, so
+ * the genome size does not depend on the repeats. Everything comes
+ * from simreads_random, so a seed always gives the same genome.
+ */
+struct GenomeSimulator {
+  double gc_content;
+  double cpg_ratio;  // observed over expected CpG frequency
+
+  char
+  background_base(const char prev) const {
+    const double gc = gc_content/2.0;
+    const double x = simreads_random::rand_double();
+    const char b = (x < gc) ? 'C' : (x < 2*gc) ? 'G' :
+                   (x < 2*gc + (1.0 - 2*gc)/2.0) ? 'A' : 'T';
+    if (prev == 'C' && b == 'G' &&
+        simreads_random::rand_double() >= cpg_ratio)
+      return 'A';
+    return b;
+  }
+
+  string
+  background(const size_t len) const {
+    string seq(len, 'N');
+    char prev = 'N';
+    for (size_t i = 0; i < len; ++i)
+      prev = seq[i] = background_base(prev);
+    return seq;
+  }
+
+  // a copy with each base substituted with probability divergence
+  static string
+  diverged_copy(const string &consensus, const double divergence) {
+    static const string bases = "ACGT";
+    string copy(consensus);
+    for (size_t i = 0; i < copy.size(); ++i)
+      if (simreads_random::rand_double() < divergence) {
+        const size_t b = bases.find(copy[i]);
+        copy[i] = bases[(b + 1 + simreads_random::rand() % 3) % 4];
+      }
+    return copy;
+  }
+
+  // write seq over a random position of a random chromosome, clipped
+  // at the end of the chromosome; returns the bases written
+  static size_t
+  insert(vector<string> &chroms, const string &seq) {
+    string &chrom = chroms[simreads_random::rand() % chroms.size()];
+    if (chrom.empty()) return 0;
+    const size_t pos = simreads_random::rand() % chrom.size();
+    const size_t len = std::min(seq.size(), chrom.size() - pos);
+    chrom.replace(pos, len, seq, 0, len);
+    return len;
+  }
+};
+
+
+static int
+simgenome(int argc, const char **argv) {
+  try {
+    bool VERBOSE = false;
+    size_t genome_size = 1000000;
+    size_t n_chroms = 1;
+    size_t n_families = 10;
+    size_t family_length = 300;
+    size_t n_copies = 100;
+    double divergence = 0.1;
+    size_t n_tandem = 0;
+    size_t tandem_unit = 171;
+    size_t tandem_copies = 100;
+    double tandem_divergence = 0.02;
+    double gc_content = 0.41;
+    double cpg_ratio = 0.2;
+    size_t rng_seed = std::numeric_limits<size_t>::max();
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse("simreads genome", "simulate a genome with "
+                           "repeats", "<output-fasta>", 1);
+    opt_parse.set_show_defaults();
+    opt_parse.add_opt("size", 'g', "genome size", false, genome_size);
+    opt_parse.add_opt("chroms", 'C', "number of chromosomes", false,
+                      n_chroms);
+    opt_parse.add_opt("families", 'f', "interspersed repeat families",
+                      false, n_families);
+    opt_parse.add_opt("family-len", '\0', "length of each repeat family",
+                      false, family_length);
+    opt_parse.add_opt("copies", 'c', "copies of each repeat family", false,
+                      n_copies);
+    opt_parse.add_opt("divergence", 'd', "fraction of bases changed in "
+                      "each repeat copy", false, divergence);
+    opt_parse.add_opt("tandem", 't', "number of tandem arrays", false,
+                      n_tandem);
+    opt_parse.add_opt("tandem-unit", '\0', "length of the tandem repeat "
+                      "unit", false, tandem_unit);
+    opt_parse.add_opt("tandem-copies", '\0', "units in each tandem array",
+                      false, tandem_copies);
+    opt_parse.add_opt("tandem-divergence", '\0', "fraction of bases "
+                      "changed in each tandem unit", false,
+                      tandem_divergence);
+    opt_parse.add_opt("gc", '\0', "GC content before CpG depletion", false,
+                      gc_content);
+    opt_parse.add_opt("cpg", '\0', "CpG observed/expected ratio", false,
+                      cpg_ratio);
+    opt_parse.add_opt("seed", '\0', "rng seed (default: from system)",
+                      false, rng_seed);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.size() != 1) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    const string outfile(leftover_args.front());
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    if (n_chroms == 0 || genome_size < n_chroms)
+      throw runtime_error("genome size must be at least one base per "
+                          "chromosome");
+    if (gc_content < 0.0 || gc_content > 1.0 || cpg_ratio < 0.0 ||
+        cpg_ratio > 1.0 || divergence < 0.0 || divergence > 1.0 ||
+        tandem_divergence < 0.0 || tandem_divergence > 1.0)
+      throw runtime_error("GC content, CpG ratio and divergence must be "
+                          "between 0 and 1");
+
+    if (rng_seed == std::numeric_limits<size_t>::max())
+      rng_seed = time(0) + getpid();
+    if (VERBOSE)
+      cerr << "rng seed: " << rng_seed << endl;
+    simreads_random::initialize(rng_seed);
+
+    const GenomeSimulator sim = {gc_content, cpg_ratio};
+
+    if (VERBOSE)
+      cerr << "[simulating background]" << endl;
+    vector<string> chroms(n_chroms);
+    for (size_t i = 0; i < n_chroms; ++i)
+      chroms[i] = sim.background(genome_size/n_chroms +
+                                 (i < genome_size % n_chroms));
+
+    if (VERBOSE)
+      cerr << "[inserting interspersed repeats]" << endl;
+    size_t interspersed_bases = 0;
+    for (size_t i = 0; i < n_families; ++i) {
+      const string consensus = sim.background(family_length);
+      for (size_t j = 0; j < n_copies; ++j) {
+        string copy = GenomeSimulator::diverged_copy(consensus, divergence);
+        if (simreads_random::rand() % 2) revcomp_inplace(copy);
+        interspersed_bases += GenomeSimulator::insert(chroms, copy);
+      }
+    }
+
+    if (VERBOSE)
+      cerr << "[inserting tandem arrays]" << endl;
+    size_t tandem_bases = 0;
+    for (size_t i = 0; i < n_tandem; ++i) {
+      const string unit = sim.background(tandem_unit);
+      string array;
+      for (size_t j = 0; j < tandem_copies; ++j)
+        array += GenomeSimulator::diverged_copy(unit, tandem_divergence);
+      tandem_bases += GenomeSimulator::insert(chroms, array);
+    }
+
+    if (VERBOSE)
+      cerr << "[writing genome: " << outfile << "]" << endl
+           << "interspersed repeat bases: " << interspersed_bases << endl
+           << "tandem repeat bases: " << tandem_bases << endl;
+    ofstream out(outfile);
+    if (!out)
+      throw runtime_error("bad output file: " + outfile);
+    static const size_t line_width = 80;
+    for (size_t i = 0; i < n_chroms; ++i) {
+      out << ">chr" << i + 1 << endl;
+      for (size_t j = 0; j < chroms[i].size(); j += line_width)
+        out << chroms[i].substr(j, line_width) << endl;
+    }
+    if (!out)
+      throw runtime_error("failed writing: " + outfile);
+  }
+  catch (const runtime_error &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::bad_alloc &ba) {
+    cerr << "ERROR: could not allocate memory" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+
 int
 simreads(int argc, const char **argv) {
 
   try {
+    // simulate a genome instead of reads from one
+    if (argc > 1 && string(argv[1]) == "genome")
+      return simgenome(argc - 1, argv + 1);
+
     string chrom_file;
     string output_prefix;
     string locations_file;
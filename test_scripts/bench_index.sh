@@ -0,0 +1,53 @@
+#!/usr/bin/env bash
+#
+# Builds indexes for synthetic genomes of increasing size and repeat
+# content, and tabulates the time and peak memory of each phase of
+# abismalidx, to see which phase limits scaling.
+#
+# usage: bench_index.sh <abismalidx> [output-dir]
+#
+# The genomes are made by `simreads genome`, with a fraction of each
+# genome written over by copies of repeat families with 2% divergence
+# (overlapping copies make the fraction slightly lower). Set
+# BENCH_SIZES (in Mbp), BENCH_REPEATS (fractions) and BENCH_THREADS to
+# change what is run.
+
+set -e
+
+abismalidx=${1:?usage: bench_index.sh <abismalidx> [output-dir]}
+simreads=$(dirname "${abismalidx}")/simreads
+outdir=${2:-bench_index}
+sizes=${BENCH_SIZES:-"1 4 16 64"}
+repeats=${BENCH_REPEATS:-"0 0.25 0.5"}
+threads=${BENCH_THREADS:-1}
+
+mkdir -p "${outdir}"
+results="${outdir}/results.tsv"
+echo -e "size_mbp\trepeat_fraction\tphase\tseconds\tpeak_rss" > "${results}"
+
+for size in ${sizes}; do
+    for repeat in ${repeats}; do
+        name="${outdir}/genome_${size}M_${repeat}"
+        if [[ ! -e "${name}.fa" ]]; then
+            # 300bp repeat families, each with 20 copies per Mbp
+            n_families=$(awk -v r=${repeat} 'BEGIN {print int(1e6*r/6000)}')
+            "${simreads}" genome -seed 1 -g $((size*1000000)) -C 4 \
+                          -f ${n_families} -c $((20*size)) -d 0.02 \
+                          "${name}.fa"
+        fi
+        "${abismalidx}" -t ${threads} -profile "${name}.yaml" \
+                        "${name}.fa" "${name}.idx"
+        rm -f "${name}.idx"
+        # phases are the entries indented by 4 spaces in the profile
+        awk -v size=${size} -v repeat=${repeat} '
+            /^    [a-z_]+:$/ {phase = substr($1, 1, length($1) - 1)}
+            /^        seconds:/ {secs = $2}
+            /^        peak_rss:/ {print size "\t" repeat "\t" phase "\t" \
+                                        secs "\t" $2}
+            /^total_seconds:/ {total = $2}
+            /^peak_rss:/ {print size "\t" repeat "\ttotal\t" total "\t" $2}
+        ' "${name}.yaml" >> "${results}"
+    done
+done
+
+column -t "${results}"